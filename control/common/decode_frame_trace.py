@@ -0,0 +1,95 @@
+#!/usr/bin/env python3
+#
+
+# Copyright 2021 Kaloian Manassiev
+#
+# Permission is hereby granted, free of charge, to any person obtaining a copy of this software and
+# associated documentation files (the "Software"), to deal in the Software without restriction,
+# including without limitation the rights to use, copy, modify, merge, publish, distribute,
+# sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is
+# furnished to do so, subject to the following conditions:
+#
+# The above copyright notice and this permission notice shall be included in all copies or
+# substantial portions of the Software.
+#
+# THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT
+# NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+# NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+# DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+# OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+import argparse
+import struct
+import sys
+from collections import Counter
+
+# Must be kept in sync with `FrameTrace` in native/common/frame_trace.h
+FILE_HEADER = struct.Struct('<8sIIQ')
+EVENT = struct.Struct('<QQIHBB')
+MAGIC = b'RPTRACE\0'
+VERSION = 1
+
+STAGES = {
+    1: 'FrameClosed',
+    2: 'FrameQueued',
+    3: 'FrameSent',
+    4: 'FrameReceived',
+    5: 'FrameWritten',
+    6: 'FrameDropped',
+}
+
+parser = argparse.ArgumentParser(description="""
+Decodes a frame trace dumped by the client or server through the 'trace dump' command and prints
+it as a timeline, along with the gaps in activity, which are longer than a threshold.
+""")
+parser.add_argument('trace_file', help='Path to the dumped trace')
+parser.add_argument('--stall_us', type=int, default=10000,
+                    help='Gaps between consecutive events longer than this are reported as stalls')
+parser.add_argument('--summary', action='store_true',
+                    help='Only print the per-stage and per-thread event counts and the stalls')
+args = parser.parse_args()
+
+with open(args.trace_file, 'rb') as f:
+    data = f.read()
+
+magic, version, event_size, num_events = FILE_HEADER.unpack_from(data, 0)
+if magic != MAGIC or version != VERSION or event_size != EVENT.size:
+    sys.exit(f'{args.trace_file} is not a version {VERSION} frame trace')
+
+events = sorted(
+    EVENT.unpack_from(data, FILE_HEADER.size + i * EVENT.size) for i in range(num_events))
+if not events:
+    sys.exit('The trace is empty')
+
+start_ns = events[0][0]
+prev_ns = start_ns
+stalls = []
+
+if not args.summary:
+    print(f'{"time_us":>14} {"delta_us":>10} {"thread":>6} {"stage":<14} {"stream":>6} '
+          f'{"seq_num":>12} {"size":>6}')
+
+for (timestamp_ns, seq_num, size, stream, stage, thread) in events:
+    delta_us = (timestamp_ns - prev_ns) / 1000
+    if delta_us > args.stall_us:
+        stalls.append(((prev_ns - start_ns) / 1000, delta_us))
+        if not args.summary:
+            print(f'*** No activity for {delta_us:.0f} us')
+
+    if not args.summary:
+        print(f'{(timestamp_ns - start_ns) / 1000:>14.3f} {delta_us:>10.3f} {thread:>6} '
+              f'{STAGES.get(stage, str(stage)):<14} {stream:>6} {seq_num:>12} {size:>6}')
+
+    prev_ns = timestamp_ns
+
+duration_us = (events[-1][0] - start_ns) / 1000
+print(f'{len(events)} events over {duration_us:.0f} us')
+
+for stage, count in sorted(Counter(e[4] for e in events).items()):
+    print(f'  {STAGES.get(stage, str(stage)):<14} {count}')
+for thread, count in sorted(Counter(e[5] for e in events).items()):
+    print(f'  Thread {thread:<7} {count}')
+
+print(f'{len(stalls)} stall(s) longer than {args.stall_us} us')
+for (at_us, length_us) in stalls:
+    print(f'  At {at_us:.0f} us for {length_us:.0f} us')
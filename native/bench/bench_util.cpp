@@ -0,0 +1,161 @@
+/**
+ * Copyright 2021 Kaloian Manassiev
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software and
+ * associated documentation files (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge, publish, distribute,
+ * sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or
+ * substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT
+ * NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE. */
+
+#include "common/base.h"
+
+#include "bench/bench_util.h"
+
+#include <boost/algorithm/string.hpp>
+#include <chrono>
+#include <cstring>
+#include <netinet/ip.h>
+#include <netinet/udp.h>
+#include <sstream>
+#include <sys/socket.h>
+#include <time.h>
+
+#include "common/exception.h"
+
+namespace ruralpi {
+namespace bench {
+namespace {
+
+uint64_t clockNanos(clockid_t clock) {
+    struct timespec ts;
+    SYSCALL(::clock_gettime(clock, &ts));
+    return uint64_t(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+} // namespace
+
+uint64_t nowNanos() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+}
+
+uint64_t processCpuNanos() { return clockNanos(CLOCK_PROCESS_CPUTIME_ID); }
+
+uint64_t threadCpuNanos() { return clockNanos(CLOCK_THREAD_CPUTIME_ID); }
+
+uint16_t ipChecksum(uint8_t const *data, size_t size) {
+    uint32_t sum = 0;
+    for (size_t i = 0; i + 1 < size; i += 2)
+        sum += (data[i] << 8) | data[i + 1];
+    while (sum >> 16)
+        sum = (sum & 0xFFFF) + (sum >> 16);
+    return htons(~sum);
+}
+
+FakeTunnelQueues::FakeTunnelQueues(const std::string &desc, int numQueues) {
+    for (int i = 0; i < numQueues; i++) {
+        int fds[2];
+        SYSCALL(::socketpair(AF_UNIX, SOCK_SEQPACKET, 0, fds));
+        _inside.emplace_back(boost::str(boost::format("%s queue %d (inside)") % desc % i), fds[0]);
+        _outside.emplace_back(boost::str(boost::format("%s queue %d (outside)") % desc % i),
+                              fds[1]);
+    }
+}
+
+std::vector<FileDescriptor> FakeTunnelQueues::inside() const {
+    return std::vector<FileDescriptor>(_inside.begin(), _inside.end());
+}
+
+void FakeTunnelQueues::shutdown() {
+    for (auto &fd : _outside)
+        ::shutdown(fd, SHUT_RDWR);
+}
+
+PacketSizeMix PacketSizeMix::parse(const std::string &spec) {
+    PacketSizeMix mix;
+    std::vector<double> weights;
+
+    std::vector<std::string> tokens;
+    boost::split(tokens, spec, boost::is_any_of(","));
+    for (auto &token : tokens) {
+        boost::trim(token);
+
+        try {
+            auto colon = token.find(':');
+            mix._sizes.push_back(std::stoul(token.substr(0, colon)));
+            weights.push_back(colon == std::string::npos ? 1 : std::stod(token.substr(colon + 1)));
+        } catch (const std::exception &) {
+            throw Exception(boost::format("Invalid packet size mix '%s'") % spec);
+        }
+
+        if (mix._sizes.back() < kMinProbeDatagramSize || mix._sizes.back() > 65535)
+            throw Exception(boost::format("Packet size %d in '%s' must be between %d and 65535") %
+                            mix._sizes.back() % spec % kMinProbeDatagramSize);
+    }
+
+    mix._distribution = std::discrete_distribution<size_t>(weights.begin(), weights.end());
+    return mix;
+}
+
+size_t PacketSizeMix::next(std::mt19937 &rng) { return _sizes[_distribution(rng)]; }
+
+size_t PacketSizeMix::maxSize() const { return *std::max_element(_sizes.begin(), _sizes.end()); }
+
+std::string PacketSizeMix::toString() const {
+    std::stringstream ss;
+    auto probabilities = _distribution.probabilities();
+    for (size_t i = 0; i < _sizes.size(); i++)
+        ss << (i ? ", " : "") << _sizes[i] << " bytes (" << int(probabilities[i] * 100) << "%)";
+    return ss.str();
+}
+
+void makeProbeDatagram(uint8_t *buf, size_t size, uint32_t flow, uint64_t seqNum) {
+    RASSERT(size >= kMinProbeDatagramSize);
+
+    auto &ip = *((iphdr *)buf);
+    memset(&ip, 0, sizeof(ip));
+    ip.version = 4;
+    ip.ihl = 5;
+    ip.ttl = 64;
+    ip.protocol = IPPROTO_UDP;
+    ip.tot_len = htons(size);
+    ip.saddr = htonl(0x0A000001);
+    ip.daddr = htonl(0x0A010000 | (flow & 0xFFFF));
+    ip.check = ipChecksum(buf, sizeof(ip));
+
+    auto &udp = *((udphdr *)(buf + sizeof(ip)));
+    udp.source = htons(10000 + (flow % 50000));
+    udp.dest = htons(5001);
+    udp.len = htons(size - sizeof(ip));
+    udp.check = 0;
+
+    DatagramProbe probe{flow, seqNum, nowNanos()};
+    memcpy(buf + sizeof(ip) + sizeof(udp), &probe, sizeof(probe));
+    memset(buf + kMinProbeDatagramSize, 0x5A, size - kMinProbeDatagramSize);
+}
+
+bool readProbeDatagram(uint8_t const *data, size_t size, DatagramProbe *probe) {
+    if (size < kMinProbeDatagramSize)
+        return false;
+
+    const auto &ip = *((iphdr const *)data);
+    if (ip.version != 4 || ip.protocol != IPPROTO_UDP ||
+        ((udphdr const *)(data + sizeof(iphdr)))->dest != htons(5001))
+        return false;
+
+    memcpy(probe, data + sizeof(iphdr) + sizeof(udphdr), sizeof(*probe));
+    return true;
+}
+
+} // namespace bench
+} // namespace ruralpi
@@ -0,0 +1,119 @@
+/**
+ * Copyright 2021 Kaloian Manassiev
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software and
+ * associated documentation files (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge, publish, distribute,
+ * sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or
+ * substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT
+ * NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE. */
+
+#pragma once
+
+#include <random>
+#include <string>
+#include <vector>
+
+#include "common/file_descriptor.h"
+
+namespace ruralpi {
+namespace bench {
+
+/**
+ * Returns the current time of the monotonic clock in nanoseconds.
+ */
+uint64_t nowNanos();
+
+/**
+ * Returns the CPU time consumed so far by the entire process and by the calling thread
+ * respectively, in nanoseconds.
+ */
+uint64_t processCpuNanos();
+uint64_t threadCpuNanos();
+
+/**
+ * Returns the checksum of an IPv4 header of `size` bytes (with its checksum field set to zero) in
+ * network byte order.
+ */
+uint16_t ipChecksum(uint8_t const *data, size_t size);
+
+/**
+ * Stands in for the queues of a tunnel device, without requiring root. Each queue is a pair of
+ * connected SOCK_SEQPACKET sockets (which, like the tunnel device, preserve the datagram
+ * boundaries). The inside end is given to the `TunnelProducerConsumer` and the benchmark writes
+ * and reads datagrams on the outside end, which is the side of the kernel networking stack.
+ */
+class FakeTunnelQueues {
+public:
+    FakeTunnelQueues(const std::string &desc, int numQueues);
+
+    std::vector<FileDescriptor> inside() const;
+    FileDescriptor &outside(int idx) { return _outside[idx]; }
+
+    size_t size() const { return _outside.size(); }
+
+    /**
+     * Shuts down both directions of all queues, which wakes up anybody blocked on them.
+     */
+    void shutdown();
+
+private:
+    std::vector<ScopedFileDescriptor> _inside;
+    std::vector<ScopedFileDescriptor> _outside;
+};
+
+/**
+ * Weighted mix of datagram sizes, specified as "size:weight,size:weight,...". For example the
+ * default, "64:7,576:4,1500:1", is the simple IMIX.
+ */
+class PacketSizeMix {
+public:
+    static PacketSizeMix parse(const std::string &spec);
+
+    size_t next(std::mt19937 &rng);
+
+    size_t maxSize() const;
+
+    std::string toString() const;
+
+private:
+    std::vector<size_t> _sizes;
+    std::discrete_distribution<size_t> _distribution;
+};
+
+/**
+ * Payload of the datagrams generated by the benchmarks, which allows the receiving side to measure
+ * the one-way latency and the loss and reordering per flow.
+ */
+struct DatagramProbe {
+    uint32_t flow;
+    uint64_t seqNum;
+    uint64_t sentAtNanos;
+} __attribute__((packed));
+
+// Size of the smallest datagram which can carry a probe (IPv4 and UDP headers and the probe)
+constexpr size_t kMinProbeDatagramSize = 20 + 8 + sizeof(DatagramProbe);
+
+/**
+ * Writes to `buf` an IPv4/UDP datagram of `size` bytes for the specified flow, carrying a probe
+ * with the current time. The flows differ by destination address and source port, so that they are
+ * spread over the tunnel queues.
+ */
+void makeProbeDatagram(uint8_t *buf, size_t size, uint32_t flow, uint64_t seqNum);
+
+/**
+ * Returns whether `data` is a datagram created by `makeProbeDatagram` and if so, extracts its
+ * probe.
+ */
+bool readProbeDatagram(uint8_t const *data, size_t size, DatagramProbe *probe);
+
+} // namespace bench
+} // namespace ruralpi
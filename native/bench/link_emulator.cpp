@@ -0,0 +1,339 @@
+/**
+ * Copyright 2021 Kaloian Manassiev
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software and
+ * associated documentation files (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge, publish, distribute,
+ * sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or
+ * substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT
+ * NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE. */
+
+#include "common/base.h"
+
+#include "bench/link_emulator.h"
+
+#include <boost/algorithm/string.hpp>
+#include <map>
+#include <sstream>
+
+#include "common/exception.h"
+
+namespace ruralpi {
+namespace bench {
+namespace {
+
+using namespace std::chrono_literals;
+
+const std::map<std::string, std::string> kPresets{
+    {"dsl", "bw=20mbit,delay=15ms,jitter=2ms,loss=0.1%"},
+    {"4g", "bw=30mbit,delay=40ms,jitter=15ms,loss=1%,outage=20s/1500ms+5s"},
+    {"satellite", "bw=10mbit,delay=300ms,jitter=10ms,loss=0.5%"},
+};
+
+/**
+ * Parses `value` as a number followed by one of the suffixes in `units` (the first one of which is
+ * the default if there is no suffix) and returns it multiplied by the unit's factor.
+ */
+double parseWithUnits(const std::string &spec, const std::string &value,
+                      const std::vector<std::pair<std::string, double>> &units) {
+    size_t end;
+    double number;
+    try {
+        number = std::stod(value, &end);
+    } catch (const std::exception &) {
+        throw Exception(boost::format("Invalid value '%s' in link spec '%s'") % value % spec);
+    }
+
+    const auto suffix = value.substr(end);
+    if (suffix.empty())
+        return number * units.front().second;
+    for (const auto &[unit, factor] : units) {
+        if (boost::iequals(suffix, unit))
+            return number * factor;
+    }
+    throw Exception(boost::format("Invalid unit '%s' in link spec '%s'") % suffix % spec);
+}
+
+std::chrono::microseconds parseTime(const std::string &spec, const std::string &value) {
+    return std::chrono::microseconds(
+        int64_t(parseWithUnits(spec, value, {{"ms", 1e3}, {"us", 1}, {"s", 1e6}})));
+}
+
+std::string formatTime(std::chrono::microseconds t) {
+    return boost::str(boost::format("%gms") % (t.count() / 1e3));
+}
+
+} // namespace
+
+LinkProfile LinkProfile::parse(const std::string &spec) {
+    LinkProfile profile;
+    profile.name = spec;
+
+    std::vector<std::string> tokens;
+    boost::split(tokens, spec, boost::is_any_of(","));
+    for (size_t i = 0; i < tokens.size(); i++) {
+        auto token = boost::trim_copy(tokens[i]);
+        auto equals = token.find('=');
+
+        if (equals == std::string::npos) {
+            auto it = kPresets.find(boost::to_lower_copy(token));
+            if (i != 0 || it == kPresets.end())
+                throw Exception(boost::format("Unknown link preset '%s' in link spec '%s'") %
+                                token % spec);
+
+            std::vector<std::string> presetTokens;
+            boost::split(presetTokens, it->second, boost::is_any_of(","));
+            tokens.insert(tokens.begin() + i + 1, presetTokens.begin(), presetTokens.end());
+            continue;
+        }
+
+        const auto key = token.substr(0, equals);
+        const auto value = token.substr(equals + 1);
+
+        if (key == "bw") {
+            profile.bitsPerSecond =
+                parseWithUnits(spec, value, {{"mbit", 1e6}, {"kbit", 1e3}, {"gbit", 1e9}});
+        } else if (key == "delay") {
+            profile.delay = parseTime(spec, value);
+        } else if (key == "jitter") {
+            profile.jitter = parseTime(spec, value);
+        } else if (key == "loss") {
+            profile.lossRate = boost::ends_with(value, "%")
+                                   ? parseWithUnits(spec, value.substr(0, value.size() - 1),
+                                                    {{"", 0.01}})
+                                   : parseWithUnits(spec, value, {{"", 1}});
+            if (profile.lossRate < 0 || profile.lossRate >= 1)
+                throw Exception(boost::format("Invalid loss rate '%s' in link spec '%s'") % value %
+                                spec);
+        } else if (key == "outage") {
+            auto slash = value.find('/');
+            auto plus = value.find('+');
+            if (slash == std::string::npos)
+                throw Exception(boost::format("Invalid outage schedule '%s' in link spec '%s'") %
+                                value % spec);
+
+            profile.outagePeriod = parseTime(spec, value.substr(0, slash));
+            profile.outageDuration = parseTime(spec, value.substr(slash + 1, plus - slash - 1));
+            profile.outageOffset = plus == std::string::npos
+                                       ? std::chrono::microseconds(0)
+                                       : parseTime(spec, value.substr(plus + 1));
+            if (profile.outageDuration >= profile.outagePeriod)
+                throw Exception(
+                    boost::format("Outage in link spec '%s' must be shorter than its period") %
+                    spec);
+        } else if (key == "queue") {
+            profile.queueBytes =
+                parseWithUnits(spec, value, {{"", 1}, {"k", 1024}, {"m", 1 << 20}});
+        } else {
+            throw Exception(boost::format("Unknown key '%s' in link spec '%s'") % key % spec);
+        }
+    }
+
+    if (!profile.queueBytes) {
+        const double maxDelaySeconds = (profile.delay + profile.jitter).count() / 1e6;
+        profile.queueBytes = 65536 + size_t(profile.bitsPerSecond / 8 * maxDelaySeconds);
+    }
+
+    return profile;
+}
+
+std::string LinkProfile::toString() const {
+    std::stringstream ss;
+    ss << name << ": ";
+    if (bitsPerSecond)
+        ss << boost::format("%g Mbit/s, ") % (bitsPerSecond / 1e6);
+    else
+        ss << "unlimited, ";
+    ss << "delay " << formatTime(delay) << ", jitter " << formatTime(jitter) << ", loss "
+       << boost::format("%g%%") % (lossRate * 100);
+    if (outagePeriod.count())
+        ss << ", down for " << formatTime(outageDuration) << " every " << formatTime(outagePeriod);
+    return ss.str();
+}
+
+std::chrono::nanoseconds LinkProfile::outageRemaining(std::chrono::nanoseconds sinceStart) const {
+    if (!outagePeriod.count() || sinceStart < outageOffset)
+        return std::chrono::nanoseconds(0);
+
+    const auto phase = (sinceStart - outageOffset) % outagePeriod;
+    if (phase >= outageDuration)
+        return std::chrono::nanoseconds(0);
+
+    return outageDuration - phase;
+}
+
+std::string LinkEmulator::Stats::toString() const {
+    return boost::str(boost::format("%d bytes in %d segments (%d lost, %d held by outages)") %
+                      bytes % segments % segmentsLost % segmentsHeldByOutage);
+}
+
+LinkEmulator::LinkEmulator(LinkProfile profile, ScopedFileDescriptor a, ScopedFileDescriptor b,
+                           uint32_t seed)
+    : _profile(std::move(profile)),
+      _createdAt(Clock::now()),
+      _a(std::move(a)),
+      _b(std::move(b)),
+      _aToB(std::make_unique<Direction>(*this, _a, _b, seed * 2)),
+      _bToA(std::make_unique<Direction>(*this, _b, _a, seed * 2 + 1)) {}
+
+LinkEmulator::~LinkEmulator() {
+    // Wakes up the readers, which are blocked on the sockets
+    ::shutdown(_a, SHUT_RDWR);
+    ::shutdown(_b, SHUT_RDWR);
+
+    _aToB.reset();
+    _bToA.reset();
+}
+
+LinkEmulator::Clock::time_point LinkEmulator::afterOutage(Clock::time_point t) const {
+    return t + _profile.outageRemaining(t - _createdAt);
+}
+
+LinkEmulator::Direction::Direction(const LinkEmulator &link, FileDescriptor src,
+                                   FileDescriptor dst, uint32_t seed)
+    : _link(link),
+      _src(std::move(src)),
+      _dst(std::move(dst)),
+      _rng(seed),
+      _reader([this] { readerThread(); }),
+      _writer([this] { writerThread(); }) {}
+
+LinkEmulator::Direction::~Direction() {
+    {
+        std::lock_guard lg(_mutex);
+        _srcClosed = true;
+        _dstClosed = true;
+        _cv.notify_all();
+    }
+
+    _reader.join();
+    _writer.join();
+}
+
+LinkEmulator::Stats LinkEmulator::Direction::stats() const {
+    return {_bytes.load(), _numSegments.load(), _numSegmentsLost.load(),
+            _numSegmentsHeldByOutage.load()};
+}
+
+void LinkEmulator::Direction::readerThread() {
+    std::vector<uint8_t> buf(kSegmentSize);
+
+    while (true) {
+        {
+            // Blocking here (instead of queueing without bound) is what pushes back on the sender,
+            // like the buffers of a real link would
+            std::unique_lock ul(_mutex);
+            _cv.wait(ul, [&] {
+                return _dstClosed || !_queuedBytes ||
+                       _queuedBytes + kSegmentSize <= _link._profile.queueBytes;
+            });
+            if (_dstClosed)
+                break;
+        }
+
+        const int size = ::read(_src, buf.data(), buf.size());
+        if (size <= 0)
+            break;
+
+        Segment segment{scheduleSegment(Clock::now(), size), {buf.begin(), buf.begin() + size}};
+
+        std::lock_guard lg(_mutex);
+        _queuedBytes += size;
+        _segments.emplace_back(std::move(segment));
+        _cv.notify_all();
+    }
+
+    std::lock_guard lg(_mutex);
+    _srcClosed = true;
+    _cv.notify_all();
+}
+
+void LinkEmulator::Direction::writerThread() {
+    std::unique_lock ul(_mutex);
+
+    while (true) {
+        _cv.wait(ul, [&] { return _dstClosed || _srcClosed || !_segments.empty(); });
+        if (_dstClosed || _segments.empty())
+            break;
+
+        const auto deliverAt = _segments.front().deliverAt;
+        if (_cv.wait_until(ul, deliverAt, [&] { return _dstClosed; }))
+            break;
+
+        auto segment = std::move(_segments.front());
+        _segments.pop_front();
+
+        ul.unlock();
+
+        bool sent = true;
+        for (size_t offset = 0; offset < segment.data.size();) {
+            const int size = ::send(_dst, segment.data.data() + offset,
+                                    segment.data.size() - offset, MSG_NOSIGNAL);
+            if (size <= 0) {
+                sent = false;
+                break;
+            }
+            offset += size;
+        }
+
+        ul.lock();
+
+        _queuedBytes -= segment.data.size();
+        _cv.notify_all();
+
+        if (!sent)
+            break;
+    }
+
+    // Propagate the closing of the stream to the other side
+    _dstClosed = true;
+    _cv.notify_all();
+    ::shutdown(_dst, SHUT_WR);
+}
+
+LinkEmulator::Clock::time_point LinkEmulator::Direction::scheduleSegment(Clock::time_point now,
+                                                                         size_t size) {
+    const auto &profile = _link._profile;
+
+    // Serialisation, which can only start once the link is up and done with the previous segments
+    auto startAt = std::max(now, _linkFreeAt);
+    const auto upAt = _link.afterOutage(startAt);
+    if (upAt != startAt) {
+        ++_numSegmentsHeldByOutage;
+        startAt = upAt;
+    }
+
+    _linkFreeAt = startAt;
+    if (profile.bitsPerSecond)
+        _linkFreeAt += std::chrono::nanoseconds(int64_t(size * 8 * 1e9 / profile.bitsPerSecond));
+
+    // Propagation
+    auto deliverAt = _linkFreeAt + profile.delay;
+    if (profile.jitter.count())
+        deliverAt += std::chrono::microseconds(
+            std::uniform_int_distribution<int64_t>(0, profile.jitter.count())(_rng));
+    if (profile.lossRate && std::bernoulli_distribution(profile.lossRate)(_rng)) {
+        ++_numSegmentsLost;
+        deliverAt += 2 * profile.delay;
+    }
+
+    // The stream is delivered in order, so a segment can't overtake the ones before it
+    deliverAt = std::max(deliverAt, _lastDeliverAt);
+    _lastDeliverAt = deliverAt;
+
+    _bytes += size;
+    ++_numSegments;
+
+    return deliverAt;
+}
+
+} // namespace bench
+} // namespace ruralpi
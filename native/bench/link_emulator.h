@@ -0,0 +1,191 @@
+/**
+ * Copyright 2021 Kaloian Manassiev
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software and
+ * associated documentation files (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge, publish, distribute,
+ * sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or
+ * substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT
+ * NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE. */
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "common/file_descriptor.h"
+
+namespace ruralpi {
+namespace bench {
+
+/**
+ * Characteristics of an emulated uplink. Can be parsed from a preset name ("dsl", "4g" or
+ * "satellite"), followed by an optional list of key=value overrides, or from overrides only, for
+ * example "4g,loss=2%" or "bw=5mbit,delay=300ms,jitter=20ms":
+ *
+ *  bw=<N>[kbit|mbit|gbit]: Bandwidth in each direction (0 means unlimited)
+ *  delay=<T>: One-way propagation delay
+ *  jitter=<T>: Additional delay, uniformly distributed between 0 and T
+ *  loss=<P>[%]: Probability that a segment is lost and has to be retransmitted
+ *  outage=<PERIOD>/<DURATION>[+<OFFSET>]: The link goes down for DURATION every PERIOD, starting
+ *      OFFSET after the emulator is created
+ *  queue=<N>[k|m]: Bytes, which may be in flight or queued on the link before the sender is blocked
+ *      (by default the bandwidth-delay product plus 64KB)
+ *
+ * Times are specified as <N>[us|ms|s].
+ */
+struct LinkProfile {
+    static LinkProfile parse(const std::string &spec);
+
+    std::string toString() const;
+
+    /**
+     * Returns for how much longer the link is down at `sinceStart` after the start of the emulation
+     * or zero if it is up at that time.
+     */
+    std::chrono::nanoseconds outageRemaining(std::chrono::nanoseconds sinceStart) const;
+
+    std::string name;
+
+    double bitsPerSecond{0};
+    std::chrono::microseconds delay{0};
+    std::chrono::microseconds jitter{0};
+    double lossRate{0};
+
+    std::chrono::microseconds outagePeriod{0};
+    std::chrono::microseconds outageDuration{0};
+    std::chrono::microseconds outageOffset{0};
+
+    size_t queueBytes{0};
+};
+
+/**
+ * Stream proxy, which sits between the two ends of a `TunnelFrameStream` (such as a client and a
+ * server socket) and shapes the traffic going through it in each direction according to a
+ * `LinkProfile`.
+ *
+ * The emulation works on segments of up to `kSegmentSize` bytes: each one is serialised at the
+ * link's bandwidth (which queues the ones behind it), held back while the link is in an outage and
+ * then delivered after the delay and jitter. Since the stream must be delivered in order, a lost
+ * segment is modelled as one which is delayed by an additional round trip (like a fast
+ * retransmission) and holds back all the segments behind it.
+ *
+ * The pseudo-random decisions are seeded with `seed`, so runs with the same traffic are
+ * repeatable.
+ */
+class LinkEmulator {
+public:
+    static constexpr size_t kSegmentSize = 1448;
+
+    /**
+     * Starts proxying between `a` (which is connected to one end of the stream) and `b` (which is
+     * connected to the other one). The proxying stops when either end closes the stream or when
+     * the emulator is destroyed.
+     */
+    LinkEmulator(LinkProfile profile, ScopedFileDescriptor a, ScopedFileDescriptor b,
+                 uint32_t seed);
+    ~LinkEmulator();
+
+    const LinkProfile &profile() const { return _profile; }
+
+    struct Stats {
+        uint64_t bytes{0};
+        uint64_t segments{0};
+        uint64_t segmentsLost{0};
+        uint64_t segmentsHeldByOutage{0};
+
+        std::string toString() const;
+    };
+
+    /**
+     * Statistics for the direction from `a` to `b` and from `b` to `a` respectively.
+     */
+    Stats statsAToB() const { return _aToB->stats(); }
+    Stats statsBToA() const { return _bToA->stats(); }
+
+private:
+    using Clock = std::chrono::steady_clock;
+
+    class Direction {
+    public:
+        Direction(const LinkEmulator &link, FileDescriptor src, FileDescriptor dst, uint32_t seed);
+        ~Direction();
+
+        Stats stats() const;
+
+    private:
+        void readerThread();
+        void writerThread();
+
+        struct Segment {
+            Clock::time_point deliverAt;
+            std::vector<uint8_t> data;
+        };
+
+        /**
+         * Returns the time at which the segment, which was read at `now`, must be delivered.
+         */
+        Clock::time_point scheduleSegment(Clock::time_point now, size_t size);
+
+        const LinkEmulator &_link;
+
+        FileDescriptor _src;
+        FileDescriptor _dst;
+
+        std::mt19937 _rng;
+
+        // Time at which the link will be done serialising the segments scheduled so far and the
+        // delivery time of the last of them
+        Clock::time_point _linkFreeAt;
+        Clock::time_point _lastDeliverAt;
+
+        mutable std::mutex _mutex;
+        std::condition_variable _cv;
+        std::deque<Segment> _segments;
+        size_t _queuedBytes{0};
+        bool _srcClosed{false};
+        bool _dstClosed{false};
+
+        std::atomic<uint64_t> _bytes{0};
+        std::atomic<uint64_t> _numSegments{0};
+        std::atomic<uint64_t> _numSegmentsLost{0};
+        std::atomic<uint64_t> _numSegmentsHeldByOutage{0};
+
+        std::thread _reader;
+        std::thread _writer;
+    };
+
+    /**
+     * Returns `t` if the link is up at that time or the time at which the outage, during which `t`
+     * falls, ends.
+     */
+    Clock::time_point afterOutage(Clock::time_point t) const;
+
+    const LinkProfile _profile;
+    const Clock::time_point _createdAt;
+
+    ScopedFileDescriptor _a;
+    ScopedFileDescriptor _b;
+
+    std::unique_ptr<Direction> _aToB;
+    std::unique_ptr<Direction> _bToA;
+};
+
+} // namespace bench
+} // namespace ruralpi
@@ -0,0 +1,437 @@
+/**
+ * Copyright 2021 Kaloian Manassiev
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software and
+ * associated documentation files (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge, publish, distribute,
+ * sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or
+ * substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT
+ * NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE. */
+
+#include "common/base.h"
+
+#include <boost/log/core.hpp>
+#include <boost/log/expressions.hpp>
+#include <boost/log/trivial.hpp>
+#include <boost/program_options.hpp>
+#include <boost/uuid/random_generator.hpp>
+#include <iostream>
+#include <netinet/in.h>
+#include <thread>
+
+#include "bench/bench_util.h"
+#include "bench/link_emulator.h"
+#include "bench/traffic.h"
+#include "common/exception.h"
+#include "common/ip_parsers.h"
+#include "common/metrics.h"
+#include "common/socket_producer_consumer.h"
+#include "common/tunnel_producer_consumer.h"
+
+namespace ruralpi {
+namespace bench {
+namespace {
+
+namespace po = boost::program_options;
+
+// MTU of the fake tunnel devices
+constexpr int kMTU = 1500;
+
+struct Options {
+    double seconds;
+    int queues;
+    int streams;
+    int flows;
+    uint64_t pps;
+    bool tcp;
+    int zerocopyMinBytes;
+    PacketSizeMix sizes;
+
+    // Same as the client/server option
+    int transformThreads{0};
+
+    // If not empty, each stream goes through an emulated link with the respective profile
+    std::vector<LinkProfile> links;
+
+    // If set, the datagrams come from this source instead of the probe generators and are
+    // accounted per flow
+    std::shared_ptr<TrafficSource> traffic;
+    size_t flowReport{0};
+};
+
+/**
+ * Returns a connected pair of stream sockets, either a UNIX socketpair or a loopback TCP
+ * connection.
+ */
+std::pair<ScopedFileDescriptor, ScopedFileDescriptor> makeStream(int idx, bool tcp) {
+    const auto desc = boost::str(boost::format("Stream %d") % idx);
+
+    if (!tcp) {
+        int fds[2];
+        SYSCALL(::socketpair(AF_UNIX, SOCK_STREAM, 0, fds));
+        return {ScopedFileDescriptor(desc + " (client)", fds[0]),
+                ScopedFileDescriptor(desc + " (server)", fds[1])};
+    }
+
+    ScopedFileDescriptor listener(desc + " (listener)", ::socket(AF_INET, SOCK_STREAM, 0));
+    struct sockaddr_in addr = {0};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t addrLen = sizeof(addr);
+    SYSCALL(::bind(listener, (struct sockaddr *)&addr, sizeof(addr)));
+    SYSCALL(::getsockname(listener, (struct sockaddr *)&addr, &addrLen));
+    SYSCALL(::listen(listener, 1));
+
+    ScopedFileDescriptor client(desc + " (client)", ::socket(AF_INET, SOCK_STREAM, 0));
+    SYSCALL(::connect(client, (struct sockaddr *)&addr, sizeof(addr)));
+    ScopedFileDescriptor server(desc + " (server)", ::accept(listener, nullptr, nullptr));
+
+    return {std::move(client), std::move(server)};
+}
+
+/**
+ * Per-thread results of the traffic generators and sinks.
+ */
+struct ThreadResult {
+    uint64_t packets{0};
+    uint64_t bytes{0};
+    uint64_t cpuNanos{0};
+};
+
+void run(const Options &options) {
+    boost::uuids::basic_random_generator<boost::mt19937> uuidGen;
+
+    std::cout << "Pushing "
+              << (options.traffic ? options.traffic->toString()
+                                  : boost::str(boost::format("%s datagrams over %d flows") %
+                                               options.sizes.toString() % options.flows))
+              << ", " << options.queues << " tunnel queue(s) and " << options.streams << ' '
+              << (options.tcp ? "loopback TCP" : "UNIX socketpair") << " stream(s) for "
+              << options.seconds << " seconds"
+              << (options.pps && !options.traffic ? boost::str(boost::format(" at %d pps") %
+                                                               options.pps)
+                                                  : "")
+              << std::endl;
+
+    FakeTunnelQueues clientQueues("Client", options.queues);
+    FakeTunnelQueues serverQueues("Server", options.queues);
+
+    TunnelProducerConsumer clientTunnelPC("client", clientQueues.inside(), kMTU);
+    TunnelProducerConsumer serverTunnelPC("server", serverQueues.inside(), kMTU);
+
+    std::vector<int> streamFds;
+    std::vector<std::unique_ptr<LinkEmulator>> links;
+    std::vector<ThreadResult> generated(options.queues), delivered(options.queues);
+    Histogram latencyNanos;
+    FlowRecorder flowRecorder;
+
+    // How long it takes for the datagrams in flight to be delivered
+    Milliseconds drainTime(200);
+    for (const auto &link : options.links)
+        drainTime = std::max(drainTime, std::chrono::duration_cast<Milliseconds>(
+                                            4 * (link.delay + link.jitter) + link.outageDuration));
+
+    {
+        SocketProducerConsumer clientSocketPC("client", uuidGen(), clientTunnelPC, CpuAffinity(),
+                                              options.transformThreads);
+        SocketProducerConsumer serverSocketPC("server", boost::none, serverTunnelPC, CpuAffinity(),
+                                              options.transformThreads);
+
+        for (int i = 0; i < options.streams; i++) {
+            auto [client, server] = makeStream(i, options.tcp);
+            if (!options.links.empty()) {
+                // Insert the link emulator in the middle of the stream
+                auto [linkEnd, linkServer] = makeStream(i, options.tcp);
+                links.push_back(std::make_unique<LinkEmulator>(options.links[i], std::move(server),
+                                                               std::move(linkEnd), i));
+                server = std::move(linkServer);
+            }
+            streamFds.push_back(client);
+            streamFds.push_back(server);
+            clientSocketPC.addSocket({std::move(client), size_t(options.zerocopyMinBytes)});
+            serverSocketPC.addSocket({std::move(server), size_t(options.zerocopyMinBytes)});
+        }
+
+        // Let the initial exchange complete, so that no datagrams are dropped while the session
+        // is being established
+        std::this_thread::sleep_for(std::max(Milliseconds(500), drainTime));
+
+        std::atomic_bool stopGenerating{false};
+        std::vector<std::thread> threads;
+
+        // Sinks, which read the datagrams which came out of the server's tunnel device
+        for (int i = 0; i < options.queues; i++) {
+            threads.emplace_back([&, i] {
+                auto &result = delivered[i];
+                uint8_t buf[65536];
+                while (true) {
+                    const int size = ::read(serverQueues.outside(i), buf, sizeof(buf));
+                    if (size <= 0)
+                        break;
+
+                    if (options.traffic) {
+                        auto latency = flowRecorder.onDelivered(buf, size, nowNanos());
+                        if (!latency)
+                            continue;
+                        latencyNanos.record(*latency);
+                    } else {
+                        DatagramProbe probe;
+                        if (!readProbeDatagram(buf, size, &probe))
+                            continue;
+                        latencyNanos.record(nowNanos() - probe.sentAtNanos);
+                    }
+                    ++result.packets;
+                    result.bytes += size;
+                }
+                result.cpuNanos = threadCpuNanos();
+            });
+        }
+
+        const uint64_t startedAtNanos = nowNanos();
+        const uint64_t startedAtCpuNanos = processCpuNanos();
+
+        // Generator, which writes the datagrams of the traffic source into the client's tunnel
+        // device, each one on the queue of its flow (like the kernel does)
+        std::atomic_bool trafficExhausted{false};
+        if (options.traffic) {
+            threads.emplace_back([&] {
+                auto &result = generated[0];
+                Packet packet;
+                const uint64_t cpuNanosBefore = threadCpuNanos();
+
+                while (!stopGenerating.load() && options.traffic->next(packet)) {
+                    const uint64_t sendAtNanos = startedAtNanos + packet.sendAtNanos;
+                    for (uint64_t now = nowNanos(); now < sendAtNanos && !stopGenerating.load();
+                         now = nowNanos()) {
+                        if (sendAtNanos - now > 2000000)
+                            std::this_thread::sleep_for(Milliseconds(1));
+                        else
+                            std::this_thread::yield();
+                    }
+
+                    const auto &data = packet.data;
+                    const int queue = IP::flowHash(data.data(), data.size()) % options.queues;
+                    flowRecorder.onSent(data.data(), data.size(), nowNanos());
+                    if (::write(clientQueues.outside(queue), data.data(), data.size()) !=
+                        ssize_t(data.size()))
+                        break;
+
+                    ++result.packets;
+                    result.bytes += data.size();
+                }
+                result.cpuNanos = threadCpuNanos() - cpuNanosBefore;
+                trafficExhausted.store(true);
+            });
+        }
+
+        // Generators, which write probe datagrams into the client's tunnel device, each one on a
+        // queue of its own
+        for (int i = 0; i < options.queues && !options.traffic; i++) {
+            threads.emplace_back([&, i] {
+                auto &result = generated[i];
+                auto sizes = options.sizes;
+                std::mt19937 rng(i);
+                std::vector<uint8_t> buf(options.sizes.maxSize());
+                const uint64_t intervalNanos =
+                    options.pps ? 1000000000 * options.queues / options.pps : 0;
+                const uint64_t cpuNanosBefore = threadCpuNanos();
+
+                uint64_t nextAtNanos = nowNanos();
+                for (uint64_t seqNum = 0; !stopGenerating.load(); seqNum++) {
+                    if (intervalNanos) {
+                        while (nowNanos() < nextAtNanos)
+                            std::this_thread::yield();
+                        nextAtNanos += intervalNanos;
+                    }
+
+                    const size_t size = sizes.next(rng);
+                    const uint32_t flow = (seqNum * options.queues + i) % options.flows;
+                    makeProbeDatagram(buf.data(), size, flow, seqNum);
+                    if (::write(clientQueues.outside(i), buf.data(), size) != ssize_t(size))
+                        break;
+
+                    ++result.packets;
+                    result.bytes += size;
+                }
+                result.cpuNanos = threadCpuNanos() - cpuNanosBefore;
+            });
+        }
+
+        const uint64_t stopAtNanos = startedAtNanos + options.seconds * 1e9;
+        while (nowNanos() < stopAtNanos && !trafficExhausted.load())
+            std::this_thread::sleep_for(Milliseconds(10));
+        stopGenerating.store(true);
+        const double elapsedSeconds = (nowNanos() - startedAtNanos) / 1e9;
+
+        // Give the datagrams which are still in flight a chance to be delivered
+        auto numDelivered = [&] {
+            uint64_t packets = 0;
+            for (auto &result : delivered)
+                packets += result.packets;
+            return packets;
+        };
+        for (uint64_t lastDelivered = -1; lastDelivered != numDelivered();) {
+            lastDelivered = numDelivered();
+            std::this_thread::sleep_for(drainTime);
+        }
+        const uint64_t cpuNanos = processCpuNanos() - startedAtCpuNanos;
+
+        // Wake up all the threads blocked on the fake tunnel devices and the streams
+        clientQueues.shutdown();
+        serverQueues.shutdown();
+        for (int fd : streamFds)
+            ::shutdown(fd, SHUT_RDWR);
+        for (auto &thread : threads)
+            thread.join();
+
+        ThreadResult totalGenerated, totalDelivered;
+        for (int i = 0; i < options.queues; i++) {
+            totalGenerated.packets += generated[i].packets;
+            totalGenerated.bytes += generated[i].bytes;
+            totalGenerated.cpuNanos += generated[i].cpuNanos;
+            totalDelivered.packets += delivered[i].packets;
+            totalDelivered.bytes += delivered[i].bytes;
+            totalDelivered.cpuNanos += delivered[i].cpuNanos;
+        }
+
+        // The CPU time of the generators and sinks is not part of the cost of the tunnel
+        const uint64_t tunnelCpuNanos =
+            cpuNanos - std::min(cpuNanos, totalGenerated.cpuNanos + totalDelivered.cpuNanos);
+        const auto latency = latencyNanos.snapshot();
+
+        std::cout << boost::format("Generated: %d datagrams, %d bytes\n") % totalGenerated.packets %
+                         totalGenerated.bytes
+                  << boost::format("Delivered: %d datagrams, %d bytes (%.3f%% lost)\n") %
+                         totalDelivered.packets % totalDelivered.bytes %
+                         (totalGenerated.packets ? 100.0 *
+                                                       (totalGenerated.packets -
+                                                        std::min(totalGenerated.packets,
+                                                                 totalDelivered.packets)) /
+                                                       totalGenerated.packets
+                                                 : 0.0)
+                  << boost::format("Throughput: %.3f Mpps, %.3f Gbps\n") %
+                         (totalDelivered.packets / elapsedSeconds / 1e6) %
+                         (totalDelivered.bytes * 8 / elapsedSeconds / 1e9)
+                  << boost::format("Latency (us): p50 %.1f, p99 %.1f, p999 %.1f, max %.1f\n") %
+                         (latency.quantile(0.5) / 1e3) % (latency.quantile(0.99) / 1e3) %
+                         (latency.quantile(0.999) / 1e3) % (latency.quantile(1.0) / 1e3)
+                  << boost::format("Tunnel CPU: %.2f ns/byte, %.1f%% of a CPU\n") %
+                         (totalDelivered.bytes ? double(tunnelCpuNanos) / totalDelivered.bytes
+                                               : 0.0) %
+                         (100.0 * tunnelCpuNanos / 1e9 / elapsedSeconds);
+
+        if (options.traffic && options.flowReport) {
+            auto flows = flowRecorder.flows();
+            std::cout << boost::format("Flows (%d of %d, by bytes sent):\n") %
+                             std::min(options.flowReport, flows.size()) % flows.size()
+                      << boost::format("  %-50s %10s %8s %10s %12s %12s\n") % "Flow" % "Sent" %
+                             "Lost" % "Mbps" % "Mean (us)" % "Max (us)";
+            for (size_t i = 0; i < flows.size() && i < options.flowReport; i++) {
+                const auto &flow = flows[i];
+                std::cout << boost::format("  %-50s %10d %7.2f%% %10.3f %12.1f %12.1f\n") %
+                                 flow.desc % flow.packetsSent %
+                                 (100.0 * (flow.packetsSent - flow.packetsDelivered) /
+                                  flow.packetsSent) %
+                                 (flow.bytesDelivered * 8 / elapsedSeconds / 1e6) %
+                                 (flow.packetsDelivered
+                                      ? flow.latencySumNanos / 1e3 / flow.packetsDelivered
+                                      : 0.0) %
+                                 (flow.latencyMaxNanos / 1e3);
+            }
+        }
+
+        for (size_t i = 0; i < links.size(); i++)
+            std::cout << "Link " << i << " (" << links[i]->profile().toString() << ")\n"
+                      << "  Client to server: " << links[i]->statsAToB().toString() << '\n'
+                      << "  Server to client: " << links[i]->statsBToA().toString() << '\n';
+    }
+}
+
+} // namespace
+} // namespace bench
+} // namespace ruralpi
+
+int main(int argc, const char *argv[]) {
+    using namespace ruralpi;
+    using namespace ruralpi::bench;
+
+    po::options_description desc("RuralPipe loopback benchmark options");
+    // clang-format off
+    desc.add_options()
+        ("help", "Produces this help message")
+        ("seconds", po::value<double>()->default_value(5), "For how long to generate traffic")
+        ("queues", po::value<int>()->default_value(2), "Number of tunnel queues on each side (and traffic generator threads)")
+        ("streams", po::value<int>()->default_value(2), "Number of streams between the client and the server")
+        ("flows", po::value<int>()->default_value(64), "Number of distinct flows, over which the datagrams are spread")
+        ("pps", po::value<uint64_t>()->default_value(0), "Total rate at which to generate datagrams. The default of 0 generates as fast as the tunnel accepts them, in which case the latency is dominated by queueing.")
+        ("sizes", po::value<std::string>()->default_value("64:7,576:4,1500:1"), "Mix of datagram sizes as size:weight pairs")
+        ("tcp", po::bool_switch()->default_value(false), "Connect the streams over loopback TCP instead of UNIX socketpairs")
+        ("zerocopy_min_bytes", po::value<int>()->default_value(0), "Same as the client/server option (only applies to TCP)")
+        ("transform_threads", po::value<int>()->default_value(0), "Same as the client/server option")
+        ("link", po::value<std::vector<std::string>>()->composing(), "Emulate an uplink on a stream (may be specified multiple times, once for each stream, in which case --streams is ignored). Either a preset (dsl, 4g or satellite), optionally followed by overrides, such as '4g,loss=2%', or just the parameters, such as 'bw=5mbit,delay=300ms,jitter=20ms,loss=1%,outage=30s/2s'.")
+        ("traffic", po::value<std::string>(), "Instead of the probe datagrams, generate a mix of synthetic flows, such as 'tcp=8,voip=20,dns=2,video=2' (see SyntheticTraffic for the kinds of flows)")
+        ("replay", po::value<std::string>(), "Instead of the probe datagrams, replay the datagrams from this pcap or pcapng file")
+        ("speed", po::value<double>()->default_value(1), "Speed at which to replay the capture (0 replays it as fast as possible)")
+        ("flow_report", po::value<size_t>()->default_value(20), "How many flows to report the statistics of when using --traffic or --replay")
+        ("log", po::bool_switch()->default_value(false), "Enable the informational logging of the tunnel")
+    ;
+    // clang-format on
+
+    try {
+        po::variables_map vm;
+        po::store(po::parse_command_line(argc, argv, desc), vm);
+        po::notify(vm);
+
+        if (vm.count("help")) {
+            std::cout << desc;
+            return 1;
+        }
+
+        boost::log::core::get()->set_filter(
+            boost::log::trivial::severity >=
+            (vm["log"].as<bool>() ? boost::log::trivial::info : boost::log::trivial::warning));
+
+        Options options{vm["seconds"].as<double>(),
+                        vm["queues"].as<int>(),
+                        vm["streams"].as<int>(),
+                        vm["flows"].as<int>(),
+                        vm["pps"].as<uint64_t>(),
+                        vm["tcp"].as<bool>(),
+                        vm["zerocopy_min_bytes"].as<int>(),
+                        PacketSizeMix::parse(vm["sizes"].as<std::string>())};
+        if (vm.count("traffic") && vm.count("replay"))
+            throw Exception("Only one of --traffic and --replay can be specified");
+        if (vm.count("traffic"))
+            options.traffic =
+                std::make_shared<SyntheticTraffic>(vm["traffic"].as<std::string>(), kMTU, 1);
+        if (vm.count("replay"))
+            options.traffic = std::make_shared<PcapReplay>(vm["replay"].as<std::string>(),
+                                                           vm["speed"].as<double>(), kMTU);
+        options.flowReport = vm["flow_report"].as<size_t>();
+        options.transformThreads = vm["transform_threads"].as<int>();
+
+        if (vm.count("link")) {
+            for (const auto &spec : vm["link"].as<std::vector<std::string>>())
+                options.links.push_back(LinkProfile::parse(spec));
+            options.streams = options.links.size();
+        }
+        if (options.sizes.maxSize() > kMTU)
+            throw Exception(boost::format("Datagrams can't be larger than the MTU of %d") % kMTU);
+        if (options.queues < 1 || options.streams < 1 || options.flows < 1)
+            throw Exception("There must be at least one queue, stream and flow");
+
+        run(options);
+        return 0;
+    } catch (const std::exception &ex) {
+        std::cerr << "Benchmark failed: " << ex.what() << std::endl;
+        return 1;
+    }
+}
@@ -0,0 +1,624 @@
+/**
+ * Copyright 2021 Kaloian Manassiev
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software and
+ * associated documentation files (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge, publish, distribute,
+ * sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or
+ * substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT
+ * NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE. */
+
+#include "common/base.h"
+
+#include <boost/program_options.hpp>
+#include <boost/property_tree/json_parser.hpp>
+#include <boost/property_tree/ptree.hpp>
+#include <condition_variable>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <optional>
+#include <regex>
+#include <sys/utsname.h>
+#include <thread>
+
+#include "bench/bench_util.h"
+#include "common/exception.h"
+#include "common/metrics.h"
+#include "common/tunnel_frame.h"
+
+namespace ruralpi {
+namespace bench {
+namespace {
+
+namespace po = boost::program_options;
+
+/**
+ * Prevents the compiler from optimising away the computation of `value` or of the memory it points
+ * to.
+ */
+template <typename T>
+void doNotOptimize(T const &value) {
+    asm volatile("" : : "r,m"(value) : "memory");
+}
+
+/**
+ * Passed to the benchmark functions, which must execute their kernel `iterations()` times and
+ * report how many items (datagrams, frames, etc) and bytes they processed.
+ */
+class State {
+public:
+    State(uint64_t iterations, int threadIdx) : _iterations(iterations), _threadIdx(threadIdx) {}
+
+    uint64_t iterations() const { return _iterations; }
+    int threadIdx() const { return _threadIdx; }
+
+    void addItemsProcessed(uint64_t n) { itemsProcessed += n; }
+    void addBytesProcessed(uint64_t n) { bytesProcessed += n; }
+
+    uint64_t itemsProcessed{0};
+    uint64_t bytesProcessed{0};
+
+private:
+    uint64_t _iterations;
+    int _threadIdx;
+};
+
+using BenchmarkFn = std::function<void(State &)>;
+
+/**
+ * A family of benchmarks, one for each combination of argument and number of threads. The setup
+ * function is invoked once for each combination and returns the function, which all the threads
+ * run concurrently, so anything it captures (such as a pipe) is shared between them.
+ */
+struct BenchmarkFamily {
+    std::string name;
+    std::string argName;
+    std::vector<int64_t> args;
+    std::vector<int> threads;
+    std::function<BenchmarkFn(int64_t arg)> setup;
+};
+
+struct Result {
+    std::string name;
+    uint64_t iterations;
+    int threads;
+    double realNanos; // Per iteration of each thread
+    double cpuNanos;  // Per iteration, summed up across the threads
+    double itemsPerSecond;
+    double bytesPerSecond;
+};
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// The benchmarks
+//
+
+// Size of the frames produced by the tunnel for MTU of 1500 bytes
+constexpr size_t kFrameSize = 2 * 1500;
+
+const std::vector<int64_t> kDatagramSizes{64, 576, 1400};
+
+/**
+ * Returns a closed frame of `frameSize` bytes filled with datagrams of `datagramSize` bytes.
+ */
+std::vector<uint8_t> makeFrame(size_t frameSize, size_t datagramSize) {
+    std::vector<uint8_t> frame(frameSize);
+    std::vector<uint8_t> datagram(datagramSize, 0xAB);
+
+    TunnelFrameWriter writer({frame.data(), frame.size()});
+    while (writer.remainingBytes() >= datagramSize)
+        writer.append(datagram.data(), datagram.size());
+    writer.close();
+
+    frame.resize(writer.header().desc.size);
+    return frame;
+}
+
+/**
+ * Chain of pass-through pipe stages, the last of which absorbs the frames, like the tunnel pipe
+ * between the tunnel and the sockets.
+ */
+class PipeChain {
+public:
+    PipeChain(int numStages) {
+        for (int i = 0; i < numStages; i++)
+            _stages.emplace_back(std::make_unique<Stage>(
+                boost::str(boost::format("microBench%d") % i), i ? _stages.back().get() : nullptr,
+                i == numStages - 1));
+    }
+
+    ~PipeChain() {
+        while (!_stages.empty())
+            _stages.pop_back();
+    }
+
+    void invoke(TunnelFrameBuffer buf) { _stages.front()->pipeInvokeNext(buf); }
+    void invoke(TunnelFrameBuffers bufs) { _stages.front()->pipeInvokeNext(bufs); }
+
+private:
+    struct Stage : public TunnelFramePipe {
+        Stage(std::string desc, TunnelFramePipe *prev, bool isLast)
+            : TunnelFramePipe(std::move(desc)), isLast(isLast) {
+            if (prev)
+                pipePush(*prev);
+            else
+                isFirst = true;
+        }
+
+        ~Stage() {
+            if (!isFirst)
+                pipePop();
+        }
+
+        void onTunnelFrameFromPrev(TunnelFrameBuffer buf) override {
+            if (!isLast)
+                pipeInvokeNext(buf);
+        }
+
+        void onTunnelFrameFromNext(TunnelFrameBuffer buf) override { RASSERT(false); }
+
+        void onTunnelFramesFromPrev(TunnelFrameBuffers bufs) override {
+            if (!isLast)
+                pipeInvokeNext(bufs);
+        }
+
+        bool isFirst{false};
+        const bool isLast;
+    };
+
+    std::vector<std::unique_ptr<Stage>> _stages;
+};
+
+// The pipe between the tunnel and the socket used to have 4 dynamic stages (tunnel, compressing,
+// signing, socket), which are kept for comparison with the static stages
+constexpr int kNumPipeStages = 4;
+
+/**
+ * Packing of datagrams into frames, as done by the tunnel for every datagram read from the tunnel
+ * device.
+ */
+BenchmarkFn benchTunnelFrameWriter(int64_t size) {
+    return [size](State &state) {
+        std::vector<uint8_t> frame(kFrameSize);
+        std::vector<uint8_t> datagram(size, 0xAB);
+
+        std::optional<TunnelFrameWriter> writer;
+        writer.emplace(TunnelFrameBuffer{frame.data(), frame.size()});
+        for (uint64_t i = 0; i < state.iterations(); i++) {
+            if (writer->remainingBytes() < size_t(size)) {
+                writer->close();
+                doNotOptimize(frame[0]);
+                writer.emplace(TunnelFrameBuffer{frame.data(), frame.size()});
+            }
+            writer->append(datagram.data(), size);
+        }
+
+        state.addItemsProcessed(state.iterations());
+        state.addBytesProcessed(state.iterations() * size);
+    };
+}
+
+/**
+ * Unpacking of the datagrams of a frame, as done by the tunnel for every frame received from the
+ * socket. Each iteration reads an entire frame, but the items are the datagrams.
+ */
+BenchmarkFn benchTunnelFrameReader(int64_t size) {
+    return [size](State &state) {
+        const auto frame = makeFrame(kFrameSize, size);
+
+        for (uint64_t i = 0; i < state.iterations(); i++) {
+            TunnelFrameReader reader({frame.data(), frame.size()});
+            while (reader.next()) {
+                doNotOptimize(reader.data());
+                state.addItemsProcessed(1);
+                state.addBytesProcessed(reader.size());
+            }
+        }
+    };
+}
+
+/**
+ * Validation of the header of every frame received from the socket.
+ */
+BenchmarkFn benchTunnelFrameHeaderInfoCheck(int64_t) {
+    return [](State &state) {
+        const auto frame = makeFrame(kFrameSize, 576);
+        const ConstTunnelFrameBuffer buf{frame.data(), frame.size()};
+
+        for (uint64_t i = 0; i < state.iterations(); i++)
+            doNotOptimize(TunnelFrameHeaderInfo::check(buf));
+
+        state.addItemsProcessed(state.iterations());
+    };
+}
+
+/**
+ * Passing of a frame through all the stages of the pipe, concurrently from all the threads (like
+ * the tunnel queue threads do), with the stage timing disabled or enabled.
+ */
+BenchmarkFn benchTunnelFramePipeDispatch(int64_t timing) {
+    auto chain = std::make_shared<PipeChain>(kNumPipeStages);
+    return [chain, timing](State &state) {
+        auto frame = makeFrame(kFrameSize, 576);
+
+        TunnelFramePipe::setTimingEnabled(timing);
+        for (uint64_t i = 0; i < state.iterations(); i++)
+            chain->invoke({frame.data(), frame.size()});
+        TunnelFramePipe::setTimingEnabled(false);
+
+        state.addItemsProcessed(state.iterations());
+        state.addBytesProcessed(state.iterations() * frame.size());
+    };
+}
+
+/**
+ * Same as `benchTunnelFramePipeDispatch`, but passing batches of `numFrames` frames, like the
+ * socket receive threads do.
+ */
+BenchmarkFn benchTunnelFramePipeDispatchBatch(int64_t numFrames) {
+    auto chain = std::make_shared<PipeChain>(kNumPipeStages);
+    return [chain, numFrames](State &state) {
+        auto frame = makeFrame(kFrameSize, 576);
+        std::vector<TunnelFrameBuffer> batch(numFrames,
+                                             TunnelFrameBuffer{frame.data(), frame.size()});
+
+        for (uint64_t i = 0; i < state.iterations(); i++)
+            chain->invoke(TunnelFrameBuffers{batch.data(), batch.size()});
+
+        state.addItemsProcessed(state.iterations() * numFrames);
+        state.addBytesProcessed(state.iterations() * numFrames * frame.size());
+    };
+}
+
+/**
+ * Pass-through stage of a `StaticTunnelFramePipe`, which only touches the frame.
+ */
+template <char Id>
+struct StaticStage {
+    static constexpr char kDesc[] = {'m', 'i', 'c', 'r', 'o', 'B', 'e', 'n', 'c', 'h', 'S', Id, 0};
+
+    void onTunnelFrameFromPrev(TunnelFrameBuffer &buf) { doNotOptimize(buf.data[0]); }
+    void onTunnelFrameFromNext(TunnelFrameBuffer &buf) { doNotOptimize(buf.data[0]); }
+};
+
+/**
+ * Same as `benchTunnelFramePipeDispatch`, but with the pass-through stages composed at compile
+ * time, like the signing and compressing stages in front of the sockets.
+ */
+BenchmarkFn benchStaticTunnelFramePipeDispatch(int64_t timing) {
+    static_assert(kNumPipeStages == 4);
+    auto pipe = std::make_shared<StaticTunnelFramePipe<StaticStage<'0'>, StaticStage<'1'>,
+                                                       StaticStage<'2'>, StaticStage<'3'>>>();
+    return [pipe, timing](State &state) {
+        auto frame = makeFrame(kFrameSize, 576);
+
+        TunnelFramePipe::setTimingEnabled(timing);
+        for (uint64_t i = 0; i < state.iterations(); i++) {
+            TunnelFrameBuffer buf{frame.data(), frame.size()};
+            pipe->onTunnelFrameFromPrev(buf);
+        }
+        TunnelFramePipe::setTimingEnabled(false);
+
+        state.addItemsProcessed(state.iterations());
+        state.addBytesProcessed(state.iterations() * frame.size());
+    };
+}
+
+/**
+ * Updates of the metrics, which the data path does for every datagram and frame.
+ */
+BenchmarkFn benchCounterAdd(int64_t) {
+    auto counter = std::make_shared<Counter>();
+    return [counter](State &state) {
+        for (uint64_t i = 0; i < state.iterations(); i++)
+            counter->add();
+
+        state.addItemsProcessed(state.iterations());
+    };
+}
+
+BenchmarkFn benchHistogramRecord(int64_t) {
+    auto histogram = std::make_shared<Histogram>();
+    return [histogram](State &state) {
+        for (uint64_t i = 0; i < state.iterations(); i++)
+            histogram->record(i & 0xFFFF);
+
+        state.addItemsProcessed(state.iterations());
+    };
+}
+
+const std::vector<BenchmarkFamily> kBenchmarks{
+    {"TunnelFrameWriter", "size", kDatagramSizes, {1}, benchTunnelFrameWriter},
+    {"TunnelFrameReader", "size", kDatagramSizes, {1}, benchTunnelFrameReader},
+    {"TunnelFrameHeaderInfo_check", "", {}, {1}, benchTunnelFrameHeaderInfoCheck},
+    {"TunnelFramePipe_dispatch", "timing", {0, 1}, {1, 2, 4}, benchTunnelFramePipeDispatch},
+    {"TunnelFramePipe_dispatchBatch", "frames", {1, 8, 64}, {1}, benchTunnelFramePipeDispatchBatch},
+    {"StaticTunnelFramePipe_dispatch", "timing", {0, 1}, {1, 2, 4},
+     benchStaticTunnelFramePipeDispatch},
+    {"Counter_add", "", {}, {1, 2, 4}, benchCounterAdd},
+    {"Histogram_record", "", {}, {1, 2, 4}, benchHistogramRecord},
+};
+
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// The harness
+//
+
+struct Measurement {
+    uint64_t realNanos;
+    uint64_t cpuNanos;
+    uint64_t itemsProcessed;
+    uint64_t bytesProcessed;
+};
+
+/**
+ * Runs `fn` on `numThreads` threads, all of which start at the same time and execute `iterations`
+ * iterations each.
+ */
+Measurement runOnce(const BenchmarkFn &fn, int numThreads, uint64_t iterations) {
+    std::mutex mutex;
+    std::condition_variable cv;
+    int numReady = 0;
+    bool go = false;
+
+    std::vector<State> states;
+    std::vector<uint64_t> cpuNanos(numThreads);
+    for (int i = 0; i < numThreads; i++)
+        states.emplace_back(iterations, i);
+
+    std::vector<std::thread> threads;
+    for (int i = 0; i < numThreads; i++) {
+        threads.emplace_back([&, i] {
+            {
+                std::unique_lock ul(mutex);
+                if (++numReady == numThreads)
+                    cv.notify_all();
+                cv.wait(ul, [&] { return go; });
+            }
+
+            const uint64_t startedAtCpuNanos = threadCpuNanos();
+            fn(states[i]);
+            cpuNanos[i] = threadCpuNanos() - startedAtCpuNanos;
+        });
+    }
+
+    uint64_t startedAtNanos;
+    {
+        std::unique_lock ul(mutex);
+        cv.wait(ul, [&] { return numReady == numThreads; });
+        go = true;
+        startedAtNanos = nowNanos();
+        cv.notify_all();
+    }
+
+    for (auto &thread : threads)
+        thread.join();
+
+    Measurement m{nowNanos() - startedAtNanos, 0, 0, 0};
+    for (int i = 0; i < numThreads; i++) {
+        m.cpuNanos += cpuNanos[i];
+        m.itemsProcessed += states[i].itemsProcessed;
+        m.bytesProcessed += states[i].bytesProcessed;
+    }
+    return m;
+}
+
+/**
+ * Same as the Google Benchmark library: grows the number of iterations until a run takes at least
+ * `minSeconds` and then repeats the run `repetitions` times, reporting the fastest one, which is
+ * the least disturbed by the rest of the system.
+ */
+Result run(const std::string &name, const BenchmarkFn &fn, int numThreads, double minSeconds,
+           int repetitions) {
+    const uint64_t minNanos = minSeconds * 1e9;
+
+    uint64_t iterations = 1;
+    Measurement m = runOnce(fn, numThreads, iterations);
+    while (m.realNanos < minNanos) {
+        const double multiplier =
+            std::clamp(1.4 * minNanos / std::max<uint64_t>(m.realNanos, 1), 2.0, 10.0);
+        iterations = std::max<uint64_t>(iterations * multiplier, iterations + 1);
+        m = runOnce(fn, numThreads, iterations);
+    }
+
+    for (int i = 1; i < repetitions; i++) {
+        auto repetition = runOnce(fn, numThreads, iterations);
+        if (repetition.cpuNanos < m.cpuNanos)
+            m = repetition;
+    }
+
+    const double realSeconds = m.realNanos / 1e9;
+    return {name,
+            iterations,
+            numThreads,
+            double(m.realNanos) / iterations,
+            double(m.cpuNanos) / iterations / numThreads,
+            m.itemsProcessed / realSeconds,
+            m.bytesProcessed / realSeconds};
+}
+
+std::string jsonEscape(const std::string &str) {
+    std::string escaped;
+    for (char c : str) {
+        if (c == '"' || c == '\\')
+            escaped += '\\';
+        escaped += c;
+    }
+    return escaped;
+}
+
+/**
+ * Writes the results in the JSON format of the Google Benchmark library, so that its tools (such as
+ * compare.py) can be used on them as well.
+ */
+void writeJson(std::ostream &os, const std::vector<Result> &results) {
+    struct utsname uts;
+    SYSCALL(::uname(&uts));
+
+    char date[64];
+    const time_t now = ::time(nullptr);
+    ::strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%S%z", ::localtime(&now));
+
+    os << "{\n"
+       << "  \"context\": {\n"
+       << "    \"date\": \"" << date << "\",\n"
+       << "    \"host_name\": \"" << jsonEscape(uts.nodename) << "\",\n"
+       << "    \"machine\": \"" << jsonEscape(uts.machine) << "\",\n"
+       << "    \"num_cpus\": " << std::thread::hardware_concurrency() << ",\n"
+       << "    \"library_build_type\": \"" <<
+#ifdef NDEBUG
+        "release"
+#else
+        "debug"
+#endif
+       << "\"\n"
+       << "  },\n"
+       << "  \"benchmarks\": [\n";
+
+    for (size_t i = 0; i < results.size(); i++) {
+        const auto &r = results[i];
+        os << "    {\n"
+           << "      \"name\": \"" << jsonEscape(r.name) << "\",\n"
+           << "      \"run_type\": \"iteration\",\n"
+           << "      \"iterations\": " << r.iterations << ",\n"
+           << "      \"threads\": " << r.threads << ",\n"
+           << boost::format("      \"real_time\": %.3f,\n") % r.realNanos
+           << boost::format("      \"cpu_time\": %.3f,\n") % r.cpuNanos
+           << "      \"time_unit\": \"ns\",\n"
+           << boost::format("      \"items_per_second\": %.1f,\n") % r.itemsPerSecond
+           << boost::format("      \"bytes_per_second\": %.1f\n") % r.bytesPerSecond
+           << "    }" << (i + 1 < results.size() ? "," : "") << "\n";
+    }
+
+    os << "  ]\n"
+       << "}\n";
+}
+
+/**
+ * Compares the CPU time of each result against the same benchmark in `baselinePath` and returns
+ * the number of benchmarks, which are slower by more than `tolerance` (a fraction).
+ */
+int compareToBaseline(const std::vector<Result> &results, const std::string &baselinePath,
+                      double tolerance) {
+    boost::property_tree::ptree baseline;
+    boost::property_tree::read_json(baselinePath, baseline);
+
+    std::map<std::string, double> baselineCpuNanos;
+    for (const auto &[_, benchmark] : baseline.get_child("benchmarks"))
+        baselineCpuNanos[benchmark.get<std::string>("name")] = benchmark.get<double>("cpu_time");
+
+    int numRegressions = 0;
+
+    std::cout << "\nComparison against " << baselinePath << " (tolerance "
+              << int(tolerance * 100) << "%):\n";
+    for (const auto &r : results) {
+        auto it = baselineCpuNanos.find(r.name);
+        if (it == baselineCpuNanos.end()) {
+            std::cout << boost::format("%-48s %12s\n") % r.name % "(new)";
+            continue;
+        }
+
+        const double change = r.cpuNanos / it->second - 1;
+        const bool regressed = change > tolerance;
+        if (regressed)
+            ++numRegressions;
+
+        std::cout << boost::format("%-48s %+11.1f%% %s\n") % r.name % (change * 100) %
+                         (regressed ? "REGRESSION" : "");
+    }
+
+    return numRegressions;
+}
+
+} // namespace
+} // namespace bench
+} // namespace ruralpi
+
+int main(int argc, const char *argv[]) {
+    using namespace ruralpi;
+    using namespace ruralpi::bench;
+
+    po::options_description desc("RuralPipe micro-benchmark options");
+    // clang-format off
+    desc.add_options()
+        ("help", "Produces this help message")
+        ("filter", po::value<std::string>()->default_value(".*"), "Only run the benchmarks, whose name matches this regular expression")
+        ("min_seconds", po::value<double>()->default_value(0.2), "Minimum duration of each measured run")
+        ("repetitions", po::value<int>()->default_value(3), "How many times to repeat each run (the fastest is reported)")
+        ("json", po::value<std::string>(), "Write the results in the Google Benchmark JSON format to this file")
+        ("baseline", po::value<std::string>(), "Compare the CPU time of the results against this JSON file (as written by --json) and fail if any benchmark regressed")
+        ("tolerance", po::value<double>()->default_value(0.15), "By what fraction a benchmark may be slower than the baseline before it is considered to have regressed")
+    ;
+    // clang-format on
+
+    try {
+        po::variables_map vm;
+        po::store(po::parse_command_line(argc, argv, desc), vm);
+        po::notify(vm);
+
+        if (vm.count("help")) {
+            std::cout << desc;
+            return 1;
+        }
+
+        const std::regex filter(vm["filter"].as<std::string>());
+        const double minSeconds = vm["min_seconds"].as<double>();
+        const int repetitions = std::max(vm["repetitions"].as<int>(), 1);
+
+        std::vector<Result> results;
+
+        std::cout << boost::format("%-48s %14s %14s %14s %12s\n") % "Benchmark" % "Time (ns)" %
+                         "CPU (ns)" % "Iterations" % "Items/s";
+        for (const auto &family : kBenchmarks) {
+            const auto args = family.args.empty() ? std::vector<int64_t>{0} : family.args;
+            for (int64_t arg : args) {
+                for (int numThreads : family.threads) {
+                    std::string name = family.name;
+                    if (!family.args.empty())
+                        name += boost::str(boost::format("/%s:%d") % family.argName % arg);
+                    if (family.threads.size() > 1)
+                        name += boost::str(boost::format("/threads:%d") % numThreads);
+
+                    if (!std::regex_search(name, filter))
+                        continue;
+
+                    auto r = run(name, family.setup(arg), numThreads, minSeconds, repetitions);
+                    std::cout << boost::format("%-48s %14.1f %14.1f %14d %11.3fM\n") % r.name %
+                                     r.realNanos % r.cpuNanos % r.iterations %
+                                     (r.itemsPerSecond / 1e6);
+                    results.push_back(std::move(r));
+                }
+            }
+        }
+
+        if (vm.count("json")) {
+            std::ofstream os(vm["json"].as<std::string>());
+            writeJson(os, results);
+            if (!os)
+                throw Exception(boost::format("Failed to write %s") % vm["json"].as<std::string>());
+        }
+
+        if (vm.count("baseline")) {
+            const int numRegressions = compareToBaseline(results, vm["baseline"].as<std::string>(),
+                                                         vm["tolerance"].as<double>());
+            if (numRegressions) {
+                std::cerr << numRegressions << " benchmark(s) regressed" << std::endl;
+                return 2;
+            }
+        }
+
+        return 0;
+    } catch (const std::exception &ex) {
+        std::cerr << "Benchmark failed: " << ex.what() << std::endl;
+        return 1;
+    }
+}
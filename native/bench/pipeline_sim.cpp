@@ -0,0 +1,231 @@
+/**
+ * Copyright 2021 Kaloian Manassiev
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software and
+ * associated documentation files (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge, publish, distribute,
+ * sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or
+ * substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT
+ * NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE. */
+
+#include "common/base.h"
+
+#include <boost/algorithm/string.hpp>
+#include <boost/program_options.hpp>
+#include <iostream>
+
+#include "bench/simulator.h"
+#include "common/exception.h"
+
+namespace ruralpi {
+namespace bench {
+namespace {
+
+namespace po = boost::program_options;
+
+/**
+ * Parameter of the simulation, which can be set from the command line and swept over.
+ */
+struct Parameter {
+    const char *name;
+    const char *description;
+    std::function<void(SimConfig &, const std::string &)> set;
+    std::function<std::string(const SimConfig &)> get;
+};
+
+const std::vector<Parameter> kParameters{
+    {"seconds", "For how long to generate traffic (of virtual time)",
+     [](SimConfig &c, const std::string &v) { c.seconds = std::stod(v); },
+     [](const SimConfig &c) { return boost::str(boost::format("%g") % c.seconds); }},
+    {"pps", "Average rate at which to generate datagrams (with Poisson arrivals)",
+     [](SimConfig &c, const std::string &v) { c.pps = std::stod(v); },
+     [](const SimConfig &c) { return boost::str(boost::format("%g") % c.pps); }},
+    {"flows", "Number of flows, over which the datagrams are spread",
+     [](SimConfig &c, const std::string &v) { c.flows = std::stoi(v); },
+     [](const SimConfig &c) { return std::to_string(c.flows); }},
+    {"sizes", "Mix of datagram sizes as size:weight pairs (can't be swept over)",
+     [](SimConfig &c, const std::string &v) { c.sizes = PacketSizeMix::parse(v); },
+     [](const SimConfig &c) { return '"' + c.sizes.toString() + '"'; }},
+    {"seed", "Seed of the random generators",
+     [](SimConfig &c, const std::string &v) { c.seed = std::stoul(v); },
+     [](const SimConfig &c) { return std::to_string(c.seed); }},
+    {"queues", "Number of tunnel queues",
+     [](SimConfig &c, const std::string &v) { c.queues = std::stoi(v); },
+     [](const SimConfig &c) { return std::to_string(c.queues); }},
+    {"tun_queue_len", "Datagrams, which the queue of the tunnel device holds before dropping",
+     [](SimConfig &c, const std::string &v) { c.tunQueueLen = std::stoul(v); },
+     [](const SimConfig &c) { return std::to_string(c.tunQueueLen); }},
+    {"frame_size", "Maximum size of the tunnel frames",
+     [](SimConfig &c, const std::string &v) { c.frameSize = std::stoul(v); },
+     [](const SimConfig &c) { return std::to_string(c.frameSize); }},
+    {"batch_timeout_us", "For how long to wait for another datagram before closing a frame",
+     [](SimConfig &c, const std::string &v) {
+         c.batchTimeout = std::chrono::microseconds(std::stoll(v));
+     },
+     [](const SimConfig &c) { return std::to_string(c.batchTimeout.count()); }},
+    {"scheduler", "How to pick the stream for a frame (idle_first, round_robin or min_delay)",
+     [](SimConfig &c, const std::string &v) { c.scheduler = SimConfig::parseScheduler(v); },
+     [](const SimConfig &c) { return SimConfig::schedulerName(c.scheduler); }},
+    {"snd_buf", "Size of the send buffer of the streams",
+     [](SimConfig &c, const std::string &v) { c.sndBufBytes = std::stoul(v); },
+     [](const SimConfig &c) { return std::to_string(c.sndBufBytes); }},
+    {"send_queue_depth", "Frames, which can be queued on a stream behind its send buffer",
+     [](SimConfig &c, const std::string &v) { c.sendQueueDepth = std::stoul(v); },
+     [](const SimConfig &c) { return std::to_string(c.sendQueueDepth); }},
+    {"reorder_window_us", "For how long the receiver holds frames, which arrived out of order",
+     [](SimConfig &c, const std::string &v) {
+         c.reorderWindow = std::chrono::microseconds(std::stoll(v));
+     },
+     [](const SimConfig &c) { return std::to_string(c.reorderWindow.count()); }},
+};
+
+const Parameter &findParameter(const std::string &name) {
+    for (const auto &parameter : kParameters) {
+        if (name == parameter.name)
+            return parameter;
+    }
+    throw Exception(boost::format("Unknown parameter '%s'") % name);
+}
+
+void setParameter(SimConfig &config, const std::string &name, const std::string &value) {
+    try {
+        findParameter(name).set(config, value);
+    } catch (const std::invalid_argument &) {
+        throw Exception(boost::format("Invalid value '%s' for parameter '%s'") % value % name);
+    }
+}
+
+struct Sweep {
+    std::string name;
+    std::vector<std::string> values;
+};
+
+/**
+ * Runs the simulation for every combination of the values of the sweeps, starting from
+ * `sweeps[idx]`, and prints a CSV row for each of them.
+ */
+void runSweeps(SimConfig config, const std::vector<Sweep> &sweeps, size_t idx) {
+    if (idx < sweeps.size()) {
+        for (const auto &value : sweeps[idx].values) {
+            setParameter(config, sweeps[idx].name, value);
+            runSweeps(config, sweeps, idx + 1);
+        }
+        return;
+    }
+
+    const auto startedAtNanos = nowNanos();
+    const auto r = simulate(config);
+    const double wallSeconds = (nowNanos() - startedAtNanos) / 1e9;
+
+    for (const auto &parameter : kParameters)
+        std::cout << parameter.get(config) << ',';
+
+    std::cout << '"';
+    for (size_t i = 0; i < config.links.size(); i++)
+        std::cout << (i ? " + " : "") << config.links[i].name;
+    std::cout << '"';
+
+    const double percentDropped =
+        r.datagramsGenerated ? 100.0 * r.datagramsDropped / r.datagramsGenerated : 0;
+    const double percentReordered =
+        r.datagramsDelivered ? 100.0 * r.datagramsReordered / r.datagramsDelivered : 0;
+    std::cout << boost::format(",%d,%.3f,%.3f,%.3f,%d,%.2f,%d,%.1f,%.1f,%.1f,%.1f") %
+                     r.datagramsGenerated % percentDropped % percentReordered %
+                     (r.bytesDelivered * 8 / config.seconds / 1e6) % r.frames %
+                     (r.frames ? double(r.datagramsGenerated - r.datagramsDropped) / r.frames : 0) %
+                     r.framesLate % (r.latencyNanos.quantile(0.5) / 1e3) %
+                     (r.latencyNanos.quantile(0.99) / 1e3) %
+                     (r.latencyNanos.quantile(0.999) / 1e3) %
+                     (r.latencyNanos.quantile(1.0) / 1e3);
+    for (auto frames : r.framesPerLink)
+        std::cout << ',' << frames;
+    std::cout << std::endl;
+
+    std::cerr << boost::format("Simulated %gs in %.2fs (%d events)\n") % config.seconds %
+                     wallSeconds % r.numEvents;
+}
+
+void printCsvHeader(const SimConfig &config) {
+    for (const auto &parameter : kParameters)
+        std::cout << parameter.name << ',';
+    std::cout << "links,generated,dropped_pct,reordered_pct,goodput_mbps,frames,"
+                 "datagrams_per_frame,late_frames,latency_p50_us,latency_p99_us,latency_p999_us,"
+                 "latency_max_us";
+    for (size_t i = 0; i < config.links.size(); i++)
+        std::cout << ",link" << i << "_frames";
+    std::cout << std::endl;
+}
+
+} // namespace
+} // namespace bench
+} // namespace ruralpi
+
+int main(int argc, const char *argv[]) {
+    using namespace ruralpi;
+    using namespace ruralpi::bench;
+
+    po::options_description desc(
+        "RuralPipe pipeline simulator options. Simulates the batching of the datagrams into "
+        "frames, the scheduling of the frames on the streams, the uplinks and the reordering at "
+        "the receiving side against a virtual clock and prints the results as CSV, one row per "
+        "combination of the swept parameters");
+    // clang-format off
+    desc.add_options()
+        ("help", "Produces this help message")
+        ("link", po::value<std::vector<std::string>>()->composing(), "Uplink, over which one of the streams goes (may be specified multiple times), in the same format as for the loopback benchmark (for example 'dsl' or '4g,loss=2%'). Defaults to dsl and 4g.")
+        ("sweep", po::value<std::vector<std::string>>()->composing(), "Parameter to sweep over as name=value1,value2,... (may be specified multiple times, in which case all the combinations are simulated)")
+    ;
+    // clang-format on
+    for (const auto &parameter : kParameters)
+        desc.add_options()(parameter.name, po::value<std::string>(), parameter.description);
+
+    try {
+        po::variables_map vm;
+        po::store(po::parse_command_line(argc, argv, desc), vm);
+        po::notify(vm);
+
+        if (vm.count("help")) {
+            std::cout << desc;
+            return 1;
+        }
+
+        SimConfig config;
+        for (const auto &parameter : kParameters) {
+            if (vm.count(parameter.name))
+                setParameter(config, parameter.name, vm[parameter.name].as<std::string>());
+        }
+
+        for (const auto &spec : vm.count("link") ? vm["link"].as<std::vector<std::string>>()
+                                                 : std::vector<std::string>{"dsl", "4g"})
+            config.links.push_back(LinkProfile::parse(spec));
+
+        std::vector<Sweep> sweeps;
+        if (vm.count("sweep")) {
+            for (const auto &spec : vm["sweep"].as<std::vector<std::string>>()) {
+                auto equals = spec.find('=');
+                if (equals == std::string::npos)
+                    throw Exception(boost::format("Invalid sweep '%s'") % spec);
+
+                Sweep sweep{spec.substr(0, equals)};
+                findParameter(sweep.name);
+                boost::split(sweep.values, spec.substr(equals + 1), boost::is_any_of(","));
+                sweeps.push_back(std::move(sweep));
+            }
+        }
+
+        printCsvHeader(config);
+        runSweeps(config, sweeps, 0);
+        return 0;
+    } catch (const std::exception &ex) {
+        std::cerr << "Simulation failed: " << ex.what() << std::endl;
+        return 1;
+    }
+}
@@ -0,0 +1,472 @@
+/**
+ * Copyright 2021 Kaloian Manassiev
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software and
+ * associated documentation files (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge, publish, distribute,
+ * sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or
+ * substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT
+ * NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE. */
+
+#include "common/base.h"
+
+#include "bench/simulator.h"
+
+#include <deque>
+#include <map>
+#include <memory>
+#include <optional>
+
+#include "common/exception.h"
+#include "common/tunnel_frame.h"
+
+namespace ruralpi {
+namespace bench {
+namespace {
+
+using Time = EventLoop::Time;
+
+struct Datagram {
+    uint32_t flow;
+    uint64_t flowSeqNum;
+    size_t size;
+    Time createdAt;
+};
+
+struct Frame {
+    uint64_t seqNum{0};
+    size_t size{sizeof(TunnelFrameHeader)};
+    std::vector<Datagram> datagrams;
+};
+
+Time transmissionTime(const LinkProfile &profile, size_t bytes) {
+    return profile.bitsPerSecond ? Time(int64_t(bytes * 8 * 1e9 / profile.bitsPerSecond)) : Time(0);
+}
+
+/**
+ * Receiving side of the tunnel, which puts the frames back in sequence number order (if there is a
+ * reorder window) and accounts for the delivered datagrams.
+ */
+class Receiver {
+public:
+    Receiver(EventLoop &loop, const SimConfig &config, SimResult &result)
+        : _loop(loop), _config(config), _result(result), _flowNextSeqNum(config.flows, 0) {}
+
+    void onFrame(Frame frame) {
+        if (!_config.reorderWindow.count()) {
+            deliver(frame);
+            return;
+        }
+
+        if (frame.seqNum < _nextSeqNum) {
+            ++_result.framesLate;
+            deliver(frame);
+            return;
+        }
+
+        const uint64_t seqNum = frame.seqNum;
+        _held.emplace(seqNum, std::move(frame));
+        if (seqNum == _nextSeqNum) {
+            deliverInSequence();
+            return;
+        }
+
+        // Give the frames before this one until the reorder window expires to arrive and then skip
+        // over the ones, which are still missing
+        _loop.after(_config.reorderWindow, [this, seqNum] {
+            if (_nextSeqNum > seqNum)
+                return;
+            while (!_held.empty() && _held.begin()->first <= seqNum) {
+                deliver(_held.begin()->second);
+                _held.erase(_held.begin());
+            }
+            _nextSeqNum = seqNum + 1;
+            deliverInSequence();
+        });
+    }
+
+    Histogram latencyNanos;
+
+private:
+    void deliverInSequence() {
+        while (!_held.empty() && _held.begin()->first == _nextSeqNum) {
+            deliver(_held.begin()->second);
+            _held.erase(_held.begin());
+            ++_nextSeqNum;
+        }
+    }
+
+    void deliver(const Frame &frame) {
+        for (const auto &datagram : frame.datagrams) {
+            ++_result.datagramsDelivered;
+            _result.bytesDelivered += datagram.size;
+            latencyNanos.record((_loop.now() - datagram.createdAt).count());
+
+            auto &flowNextSeqNum = _flowNextSeqNum[datagram.flow];
+            if (datagram.flowSeqNum < flowNextSeqNum)
+                ++_result.datagramsReordered;
+            else
+                flowNextSeqNum = datagram.flowSeqNum + 1;
+        }
+    }
+
+    EventLoop &_loop;
+    const SimConfig &_config;
+    SimResult &_result;
+
+    uint64_t _nextSeqNum{0};
+    std::map<uint64_t, Frame> _held;
+
+    std::vector<uint64_t> _flowNextSeqNum;
+};
+
+/**
+ * A stream and the uplink it goes over. The frames scheduled on it are serialised one after the
+ * other at the link's bandwidth (not while the link is down) and delivered in order after the
+ * link's delay, jitter and loss (an extra round trip, as in the `LinkEmulator`).
+ *
+ * It is idle if the frame fits in the socket's send buffer and full if the send queue behind the
+ * socket buffer is full, which mirrors `SocketProducerConsumer::StreamTracker`.
+ */
+class Uplink {
+public:
+    Uplink(EventLoop &loop, const SimConfig &config, const LinkProfile &profile, uint32_t seed,
+           Receiver &receiver, uint64_t &numFramesSent, std::function<void()> onCapacity)
+        : _loop(loop),
+          _config(config),
+          _profile(profile),
+          _rng(seed),
+          _receiver(receiver),
+          _numFramesSent(numFramesSent),
+          _onCapacity(std::move(onCapacity)),
+          _maxFrames(config.sendQueueDepth +
+                     std::max<size_t>(1, config.sndBufBytes / config.frameSize)) {}
+
+    bool idle(size_t size) const { return _backlogBytes + size <= _config.sndBufBytes; }
+    bool full() const { return _backlog.size() >= _maxFrames; }
+    size_t backlogBytes() const { return _backlogBytes; }
+
+    /**
+     * Returns when a frame of `size` bytes scheduled now would be expected to arrive (without the
+     * jitter and loss).
+     */
+    Time expectedArrival(size_t size) const {
+        const auto now = _loop.now();
+        return now + _profile.outageRemaining(now) +
+               transmissionTime(_profile, _backlogBytes + size) + _profile.delay;
+    }
+
+    void send(Frame frame) {
+        _backlogBytes += frame.size;
+        _backlog.emplace_back(std::move(frame));
+        ++_numFramesSent;
+        if (!_transmitting)
+            transmitNext();
+    }
+
+private:
+    void transmitNext() {
+        if (_backlog.empty()) {
+            _transmitting = false;
+            return;
+        }
+        _transmitting = true;
+
+        const auto upAt = _loop.now() + _profile.outageRemaining(_loop.now());
+        _loop.at(upAt + transmissionTime(_profile, _backlog.front().size), [this] {
+            auto frame = std::move(_backlog.front());
+            _backlog.pop_front();
+            _backlogBytes -= frame.size;
+
+            auto deliverAt = _loop.now() + _profile.delay;
+            if (_profile.jitter.count())
+                deliverAt += std::chrono::microseconds(
+                    std::uniform_int_distribution<int64_t>(0, _profile.jitter.count())(_rng));
+            if (_profile.lossRate && std::bernoulli_distribution(_profile.lossRate)(_rng))
+                deliverAt += 2 * _profile.delay;
+            deliverAt = std::max(deliverAt, _lastDeliverAt);
+            _lastDeliverAt = deliverAt;
+
+            _loop.at(deliverAt, [this, frame = std::move(frame)]() mutable {
+                _receiver.onFrame(std::move(frame));
+            });
+
+            transmitNext();
+            _onCapacity();
+        });
+    }
+
+    EventLoop &_loop;
+    const SimConfig &_config;
+    const LinkProfile &_profile;
+    std::mt19937 _rng;
+    Receiver &_receiver;
+    uint64_t &_numFramesSent;
+    std::function<void()> _onCapacity;
+
+    const size_t _maxFrames;
+
+    std::deque<Frame> _backlog;
+    size_t _backlogBytes{0};
+    bool _transmitting{false};
+    Time _lastDeliverAt{0};
+};
+
+class Batcher;
+
+/**
+ * Assigns the frames to the uplinks according to the configured policy. The `kIdleFirst` policy is
+ * the one of `SocketProducerConsumer::onTunnelFrameFromPrev`.
+ */
+class Scheduler {
+public:
+    Scheduler(const SimConfig &config) : _config(config) {}
+
+    void setUplinks(std::vector<std::unique_ptr<Uplink>> *uplinks) { _uplinks = uplinks; }
+
+    uint64_t nextSeqNum() { return _nextSeqNum++; }
+
+    /**
+     * Places the frame on one of the uplinks and returns true or returns false if all of them are
+     * full, in which case the batcher must wait for `onCapacity`.
+     */
+    bool trySend(Frame &frame) {
+        Uplink *uplink = select(frame.size);
+        if (!uplink)
+            return false;
+        uplink->send(std::move(frame));
+        return true;
+    }
+
+    void waitForCapacity(Batcher *batcher) { _waiting.push_back(batcher); }
+
+    void onCapacity();
+
+private:
+    Uplink *select(size_t size) {
+        auto &uplinks = *_uplinks;
+
+        if (_config.scheduler == SimConfig::Scheduler::kRoundRobin) {
+            for (size_t i = 0; i < uplinks.size(); i++) {
+                auto &uplink = uplinks[_nextRoundRobin++ % uplinks.size()];
+                if (!uplink->full())
+                    return uplink.get();
+            }
+            return nullptr;
+        }
+
+        Uplink *selected = nullptr;
+        Time selectedArrival = Time::max();
+        for (auto &uplink : uplinks) {
+            if (uplink->full())
+                continue;
+
+            if (_config.scheduler == SimConfig::Scheduler::kIdleFirst) {
+                if (uplink->idle(size))
+                    return uplink.get();
+                if (!selected || uplink->backlogBytes() < selected->backlogBytes())
+                    selected = uplink.get();
+            } else {
+                const auto arrival = uplink->expectedArrival(size);
+                if (arrival < selectedArrival) {
+                    selected = uplink.get();
+                    selectedArrival = arrival;
+                }
+            }
+        }
+        return selected;
+    }
+
+    const SimConfig &_config;
+    std::vector<std::unique_ptr<Uplink>> *_uplinks{nullptr};
+
+    uint64_t _nextSeqNum{0};
+    size_t _nextRoundRobin{0};
+    std::deque<Batcher *> _waiting;
+};
+
+/**
+ * One queue of the tunnel device and the thread, which batches its datagrams into frames, like
+ * `TunnelProducerConsumer::_receiveFromTunnelLoop`: a frame is closed when the next datagram does
+ * not fit in it or when no datagram arrives for `batchTimeout`. While the scheduler has no room for
+ * the frame, the datagrams accumulate in the queue of the tunnel device and are dropped when it is
+ * full.
+ */
+class Batcher {
+public:
+    Batcher(EventLoop &loop, const SimConfig &config, Scheduler &scheduler, SimResult &result)
+        : _loop(loop), _config(config), _scheduler(scheduler), _result(result) {}
+
+    void onDatagram(Datagram datagram) {
+        if (_tunQueue.size() >= _config.tunQueueLen) {
+            ++_result.datagramsDropped;
+            return;
+        }
+        _tunQueue.push_back(datagram);
+        pump();
+    }
+
+    /**
+     * Invoked by the scheduler, when the frame, which was blocked, might now have a place to go.
+     * Returns false if it is still blocked.
+     */
+    bool retry() {
+        if (!_scheduler.trySend(*_blocked))
+            return false;
+        _blocked.reset();
+        pump();
+        return true;
+    }
+
+private:
+    void pump() {
+        while (!_blocked && !_tunQueue.empty()) {
+            const auto &datagram = _tunQueue.front();
+            const size_t size = sizeof(TunnelFrameDatagramSeparator) + datagram.size;
+            if (_frame.size + size > _config.frameSize) {
+                closeFrame();
+                continue;
+            }
+
+            _frame.size += size;
+            _frame.datagrams.push_back(datagram);
+            _tunQueue.pop_front();
+
+            const uint64_t timerGeneration = ++_timerGeneration;
+            _loop.after(_config.batchTimeout, [this, timerGeneration] {
+                if (timerGeneration == _timerGeneration && !_blocked &&
+                    !_frame.datagrams.empty())
+                    closeFrame();
+            });
+        }
+    }
+
+    void closeFrame() {
+        RASSERT(!_frame.datagrams.empty());
+
+        ++_result.frames;
+        _frame.seqNum = _scheduler.nextSeqNum();
+        if (!_scheduler.trySend(_frame)) {
+            _blocked.emplace(std::move(_frame));
+            _scheduler.waitForCapacity(this);
+        }
+        _frame = Frame();
+    }
+
+    EventLoop &_loop;
+    const SimConfig &_config;
+    Scheduler &_scheduler;
+    SimResult &_result;
+
+    std::deque<Datagram> _tunQueue;
+    Frame _frame;
+    std::optional<Frame> _blocked;
+    uint64_t _timerGeneration{0};
+};
+
+void Scheduler::onCapacity() {
+    while (!_waiting.empty()) {
+        if (!_waiting.front()->retry())
+            break;
+        _waiting.pop_front();
+    }
+}
+
+} // namespace
+
+void EventLoop::at(Time t, std::function<void()> fn) {
+    RASSERT(t >= _now);
+    _events.push({t, _nextSeq++, std::move(fn)});
+}
+
+void EventLoop::runUntil(Time until) {
+    while (!_events.empty() && _events.top().t <= until) {
+        // The event must be popped before it runs, because it may schedule other events
+        auto fn = std::move(const_cast<Event &>(_events.top()).fn);
+        _now = _events.top().t;
+        _events.pop();
+
+        fn();
+        ++_numEventsRun;
+    }
+}
+
+std::string SimConfig::schedulerName(Scheduler scheduler) {
+    static const char *kNames[] = {"idle_first", "round_robin", "min_delay"};
+    return kNames[int(scheduler)];
+}
+
+SimConfig::Scheduler SimConfig::parseScheduler(const std::string &name) {
+    for (auto scheduler : {Scheduler::kIdleFirst, Scheduler::kRoundRobin, Scheduler::kMinDelay}) {
+        if (name == schedulerName(scheduler))
+            return scheduler;
+    }
+    throw Exception(boost::format("Unknown scheduler '%s'") % name);
+}
+
+SimResult simulate(const SimConfig &config) {
+    RASSERT(!config.links.empty());
+    RASSERT(config.queues > 0 && config.flows > 0);
+    if (config.frameSize < kTunnelFrameMinSize + config.sizes.maxSize() ||
+        config.frameSize > kTunnelFrameMaxSize)
+        throw Exception(boost::format("Frame size must be between %d and %d") %
+                        (kTunnelFrameMinSize + config.sizes.maxSize()) % kTunnelFrameMaxSize);
+
+    EventLoop loop;
+    SimResult result;
+    result.framesPerLink.resize(config.links.size());
+
+    Receiver receiver(loop, config, result);
+    Scheduler scheduler(config);
+
+    std::vector<std::unique_ptr<Uplink>> uplinks;
+    for (size_t i = 0; i < config.links.size(); i++)
+        uplinks.push_back(std::make_unique<Uplink>(loop, config, config.links[i],
+                                                   config.seed * 1000 + i, receiver,
+                                                   result.framesPerLink[i],
+                                                   [&scheduler] { scheduler.onCapacity(); }));
+    scheduler.setUplinks(&uplinks);
+
+    std::vector<std::unique_ptr<Batcher>> batchers;
+    for (int i = 0; i < config.queues; i++)
+        batchers.push_back(std::make_unique<Batcher>(loop, config, scheduler, result));
+
+    // Poisson arrivals of datagrams on flows chosen uniformly at random, which the kernel spreads
+    // over the tunnel queues by flow
+    std::mt19937 rng(config.seed);
+    auto sizes = config.sizes;
+    std::exponential_distribution<double> interArrivalSeconds(config.pps);
+    std::uniform_int_distribution<uint32_t> flows(0, config.flows - 1);
+    std::vector<uint64_t> flowNextSeqNum(config.flows, 0);
+    const Time generateUntil(int64_t(config.seconds * 1e9));
+
+    std::function<void()> generate = [&] {
+        const uint32_t flow = flows(rng);
+        batchers[flow % batchers.size()]->onDatagram(
+            {flow, flowNextSeqNum[flow]++, sizes.next(rng), loop.now()});
+        ++result.datagramsGenerated;
+
+        const auto next = loop.now() + Time(int64_t(interArrivalSeconds(rng) * 1e9));
+        if (next < generateUntil)
+            loop.at(next, generate);
+    };
+    loop.at(Time(0), generate);
+
+    // Run until all the datagrams have been delivered
+    loop.runUntil(Time::max());
+
+    result.latencyNanos = receiver.latencyNanos.snapshot();
+    result.numEvents = loop.numEventsRun();
+    return result;
+}
+
+} // namespace bench
+} // namespace ruralpi
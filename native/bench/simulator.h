@@ -0,0 +1,131 @@
+/**
+ * Copyright 2021 Kaloian Manassiev
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software and
+ * associated documentation files (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge, publish, distribute,
+ * sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or
+ * substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT
+ * NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE. */
+
+#pragma once
+
+#include <chrono>
+#include <functional>
+#include <queue>
+#include <string>
+#include <vector>
+
+#include "bench/bench_util.h"
+#include "bench/link_emulator.h"
+#include "common/metrics.h"
+
+namespace ruralpi {
+namespace bench {
+
+/**
+ * Discrete-event loop with a virtual clock. Events scheduled for the same time run in the order in
+ * which they were scheduled, so a simulation driven by seeded random generators always produces
+ * the same results.
+ */
+class EventLoop {
+public:
+    using Time = std::chrono::nanoseconds;
+
+    Time now() const { return _now; }
+
+    void at(Time t, std::function<void()> fn);
+    void after(Time delay, std::function<void()> fn) { at(_now + delay, std::move(fn)); }
+
+    /**
+     * Runs the events in time order until there are none left or the next one is after `until`.
+     */
+    void runUntil(Time until);
+
+    uint64_t numEventsRun() const { return _numEventsRun; }
+
+private:
+    struct Event {
+        Time t;
+        uint64_t seq;
+        std::function<void()> fn;
+
+        bool operator>(const Event &other) const {
+            return t > other.t || (t == other.t && seq > other.seq);
+        }
+    };
+
+    Time _now{0};
+    uint64_t _nextSeq{0};
+    uint64_t _numEventsRun{0};
+    std::priority_queue<Event, std::vector<Event>, std::greater<Event>> _events;
+};
+
+/**
+ * Parameters of a simulation of the tunnel pipeline, in which the client's tunnel queues batch the
+ * datagrams into frames (like `TunnelProducerConsumer`), the frames are scheduled on the streams
+ * (like `SocketProducerConsumer`), go over the emulated uplinks (with the same `LinkProfile` as the
+ * `LinkEmulator`) and are put back in order at the receiving side.
+ */
+struct SimConfig {
+    // Traffic
+    double seconds{60};
+    double pps{2000};
+    int flows{64};
+    PacketSizeMix sizes{PacketSizeMix::parse("64:7,576:4,1500:1")};
+    uint32_t seed{1};
+
+    // Tunnel side (the defaults are the constants of `TunnelProducerConsumer`)
+    int queues{2};
+    size_t tunQueueLen{500};
+    size_t frameSize{4096};
+    std::chrono::microseconds batchTimeout{5000};
+
+    // Socket side (the defaults are the constants of `SocketProducerConsumer`)
+    enum class Scheduler { kIdleFirst, kRoundRobin, kMinDelay };
+    Scheduler scheduler{Scheduler::kIdleFirst};
+    size_t sndBufBytes{2 * 2 * 4096};
+    size_t sendQueueDepth{32};
+
+    // Receiving side: for how long to hold frames, which arrived ahead of a missing one, before
+    // giving up on it (0 delivers the frames as they arrive, which is what the tunnel does now)
+    std::chrono::microseconds reorderWindow{0};
+
+    std::vector<LinkProfile> links;
+
+    static std::string schedulerName(Scheduler scheduler);
+    static Scheduler parseScheduler(const std::string &name);
+};
+
+struct SimResult {
+    uint64_t datagramsGenerated{0};
+    uint64_t datagramsDropped{0};
+    uint64_t datagramsDelivered{0};
+    uint64_t bytesDelivered{0};
+
+    // Datagrams, which were delivered after a later datagram of the same flow
+    uint64_t datagramsReordered{0};
+
+    uint64_t frames{0};
+    std::vector<uint64_t> framesPerLink;
+
+    // Frames, which arrived after the reorder window had given up on them
+    uint64_t framesLate{0};
+
+    Histogram::Snapshot latencyNanos;
+
+    uint64_t numEvents{0};
+};
+
+SimResult simulate(const SimConfig &config);
+
+} // namespace bench
+} // namespace ruralpi
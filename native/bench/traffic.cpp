@@ -0,0 +1,532 @@
+/**
+ * Copyright 2021 Kaloian Manassiev
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software and
+ * associated documentation files (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge, publish, distribute,
+ * sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or
+ * substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT
+ * NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE. */
+
+#include "common/base.h"
+
+#include "bench/traffic.h"
+
+#include <algorithm>
+#include <arpa/inet.h>
+#include <boost/algorithm/string.hpp>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <netinet/ip.h>
+#include <netinet/ip6.h>
+#include <netinet/tcp.h>
+#include <netinet/udp.h>
+#include <sstream>
+#include <string_view>
+
+#include "bench/bench_util.h"
+#include "common/exception.h"
+
+namespace ruralpi {
+namespace bench {
+namespace {
+
+constexpr uint64_t kNanosPerSecond = 1000000000;
+constexpr uint64_t kNanosPerMilli = 1000000;
+
+// Link types of the pcap files, which can be replayed (see https://www.tcpdump.org/linktypes.html)
+constexpr int kLinkTypeNull = 0;
+constexpr int kLinkTypeEthernet = 1;
+constexpr int kLinkTypeRaw = 101;
+constexpr int kLinkTypeLoop = 108;
+constexpr int kLinkTypeLinuxSLL = 113;
+constexpr int kLinkTypeIPv4 = 228;
+constexpr int kLinkTypeIPv6 = 229;
+constexpr int kLinkTypeLinuxSLL2 = 276;
+
+uint64_t transmissionNanos(size_t bytes, double bitsPerSecond) {
+    return bytes * 8 * kNanosPerSecond / bitsPerSecond;
+}
+
+/**
+ * Reads integers from a capture file, whose byte order may be different than the one of the CPU.
+ */
+struct CaptureReader {
+    bool swap{false};
+
+    uint16_t u16(uint8_t const *p) const {
+        uint16_t v;
+        memcpy(&v, p, sizeof(v));
+        return swap ? __builtin_bswap16(v) : v;
+    }
+
+    uint32_t u32(uint8_t const *p) const {
+        uint32_t v;
+        memcpy(&v, p, sizeof(v));
+        return swap ? __builtin_bswap32(v) : v;
+    }
+};
+
+uint16_t readBigEndian16(uint8_t const *p) { return (p[0] << 8) | p[1]; }
+
+} // namespace
+
+SyntheticTraffic::SyntheticTraffic(const std::string &spec, size_t mtu, uint32_t seed)
+    : _spec(spec), _mtu(mtu), _rng(seed) {
+    if (mtu < 576)
+        throw Exception("Synthetic traffic requires an MTU of at least 576 bytes");
+
+    std::vector<std::string> tokens;
+    boost::split(tokens, spec, boost::is_any_of(","));
+    for (auto &token : tokens) {
+        boost::trim(token);
+        auto equals = token.find('=');
+
+        static const std::vector<std::pair<std::string, Kind>> kKinds{
+            {"tcp", Kind::kTCP},
+            {"voip", Kind::kVoIP},
+            {"dns", Kind::kDNS},
+            {"video", Kind::kVideo}};
+        auto it = std::find_if(kKinds.begin(), kKinds.end(),
+                               [&](auto &kind) { return kind.first == token.substr(0, equals); });
+        if (it == kKinds.end())
+            throw Exception(boost::format("Unknown flow kind '%s' in traffic mix '%s'") % token %
+                            spec);
+
+        int count = 1;
+        try {
+            if (equals != std::string::npos)
+                count = std::stoi(token.substr(equals + 1));
+        } catch (const std::exception &) {
+            throw Exception(boost::format("Invalid flow count '%s' in traffic mix '%s'") % token %
+                            spec);
+        }
+
+        // The flows start at random offsets within their period
+        for (int i = 0; i < count; i++) {
+            const uint64_t periodNanos = [&] {
+                switch (it->second) {
+                case Kind::kTCP:
+                    return transmissionNanos(_mtu, 2e6);
+                case Kind::kVoIP:
+                    return 20 * kNanosPerMilli;
+                case Kind::kDNS:
+                    return kNanosPerSecond;
+                case Kind::kVideo:
+                    return 2 * kNanosPerSecond;
+                }
+                return kNanosPerSecond;
+            }();
+            _flows.push({it->second, uint32_t(_flows.size()),
+                         std::uniform_int_distribution<uint64_t>(0, periodNanos)(_rng)});
+        }
+    }
+}
+
+bool SyntheticTraffic::next(Packet &packet) {
+    if (_flows.empty())
+        return false;
+
+    auto flow = _flows.top();
+    _flows.pop();
+
+    makeDatagram(flow, packet);
+    ++flow.numSent;
+
+    switch (flow.kind) {
+    case Kind::kTCP:
+        flow.nextAtNanos += transmissionNanos(_mtu, 2e6);
+        break;
+    case Kind::kVoIP:
+        flow.nextAtNanos += 20 * kNanosPerMilli;
+        break;
+    case Kind::kDNS:
+        // Bursts of 10 queries, 1ms apart, about every second
+        if (!flow.burstLeft) {
+            flow.burstLeft = 10;
+            flow.burstStartedAtNanos = flow.nextAtNanos;
+        }
+        if (--flow.burstLeft)
+            flow.nextAtNanos += kNanosPerMilli;
+        else
+            flow.nextAtNanos =
+                flow.burstStartedAtNanos + kNanosPerSecond - 100 * kNanosPerMilli +
+                std::uniform_int_distribution<uint64_t>(0, 200 * kNanosPerMilli)(_rng);
+        break;
+    case Kind::kVideo:
+        // 1MB chunks every 2 seconds, each one sent at 20 Mbit/s
+        if (!flow.burstLeft) {
+            flow.burstLeft = (1 << 20) / (_mtu - sizeof(iphdr) - sizeof(tcphdr));
+            flow.burstStartedAtNanos = flow.nextAtNanos;
+        }
+        if (--flow.burstLeft)
+            flow.nextAtNanos += transmissionNanos(_mtu, 20e6);
+        else
+            flow.nextAtNanos = flow.burstStartedAtNanos + 2 * kNanosPerSecond;
+        break;
+    }
+
+    _flows.push(flow);
+    return true;
+}
+
+std::string SyntheticTraffic::toString() const {
+    return boost::str(boost::format("synthetic traffic mix '%s' (%d flows)") % _spec %
+                      _flows.size());
+}
+
+void SyntheticTraffic::makeDatagram(Flow &flow, Packet &packet) {
+    uint8_t protocol;
+    uint16_t sourcePort, destPort;
+    size_t size;
+
+    switch (flow.kind) {
+    case Kind::kTCP:
+        protocol = IPPROTO_TCP;
+        sourcePort = 40000 + flow.idx;
+        destPort = 5201;
+        size = _mtu;
+        break;
+    case Kind::kVoIP:
+        protocol = IPPROTO_UDP;
+        sourcePort = destPort = 16384 + 2 * (flow.idx % 8192);
+        size = 200;
+        break;
+    case Kind::kDNS:
+        protocol = IPPROTO_UDP;
+        sourcePort = 50000 + flow.idx;
+        destPort = 53;
+        size = std::uniform_int_distribution<size_t>(60, 100)(_rng);
+        break;
+    case Kind::kVideo:
+        protocol = IPPROTO_TCP;
+        sourcePort = 45000 + flow.idx;
+        destPort = 443;
+        size = _mtu;
+        break;
+    default:
+        throw Exception(boost::format("Unknown flow kind %d") % int(flow.kind));
+    }
+
+    packet.sendAtNanos = flow.nextAtNanos;
+    packet.data.assign(size, 0x5A);
+    uint8_t *buf = packet.data.data();
+
+    auto &ip = *((iphdr *)buf);
+    ip.version = 4;
+    ip.ihl = 5;
+    ip.tos = flow.kind == Kind::kVoIP ? 0xB8 /* EF */ : 0;
+    ip.tot_len = htons(size);
+    ip.id = htons(flow.numSent);
+    ip.frag_off = htons(IP_DF);
+    ip.ttl = 64;
+    ip.protocol = protocol;
+    ip.check = 0;
+    ip.saddr = htonl(0x0A000001);
+    ip.daddr = htonl(0x0A000000 | ((2 + int(flow.kind)) << 16) | (flow.idx & 0xFFFF));
+    ip.check = ipChecksum(buf, sizeof(ip));
+
+    // Each datagram of a flow carries a different sequence number, which makes it unique
+    size_t headerSize = sizeof(ip);
+    if (protocol == IPPROTO_TCP) {
+        const size_t payloadSize = size - sizeof(iphdr) - sizeof(tcphdr);
+        auto &tcp = *((tcphdr *)(buf + sizeof(ip)));
+        memset(&tcp, 0, sizeof(tcp));
+        tcp.source = htons(sourcePort);
+        tcp.dest = htons(destPort);
+        tcp.seq = htonl(uint32_t(flow.numSent * payloadSize));
+        tcp.ack_seq = htonl(1);
+        tcp.doff = 5;
+        tcp.ack = 1;
+        tcp.psh = 1;
+        tcp.window = htons(65535);
+        headerSize += sizeof(tcp);
+    } else {
+        auto &udp = *((udphdr *)(buf + sizeof(ip)));
+        udp.source = htons(sourcePort);
+        udp.dest = htons(destPort);
+        udp.len = htons(size - sizeof(ip));
+        udp.check = 0;
+        headerSize += sizeof(udp);
+    }
+
+    memcpy(buf + headerSize, &flow.numSent, sizeof(flow.numSent));
+}
+
+PcapReplay::PcapReplay(const std::string &path, double speed, size_t mtu)
+    : _path(path), _speed(speed), _mtu(mtu) {
+    std::ifstream is(path, std::ios::binary);
+    if (!is)
+        throw Exception(boost::format("Unable to open %s") % path);
+    const std::vector<uint8_t> file((std::istreambuf_iterator<char>(is)),
+                                    std::istreambuf_iterator<char>());
+    uint8_t const *const end = file.data() + file.size();
+
+    auto truncated = [&] { return Exception(boost::format("%s is truncated") % path); };
+
+    if (file.size() < 24)
+        throw truncated();
+
+    CaptureReader r;
+    uint32_t magic;
+    memcpy(&magic, file.data(), sizeof(magic));
+
+    if (magic == 0x0A0D0D0A) {
+        // pcapng: a sequence of blocks, in which each section starts with a header block, which
+        // specifies the byte order and interface description blocks specify the link type and
+        // the timestamp resolution of the packet blocks which follow
+        struct Interface {
+            int linkType;
+            uint64_t unitsPerSecond;
+        };
+        std::vector<Interface> interfaces;
+        uint64_t lastTimestampNanos = 0;
+
+        for (uint8_t const *block = file.data(); block + 12 <= end;) {
+            const uint32_t type = r.u32(block);
+            if (type == 0x0A0D0D0A) {
+                uint32_t byteOrderMagic;
+                memcpy(&byteOrderMagic, block + 8, sizeof(byteOrderMagic));
+                if (byteOrderMagic != 0x1A2B3C4D && byteOrderMagic != 0x4D3C2B1A)
+                    throw Exception(boost::format("%s is not a valid pcapng file") % path);
+                r.swap = byteOrderMagic == 0x4D3C2B1A;
+                interfaces.clear();
+            }
+
+            const uint32_t blockSize = r.u32(block + 4);
+            if (blockSize < 12 || block + blockSize > end)
+                throw truncated();
+
+            if (type == 1 /* Interface Description Block */) {
+                Interface interface{r.u16(block + 8), 1000000};
+                for (uint8_t const *option = block + 16; option + 4 <= block + blockSize - 4;) {
+                    const uint16_t code = r.u16(option), length = r.u16(option + 2);
+                    if (code == 0 /* opt_endofopt */)
+                        break;
+                    if (code == 9 /* if_tsresol */ && length == 1) {
+                        const uint8_t resolution = option[4];
+                        interface.unitsPerSecond = 1;
+                        for (int i = 0; i < (resolution & 0x7F); i++)
+                            interface.unitsPerSecond *= (resolution & 0x80) ? 2 : 10;
+                    }
+                    option += 4 + ((length + 3) & ~3);
+                }
+                interfaces.push_back(interface);
+            } else if (type == 6 /* Enhanced Packet Block */) {
+                const uint32_t idxInterface = r.u32(block + 8);
+                if (idxInterface >= interfaces.size())
+                    throw Exception(boost::format("%s references unknown interface %d") % path %
+                                    idxInterface);
+                const auto &interface = interfaces[idxInterface];
+                const uint64_t timestamp = (uint64_t(r.u32(block + 12)) << 32) | r.u32(block + 16);
+                lastTimestampNanos = timestamp / interface.unitsPerSecond * kNanosPerSecond +
+                                     timestamp % interface.unitsPerSecond * kNanosPerSecond /
+                                         interface.unitsPerSecond;
+                const uint32_t capturedSize = r.u32(block + 20);
+                if (28 + capturedSize > blockSize)
+                    throw truncated();
+                add(interface.linkType, lastTimestampNanos, block + 28, capturedSize,
+                    r.u32(block + 24));
+            } else if (type == 3 /* Simple Packet Block */) {
+                if (interfaces.empty())
+                    throw Exception(boost::format("%s has no interfaces") % path);
+                const uint32_t originalSize = r.u32(block + 8);
+                add(interfaces[0].linkType, lastTimestampNanos, block + 12,
+                    std::min<uint32_t>(originalSize, blockSize - 16), originalSize);
+            }
+
+            block += blockSize;
+        }
+    } else {
+        // Classic pcap: a file header, followed by the packet records
+        bool nanos;
+        if (magic == 0xA1B2C3D4 || magic == 0xD4C3B2A1)
+            nanos = false;
+        else if (magic == 0xA1B23C4D || magic == 0x4D3CB2A1)
+            nanos = true;
+        else
+            throw Exception(boost::format("%s is neither a pcap nor a pcapng file") % path);
+        r.swap = magic == 0xD4C3B2A1 || magic == 0x4D3CB2A1;
+
+        const int linkType = r.u32(file.data() + 20) & 0xFFFF;
+        for (uint8_t const *record = file.data() + 24; record < end;) {
+            if (record + 16 > end)
+                throw truncated();
+            const uint32_t capturedSize = r.u32(record + 8);
+            if (record + 16 + capturedSize > end)
+                throw truncated();
+
+            const uint64_t timestampNanos = r.u32(record) * kNanosPerSecond +
+                                            r.u32(record + 4) * (nanos ? 1 : 1000);
+            add(linkType, timestampNanos, record + 16, capturedSize, r.u32(record + 12));
+            record += 16 + capturedSize;
+        }
+    }
+
+    if (_packets.empty())
+        throw Exception(boost::format("%s contains no datagrams, which can be replayed") % path);
+
+    // Make the send times relative to the first datagram and apply the speed
+    const uint64_t firstTimestampNanos = _packets.front().sendAtNanos;
+    for (auto &packet : _packets)
+        packet.sendAtNanos =
+            _speed ? (std::max(packet.sendAtNanos, firstTimestampNanos) - firstTimestampNanos) /
+                         _speed
+                   : 0;
+}
+
+bool PcapReplay::next(Packet &packet) {
+    if (_next == _packets.size())
+        return false;
+
+    packet = _packets[_next++];
+    return true;
+}
+
+std::string PcapReplay::toString() const {
+    return boost::str(
+        boost::format("%s (%d datagrams over %.1f seconds, %d skipped) at %s") % _path %
+        _packets.size() % (_packets.back().sendAtNanos / 1e9) % _numSkipped %
+        (_speed ? boost::str(boost::format("%gx speed") % _speed) : "full speed"));
+}
+
+void PcapReplay::add(int linkType, uint64_t timestampNanos, uint8_t const *data,
+                     size_t capturedSize, size_t originalSize) {
+    // Strip the link-layer header
+    size_t offset;
+    switch (linkType) {
+    case kLinkTypeRaw:
+    case kLinkTypeIPv4:
+    case kLinkTypeIPv6:
+        offset = 0;
+        break;
+    case kLinkTypeNull:
+    case kLinkTypeLoop:
+        offset = 4;
+        break;
+    case kLinkTypeEthernet:
+        offset = 14;
+        if (capturedSize >= 18 && readBigEndian16(data + 12) == 0x8100 /* 802.1Q */)
+            offset = 18;
+        break;
+    case kLinkTypeLinuxSLL:
+        offset = 16;
+        break;
+    case kLinkTypeLinuxSLL2:
+        offset = 20;
+        break;
+    default:
+        throw Exception(boost::format("%s has unsupported link type %d") % _path % linkType);
+    }
+
+    if (capturedSize != originalSize || capturedSize < offset + sizeof(iphdr)) {
+        ++_numSkipped;
+        return;
+    }
+    data += offset;
+    size_t size = capturedSize - offset;
+
+    // Drop the link-layer padding and anything which is not IP
+    const int version = data[0] >> 4;
+    if (version == 4)
+        size = std::min<size_t>(size, readBigEndian16(data + 2));
+    else if (version == 6 && size >= sizeof(ip6_hdr))
+        size = std::min<size_t>(size, sizeof(ip6_hdr) + readBigEndian16(data + 4));
+    else
+        size = 0;
+
+    if (!size || size > _mtu) {
+        ++_numSkipped;
+        return;
+    }
+
+    _packets.push_back({{data, data + size}, timestampNanos});
+}
+
+void FlowRecorder::onSent(uint8_t const *data, size_t size, uint64_t nowNanos) {
+    std::string desc = "Other";
+
+    const int version = size ? data[0] >> 4 : 0;
+    int protocol = -1;
+    size_t l4Offset = 0;
+    char source[INET6_ADDRSTRLEN], dest[INET6_ADDRSTRLEN];
+    if (version == 4 && size >= sizeof(iphdr)) {
+        const auto &ip = *((iphdr const *)data);
+        inet_ntop(AF_INET, &ip.saddr, source, sizeof(source));
+        inet_ntop(AF_INET, &ip.daddr, dest, sizeof(dest));
+        protocol = ip.protocol;
+        l4Offset = ip.ihl * 4;
+    } else if (version == 6 && size >= sizeof(ip6_hdr)) {
+        const auto &ip6 = *((ip6_hdr const *)data);
+        inet_ntop(AF_INET6, &ip6.ip6_src, source, sizeof(source));
+        inet_ntop(AF_INET6, &ip6.ip6_dst, dest, sizeof(dest));
+        protocol = ip6.ip6_nxt;
+        l4Offset = sizeof(ip6_hdr);
+    }
+
+    if (protocol == IPPROTO_TCP || protocol == IPPROTO_UDP) {
+        if (size >= l4Offset + 4)
+            desc = boost::str(boost::format("%s %s:%d > %s:%d") %
+                              (protocol == IPPROTO_TCP ? "TCP" : "UDP") % source %
+                              readBigEndian16(data + l4Offset) % dest %
+                              readBigEndian16(data + l4Offset + 2));
+    } else if (protocol >= 0) {
+        desc = boost::str(boost::format("Proto %d %s > %s") % protocol % source % dest);
+    }
+
+    const uint64_t hash = std::hash<std::string_view>()(std::string_view((char const *)data, size));
+
+    std::lock_guard lg(_mutex);
+
+    auto [it, inserted] = _flowsByDesc.try_emplace(std::move(desc), _flows.size());
+    if (inserted)
+        _flows.push_back({it->first});
+
+    auto &flow = _flows[it->second];
+    ++flow.packetsSent;
+    flow.bytesSent += size;
+
+    _inFlight.emplace(hash, InFlight{nowNanos, it->second});
+}
+
+std::optional<uint64_t> FlowRecorder::onDelivered(uint8_t const *data, size_t size,
+                                                  uint64_t nowNanos) {
+    const uint64_t hash = std::hash<std::string_view>()(std::string_view((char const *)data, size));
+
+    std::lock_guard lg(_mutex);
+
+    auto it = _inFlight.find(hash);
+    if (it == _inFlight.end())
+        return std::nullopt;
+
+    const uint64_t latencyNanos = nowNanos - it->second.sentAtNanos;
+    auto &flow = _flows[it->second.idxFlow];
+    ++flow.packetsDelivered;
+    flow.bytesDelivered += size;
+    flow.latencySumNanos += latencyNanos;
+    flow.latencyMaxNanos = std::max(flow.latencyMaxNanos, latencyNanos);
+
+    _inFlight.erase(it);
+    return latencyNanos;
+}
+
+std::vector<FlowRecorder::FlowStats> FlowRecorder::flows() const {
+    std::lock_guard lg(_mutex);
+
+    auto flows = _flows;
+    std::sort(flows.begin(), flows.end(),
+              [](auto &a, auto &b) { return a.bytesSent > b.bytesSent; });
+    return flows;
+}
+
+} // namespace bench
+} // namespace ruralpi
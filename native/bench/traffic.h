@@ -0,0 +1,170 @@
+/**
+ * Copyright 2021 Kaloian Manassiev
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software and
+ * associated documentation files (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge, publish, distribute,
+ * sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or
+ * substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT
+ * NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE. */
+
+#pragma once
+
+#include <mutex>
+#include <optional>
+#include <queue>
+#include <random>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace ruralpi {
+namespace bench {
+
+/**
+ * Datagram to be written to the tunnel and the time, relative to the start of the traffic, at which
+ * it must be written.
+ */
+struct Packet {
+    std::vector<uint8_t> data;
+    uint64_t sendAtNanos{0};
+};
+
+/**
+ * Sequence of datagrams to be written to the tunnel, ordered by their send time.
+ */
+class TrafficSource {
+public:
+    virtual ~TrafficSource() = default;
+
+    /**
+     * Fills `packet` with the next datagram or returns false if there are no more datagrams.
+     */
+    virtual bool next(Packet &packet) = 0;
+
+    virtual std::string toString() const = 0;
+};
+
+/**
+ * Mix of synthetic IPv4 flows, specified as "kind=count,..." (for example
+ * "tcp=8,voip=20,dns=2,video=2"), where the kinds are:
+ *
+ *  tcp: Bulk transfer of full-sized TCP segments at 2 Mbit/s
+ *  voip: RTP over UDP, 200 byte datagrams every 20ms
+ *  dns: Bursts of 10 small UDP queries about every second
+ *  video: 1MB chunks of TCP segments every 2 seconds, each one sent at 20 Mbit/s
+ *
+ * The flows start at random offsets, so that they don't all send at the same time, and each
+ * datagram is unique, so that it can be matched at the receiving side.
+ */
+class SyntheticTraffic : public TrafficSource {
+public:
+    SyntheticTraffic(const std::string &spec, size_t mtu, uint32_t seed);
+
+    bool next(Packet &packet) override;
+    std::string toString() const override;
+
+private:
+    enum class Kind { kTCP, kVoIP, kDNS, kVideo };
+
+    struct Flow {
+        Kind kind;
+        uint32_t idx;
+        uint64_t nextAtNanos;
+
+        // Number of datagrams sent so far and left in the current burst
+        uint64_t numSent{0};
+        uint64_t burstLeft{0};
+        uint64_t burstStartedAtNanos{0};
+
+        bool operator>(const Flow &other) const { return nextAtNanos > other.nextAtNanos; }
+    };
+
+    void makeDatagram(Flow &flow, Packet &packet);
+
+    const std::string _spec;
+    const size_t _mtu;
+    std::mt19937 _rng;
+
+    std::priority_queue<Flow, std::vector<Flow>, std::greater<Flow>> _flows;
+};
+
+/**
+ * Datagrams read from a pcap or pcapng file (with raw IP, Ethernet or Linux cooked link types), to
+ * be written at the times at which they were captured, scaled by `speed` (e.g., 2 replays twice as
+ * fast and 0 as fast as possible). Datagrams, which are not IP, were truncated at capture time or
+ * are larger than `mtu` are skipped.
+ */
+class PcapReplay : public TrafficSource {
+public:
+    PcapReplay(const std::string &path, double speed, size_t mtu);
+
+    bool next(Packet &packet) override;
+    std::string toString() const override;
+
+private:
+    void add(int linkType, uint64_t timestampNanos, uint8_t const *data, size_t capturedSize,
+             size_t originalSize);
+
+    const std::string _path;
+    const double _speed;
+    const size_t _mtu;
+
+    std::vector<Packet> _packets;
+    size_t _numSkipped{0};
+    size_t _next{0};
+};
+
+/**
+ * Matches the datagrams, which come out of the receiving side of the tunnel, to the ones which were
+ * sent and accounts for them per flow (addresses, protocol and ports).
+ */
+class FlowRecorder {
+public:
+    void onSent(uint8_t const *data, size_t size, uint64_t nowNanos);
+
+    /**
+     * Returns the latency of the datagram or nothing if it was not sent through `onSent`.
+     */
+    std::optional<uint64_t> onDelivered(uint8_t const *data, size_t size, uint64_t nowNanos);
+
+    struct FlowStats {
+        std::string desc;
+        uint64_t packetsSent{0};
+        uint64_t bytesSent{0};
+        uint64_t packetsDelivered{0};
+        uint64_t bytesDelivered{0};
+        uint64_t latencySumNanos{0};
+        uint64_t latencyMaxNanos{0};
+    };
+
+    /**
+     * Returns the statistics of all the flows, in descending order of bytes sent.
+     */
+    std::vector<FlowStats> flows() const;
+
+private:
+    struct InFlight {
+        uint64_t sentAtNanos;
+        size_t idxFlow;
+    };
+
+    mutable std::mutex _mutex;
+
+    std::unordered_map<std::string, size_t> _flowsByDesc;
+    std::vector<FlowStats> _flows;
+
+    // Keyed by a hash of the contents of the datagram
+    std::unordered_multimap<uint64_t, InFlight> _inFlight;
+};
+
+} // namespace bench
+} // namespace ruralpi
@@ -26,6 +26,7 @@
 
 #include "client/context.h"
 #include "common/exception.h"
+#include "common/logging.h"
 #include "common/socket_producer_consumer.h"
 #include "common/tun_ctl.h"
 #include "common/tunnel_producer_consumer.h"
@@ -66,14 +67,14 @@ public:
         while (true) {
             try {
                 for (const auto &intf : _ctx.interfaces) {
-                    _socketPC.addSocket(
-                        SocketProducerConsumer::SocketConfig{_connectToServer(intf)});
+                    _socketPC.addSocket(SocketProducerConsumer::SocketConfig{
+                        _connectToServer(intf), size_t(_ctx.zerocopy_min_bytes)});
                 }
 
                 _ctx.waitForExit();
                 break;
             } catch (const ConnRefusedSystemException &ex) {
-                BOOST_LOG_TRIVIAL(trace)
+                RLOG(trace)
                     << "Server not yet ready due to error: " << ex.what() << "; retrying ...";
                 ::sleep(5);
             } catch (const Exception &ex) {
@@ -120,11 +121,15 @@ void clientMain(Context &ctx) {
     BOOST_LOG_TRIVIAL(info) << "Rural Pipe client starting with server " << ctx.serverHost << ':'
                             << ctx.serverPort << " and tunnel interface " << ctx.tunnel_interface
                             << " listening on " << ctx.nqueues << " queues";
+    BOOST_LOG_TRIVIAL(info) << "Tunnel queue threads placement: " << ctx.tunnel_cpus.toString()
+                            << "; socket threads placement: " << ctx.stream_cpus.toString();
 
     // Create the client-side Tunnel device
     TunCtl tunnel(ctx.tunnel_interface, ctx.nqueues);
-    TunnelProducerConsumer tunnelPC(tunnel.getQueues(), tunnel.getMTU());
-    SocketProducerConsumer socketPC(uuidGen() /* clientSessionId */, tunnelPC);
+    TunnelProducerConsumer tunnelPC("client", tunnel.getQueues(), tunnel.getMTU(),
+                                    ctx.tunnel_cpus, ctx.nqueues_min);
+    SocketProducerConsumer socketPC("client", uuidGen() /* clientSessionId */, tunnelPC,
+                                    ctx.stream_cpus, ctx.transform_threads);
     Client client(ctx, socketPC);
 
     BOOST_LOG_TRIVIAL(info) << "Rural Pipe client running";
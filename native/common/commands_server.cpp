@@ -61,7 +61,7 @@ CommandsServer::CommandsServer(asio::io_service &ioService, std::string pipeName
 CommandsServer::~CommandsServer() {}
 
 void CommandsServer::_acceptNext() {
-    auto conn = std::make_shared<UNIXConnection>(_ioService);
+    auto conn = std::make_shared<UNIXConnection>(_ioService, _onCommand);
 
     _acceptor.async_accept(conn->socket(), [this, conn](const boost::system::error_code &error) {
         BOOST_LOG_TRIVIAL(debug) << "Accepted connection: " << error;
@@ -35,8 +35,7 @@ namespace ruralpi {
  */
 class CommandsServer {
 public:
-    // First argument is the command, the rest are its arguments
-    using OnCommandFn = std::function<std::string(std::vector<std::string>)>;
+    using OnCommandFn = ConnectionBase::OnCommandFn;
 
     CommandsServer(boost::asio::io_service &ioService, std::string pipeName, OnCommandFn onCommand);
     ~CommandsServer();
@@ -16,21 +16,20 @@
  * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
  * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE. */
 
-#pragma once
+#include "common/base.h"
 
-#include "common/tunnel_frame.h"
+#include "common/compressing_tunnel_frame_stage.h"
+
+#include <boost/log/trivial.hpp>
 
 namespace ruralpi {
 
-class SigningTunnelFramePipe : public TunnelFramePipe {
-public:
-    SigningTunnelFramePipe(TunnelFramePipe &prev);
-    ~SigningTunnelFramePipe();
+CompressingTunnelFrameStage::CompressingTunnelFrameStage() {
+    BOOST_LOG_TRIVIAL(info) << "Compressing stage attached";
+}
 
-private:
-    // TunnelFramePipe methods
-    void onTunnelFrameFromPrev(TunnelFrameBuffer buf) override;
-    void onTunnelFrameFromNext(TunnelFrameBuffer buf) override;
-};
+CompressingTunnelFrameStage::~CompressingTunnelFrameStage() {
+    BOOST_LOG_TRIVIAL(info) << "Compressing stage detached";
+}
 
 } // namespace ruralpi
@@ -16,32 +16,31 @@
  * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
  * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE. */
 
-#include "common/base.h"
+#pragma once
 
-#include "common/signing_tunnel_frame_pipe.h"
-
-#include <boost/log/trivial.hpp>
+#include "common/tunnel_frame.h"
 
 namespace ruralpi {
 
-SigningTunnelFramePipe::SigningTunnelFramePipe(TunnelFramePipe &prev) : TunnelFramePipe("Signing") {
-    pipePush(prev);
-    BOOST_LOG_TRIVIAL(info) << "Signing pipe attached";
-}
-
-SigningTunnelFramePipe::~SigningTunnelFramePipe() {
-    pipePop();
-    BOOST_LOG_TRIVIAL(info) << "Signing pipe detached";
-}
-
-void SigningTunnelFramePipe::onTunnelFrameFromPrev(TunnelFrameBuffer buf) {
-    // TODO: Sign the contents of buf
-    pipeInvokeNext(buf);
-}
-
-void SigningTunnelFramePipe::onTunnelFrameFromNext(TunnelFrameBuffer buf) {
-    // TODO: Check the signature of the contents of buf
-    pipeInvokePrev(buf);
-}
+/**
+ * Stage of the `StaticTunnelFramePipe` in front of the sockets, which compresses the outgoing
+ * tunnel frames and de-compresses the incoming ones. The compression is not implemented yet, so
+ * for now the frames pass through it unchanged.
+ */
+class CompressingTunnelFrameStage {
+public:
+    static constexpr char kDesc[] = "Compressing";
+
+    CompressingTunnelFrameStage();
+    ~CompressingTunnelFrameStage();
+
+    void onTunnelFrameFromPrev(TunnelFrameBuffer &buf) {
+        // TODO: Compress the contents of buf
+    }
+
+    void onTunnelFrameFromNext(TunnelFrameBuffer &buf) {
+        // TODO: De-compress the contents of buf
+    }
+};
 
 } // namespace ruralpi
@@ -20,12 +20,40 @@
 
 #include "common/connection.h"
 
+#include <boost/algorithm/string.hpp>
+#include <boost/log/trivial.hpp>
+
 namespace ruralpi {
 
-ConnectionBase::ConnectionBase(boost::asio::io_service &ioService) : _ioService(ioService) {}
+ConnectionBase::ConnectionBase(boost::asio::io_service &ioService, OnCommandFn onCommand)
+    : _ioService(ioService), _onCommand(std::move(onCommand)) {}
 
 ConnectionBase::~ConnectionBase() = default;
 
-void ConnectionBase::start() {}
+std::string ConnectionBase::_processCommand(const std::string &line) {
+    const std::string trimmedLine = boost::trim_copy(line);
+
+    std::vector<std::string> args;
+    boost::split(args, trimmedLine, boost::is_space(), boost::token_compress_on);
+    if (args.size() == 1 && args[0].empty())
+        args.clear();
+
+    BOOST_LOG_TRIVIAL(debug) << "Received command: " << boost::join(args, " ");
+
+    std::string response;
+    if (args.empty()) {
+        response = "EMPTY COMMAND";
+    } else {
+        try {
+            response = _onCommand(std::move(args));
+        } catch (const std::exception &ex) {
+            response = std::string("ERROR: ") + ex.what();
+        }
+    }
+
+    if (response.empty() || response.back() != '\n')
+        response += '\n';
+    return response + '\n';
+}
 
 } // namespace ruralpi
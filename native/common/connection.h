@@ -19,33 +19,78 @@
 #pragma once
 
 #include <boost/asio.hpp>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
 
 namespace ruralpi {
 
 /**
- * Contains the base functionality for the two types of connections supported.
+ * Contains the base functionality for the two types of connections supported. A connection reads
+ * text commands (one per line), tokenises them, invokes the `onCommand` handler with the result and
+ * writes its response back, until the other side disconnects.
  */
-class ConnectionBase {
+class ConnectionBase : public std::enable_shared_from_this<ConnectionBase> {
 public:
-    void start();
+    // First argument is the command, the rest are its arguments
+    using OnCommandFn = std::function<std::string(std::vector<std::string>)>;
+
+    virtual void start() = 0;
 
 protected:
-    ConnectionBase(boost::asio::io_service &ioService);
+    ConnectionBase(boost::asio::io_service &ioService, OnCommandFn onCommand);
     virtual ~ConnectionBase();
 
+    /**
+     * Tokenises the command `line` and returns the response to be sent back for it, which is
+     * always terminated with an empty line, so that multi-line responses can be told apart.
+     */
+    std::string _processCommand(const std::string &line);
+
     boost::asio::io_service &_ioService;
+
+    OnCommandFn _onCommand;
 };
 
 template <typename TSocket>
 class Connection : public ConnectionBase {
 public:
-    Connection(boost::asio::io_service &ioService)
-        : ConnectionBase(ioService), _socket(_ioService) {}
+    Connection(boost::asio::io_service &ioService, OnCommandFn onCommand)
+        : ConnectionBase(ioService, std::move(onCommand)), _socket(_ioService) {}
 
     TSocket &socket() { return _socket; }
 
+    void start() override { _readNext(); }
+
 private:
+    void _readNext() {
+        // The connection keeps itself alive for as long as there are operations pending on it
+        auto self = std::static_pointer_cast<Connection>(shared_from_this());
+
+        boost::asio::async_read_until(
+            _socket, _inBuffer, '\n',
+            [this, self](const boost::system::error_code &error, size_t numBytes) {
+                if (error)
+                    return;
+
+                std::string line(numBytes, 0);
+                _inBuffer.sgetn(line.data(), numBytes);
+                _response = _processCommand(line);
+
+                boost::asio::async_write(
+                    _socket, boost::asio::buffer(_response),
+                    [this, self](const boost::system::error_code &error, size_t numBytes) {
+                        if (!error)
+                            _readNext();
+                    });
+            });
+    }
+
     TSocket _socket;
+
+    boost::asio::streambuf _inBuffer;
+    std::string _response;
 };
 
 using UNIXConnection = Connection<boost::asio::local::stream_protocol::socket>;
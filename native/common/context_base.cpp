@@ -23,12 +23,17 @@
 #include <boost/filesystem.hpp>
 #include <boost/log/attributes/named_scope.hpp>
 #include <boost/log/core.hpp>
+#include <boost/log/expressions.hpp>
 #include <boost/log/trivial.hpp>
 #include <boost/log/utility/setup/common_attributes.hpp>
-#include <boost/log/utility/setup/console.hpp>
-#include <boost/log/utility/setup/file.hpp>
 #include <iostream>
 
+#include "common/frame_trace.h"
+#include "common/logging.h"
+#include "common/metrics.h"
+#include "common/pcap_tap.h"
+#include "common/tunnel_frame.h"
+
 namespace ruralpi {
 
 namespace fs = boost::filesystem;
@@ -44,11 +49,23 @@ ContextBase::ContextBase(std::string serviceName)
         ("settings.log", po::value<std::string>(), "The name of the log file to use. If missing, all logging will be sent to the console.")
         ("settings.tunnel_interface", po::value<std::string>(), "Name to use for the tunnel network interface")
         ("settings.nqueues", po::value<int>()->default_value(0), "Number of queues/threads to instantiate to listen on the tunnel device. The default value of 0 lets the system decide.")
+        ("settings.nqueues_min", po::value<int>()->default_value(0), "Number of tunnel queues to keep attached at all times. If non-zero, the rest of the settings.nqueues queues are attached and detached at runtime depending on how busy the attached ones are. The default value of 0 keeps all queues attached.")
+        ("settings.zerocopy_min_bytes", po::value<int>()->default_value(0), "Batches of tunnel frames of at least that many bytes will be sent using MSG_ZEROCOPY, which saves copying them into the kernel at the cost of having to wait for completion notifications. The default value of 0 disables zero-copy.")
+        ("settings.tunnel_cpus", po::value<std::string>()->default_value(""), "CPUs on which to pin the threads servicing the tunnel queues, assigned in the order in which the queues are created. Either empty (no pinning), 'auto' (all CPUs except CPU 0, which services the network interrupts) or a list of CPUs, such as '1,2-3'.")
+        ("settings.stream_cpus", po::value<std::string>()->default_value(""), "CPUs on which to pin the threads receiving from the client/server sockets, assigned in the order in which the sockets are connected. Same format as settings.tunnel_cpus.")
+        ("settings.transform_threads", po::value<int>()->default_value(0), "Number of threads per direction on which to compress, sign, etc the tunnel frames, so that the frames of a single fast stream can be processed by multiple CPUs. The default value of 0 processes each frame on the thread which carries it.")
+        ("settings.pipe_timing", po::value<bool>()->default_value(false), "Whether to record the time spent by each stage of the pipe from the start. Can also be turned on and off at runtime through the 'timing' command.")
     ;
     // clang-format on
 }
 
-ContextBase::~ContextBase() = default;
+ContextBase::~ContextBase() {
+    _ioService.stop();
+    if (_ioThread.joinable())
+        _ioThread.join();
+
+    AsyncLog::stop();
+}
 
 ContextBase::ShouldStart ContextBase::start(int argc, const char *argv[],
                                             CommandsServer::OnCommandFn onCommand) {
@@ -71,31 +88,34 @@ ContextBase::ShouldStart ContextBase::start(int argc, const char *argv[],
 
     tunnel_interface = _vm["settings.tunnel_interface"].as<std::string>();
     nqueues = _vm["settings.nqueues"].as<int>();
+    nqueues_min = _vm["settings.nqueues_min"].as<int>();
+    zerocopy_min_bytes = _vm["settings.zerocopy_min_bytes"].as<int>();
+    tunnel_cpus = CpuAffinity::parse(_vm["settings.tunnel_cpus"].as<std::string>());
+    stream_cpus = CpuAffinity::parse(_vm["settings.stream_cpus"].as<std::string>());
+    transform_threads = _vm["settings.transform_threads"].as<int>();
+    TunnelFramePipe::setTimingEnabled(_vm["settings.pipe_timing"].as<bool>());
 
     // Initialise the logging system
-    if (_vm.count("settings.log")) {
-        logging::add_file_log(logging::keywords::file_name =
-                                  _vm["settings.log"].as<std::string>() + "_%N.log",
-                              logging::keywords::rotation_size = 256 * 1024 * 1024,
-                              logging::keywords::time_based_rotation =
-                                  logging::sinks::file::rotation_at_time_point(0, 0, 0),
-                              logging::keywords::auto_flush = true,
-                              logging::keywords::format = "[%TimeStamp% (%Scope%)]: %Message%");
-
-        logging::core::get()->set_filter(logging::trivial::severity >= logging::trivial::debug);
-    } else {
-        logging::add_console_log(std::cout, boost::log::keywords::format =
-                                                "[%TimeStamp% (%Scope%)] %Message%");
-
-        logging::core::get()->set_filter(logging::trivial::severity >= logging::trivial::debug);
-    }
+    if (_vm.count("settings.log"))
+        AsyncLog::addFileSink(_vm["settings.log"].as<std::string>());
+    else
+        AsyncLog::addConsoleSink(std::cout);
+
+    logging::core::get()->set_filter(logging::trivial::severity >= logging::trivial::debug);
 
     logging::add_common_attributes();
     logging::core::get()->add_global_attribute("Scope", boost::log::attributes::named_scope());
 
     // Instantiate the commands server so that the controlling script can start polling for startup
     // state information
-    _cmdServer.emplace(_ioService, _serviceName, std::move(onCommand));
+    _cmdServer.emplace(_ioService, _serviceName,
+                       [this, onCommand = std::move(onCommand)](std::vector<std::string> args) {
+                           return _onCommand(args, onCommand);
+                       });
+    _ioThread = std::thread([this] {
+        BOOST_LOG_NAMED_SCOPE("commandsServer");
+        _ioService.run();
+    });
 
     return kYes;
 }
@@ -121,4 +141,65 @@ void ContextBase::exit(int exitCode) {
 
 void ContextBase::exit(const Exception &ex) { exit(1); }
 
+std::string ContextBase::_onCommand(const std::vector<std::string> &args,
+                                    const CommandsServer::OnCommandFn &onCommand) {
+    if (args[0] == "stats")
+        return MetricsRegistry::get().snapshot();
+
+    if (args[0] == "timing") {
+        if (args.size() > 1) {
+            if (args[1] != "on" && args[1] != "off")
+                throw Exception("Usage: timing [on|off]");
+            TunnelFramePipe::setTimingEnabled(args[1] == "on");
+        }
+        return TunnelFramePipe::timingEnabled() ? "on" : "off";
+    }
+
+    if (args[0] == "trace") {
+        if (args.size() > 1 && args[1] == "dump") {
+            const std::string path =
+                args.size() > 2 ? args[2]
+                                : (fs::temp_directory_path() /
+                                   boost::str(boost::format("%s_frame_trace.bin") % _serviceName))
+                                      .string();
+            const size_t numEvents = FrameTrace::dump(path);
+            return boost::str(boost::format("Dumped %d events to %s") % numEvents % path);
+        }
+        if (args.size() > 1) {
+            if (args[1] != "on" && args[1] != "off")
+                throw Exception("Usage: trace [on|off|dump [path]]");
+            FrameTrace::setEnabled(args[1] == "on");
+        }
+        return FrameTrace::enabled() ? "on" : "off";
+    }
+
+    if (args[0] == "pcap") {
+        if (args.size() > 2 && args[1] == "start") {
+            PcapTap::Config config;
+            config.pathPrefix = args[2];
+            try {
+                if (args.size() > 3)
+                    config.snapLen = std::stoul(args[3]);
+                if (args.size() > 4)
+                    config.sampleEvery = std::stoul(args[4]);
+                if (args.size() > 5)
+                    config.rotateBytes = std::stoul(args[5]) * 1024 * 1024;
+                if (args.size() > 6)
+                    config.maxFiles = std::stoul(args[6]);
+            } catch (const std::logic_error &) {
+                throw Exception("Usage: pcap start <path prefix> [snaplen [sample every "
+                                "[rotate MB [max files]]]]");
+            }
+            PcapTap::get().start(std::move(config));
+        } else if (args.size() > 1 && args[1] == "stop") {
+            PcapTap::get().stop();
+        } else if (args.size() > 1) {
+            throw Exception("Usage: pcap [start <path prefix> [...]|stop]");
+        }
+        return PcapTap::get().toString();
+    }
+
+    return onCommand(args);
+}
+
 } // namespace ruralpi
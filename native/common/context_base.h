@@ -25,8 +25,10 @@
 #include <functional>
 #include <mutex>
 #include <string>
+#include <thread>
 
 #include "common/commands_server.h"
+#include "common/cpu_affinity.h"
 #include "common/exception.h"
 
 namespace ruralpi {
@@ -44,6 +46,9 @@ public:
     /**
      * Optional method to initialise the logging system and start the process. It can be skipped in
      * unit-tests in which case the logging will be to stdout/stderr.
+     *
+     * The commands which are common to all services (such as `stats`) are handled here and all the
+     * other ones are passed on to `onCommand`.
      */
     enum ShouldStart { kYes, kHelpOnly };
     ShouldStart start(int argc, const char *argv[], CommandsServer::OnCommandFn onCommand);
@@ -69,6 +74,11 @@ public:
     // Common configuration options
     std::string tunnel_interface;
     int nqueues;
+    int nqueues_min;
+    int zerocopy_min_bytes;
+    CpuAffinity tunnel_cpus;
+    CpuAffinity stream_cpus;
+    int transform_threads;
 
 protected:
     boost::program_options::options_description _desc;
@@ -80,9 +90,19 @@ protected:
 private:
     const std::string _serviceName;
 
+    /**
+     * Handles the commands which are common to all services and passes the rest on to the
+     * service-specific `onCommand` handler.
+     */
+    std::string _onCommand(const std::vector<std::string> &args,
+                           const CommandsServer::OnCommandFn &onCommand);
+
     // This is optional, so it can be constructed after the constructor of ContextBase has finished
     boost::optional<CommandsServer> _cmdServer;
 
+    // Thread running `_ioService`, which services the connections to the commands server
+    std::thread _ioThread;
+
     // Protects the mutable state below
     std::mutex _mutex;
     std::condition_variable _condVar;
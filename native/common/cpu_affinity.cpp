@@ -0,0 +1,110 @@
+/**
+ * Copyright 2021 Kaloian Manassiev
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software and
+ * associated documentation files (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge, publish, distribute,
+ * sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or
+ * substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT
+ * NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE. */
+
+#include "common/base.h"
+
+#include "common/cpu_affinity.h"
+
+#include <boost/algorithm/string.hpp>
+#include <pthread.h>
+#include <sched.h>
+#include <sstream>
+#include <unistd.h>
+
+#include "common/exception.h"
+
+namespace ruralpi {
+
+CpuAffinity::CpuAffinity(std::vector<int> cpus) : _cpus(std::move(cpus)) {}
+
+CpuAffinity CpuAffinity::parse(const std::string &spec) {
+    const int numCpus = SYSCALL(::sysconf(_SC_NPROCESSORS_ONLN));
+
+    if (spec.empty())
+        return CpuAffinity();
+
+    std::vector<int> cpus;
+    if (spec == "auto") {
+        for (int cpu = 1; cpu < numCpus; cpu++)
+            cpus.push_back(cpu);
+        return CpuAffinity(std::move(cpus));
+    }
+
+    std::vector<std::string> tokens;
+    boost::split(tokens, spec, boost::is_any_of(","));
+    for (auto &token : tokens) {
+        boost::trim(token);
+
+        int first, last;
+        try {
+            auto dash = token.find('-');
+            first = std::stoi(token.substr(0, dash));
+            last = (dash == std::string::npos) ? first : std::stoi(token.substr(dash + 1));
+        } catch (const std::exception &) {
+            throw Exception(boost::format("Invalid CPU affinity specification '%s'") % spec);
+        }
+
+        if (first < 0 || last < first || last >= numCpus)
+            throw Exception(boost::format("Invalid CPU range '%s' in affinity specification '%s' "
+                                          "(there are %d CPUs online)") %
+                            token % spec % numCpus);
+
+        for (int cpu = first; cpu <= last; cpu++)
+            cpus.push_back(cpu);
+    }
+
+    return CpuAffinity(std::move(cpus));
+}
+
+int CpuAffinity::cpuFor(size_t idx) const {
+    if (_cpus.empty())
+        return -1;
+    return _cpus[idx % _cpus.size()];
+}
+
+int CpuAffinity::pinCurrentThread(size_t idx) const {
+    const int cpu = cpuFor(idx);
+    if (cpu < 0)
+        return cpu;
+
+    cpu_set_t cpuSet;
+    CPU_ZERO(&cpuSet);
+    CPU_SET(cpu, &cpuSet);
+
+    // Unlike the other system calls, this one returns the error code instead of setting `errno`
+    int res = ::pthread_setaffinity_np(::pthread_self(), sizeof(cpuSet), &cpuSet);
+    if (res != 0) {
+        errno = res;
+        SystemException::throwFromErrno(boost::format("Unable to pin thread to CPU %d") % cpu);
+    }
+
+    return cpu;
+}
+
+std::string CpuAffinity::toString() const {
+    if (_cpus.empty())
+        return "unpinned";
+
+    std::stringstream ss;
+    ss << "CPUs";
+    for (int cpu : _cpus)
+        ss << ' ' << cpu;
+    return ss.str();
+}
+
+} // namespace ruralpi
@@ -0,0 +1,64 @@
+/**
+ * Copyright 2021 Kaloian Manassiev
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software and
+ * associated documentation files (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge, publish, distribute,
+ * sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or
+ * substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT
+ * NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE. */
+
+#pragma once
+
+#include <string>
+#include <vector>
+
+namespace ruralpi {
+
+/**
+ * Describes on which CPUs a set of data-plane threads (such as the ones servicing the tunnel queues
+ * or the socket streams) should run. The threads are numbered in the order in which they are
+ * started and the `idx`'th one is pinned to CPU `cpus[idx % cpus.size()]`. An empty set of CPUs
+ * means that the threads are not pinned and are left to the scheduler.
+ */
+class CpuAffinity {
+public:
+    CpuAffinity() = default;
+
+    /**
+     * Parses an affinity specification, which is either empty (no pinning), "auto" or a comma
+     * separated list of CPUs and CPU ranges, such as "1,2-3".
+     *
+     * The "auto" policy uses all the online CPUs except for CPU 0, which is where the Raspberry Pi
+     * delivers all the network and USB interrupts (and the associated softirq processing). On
+     * single-CPU machines it doesn't pin.
+     */
+    static CpuAffinity parse(const std::string &spec);
+
+    /**
+     * Returns the CPU on which the `idx`'th thread should be pinned, or -1 if it shouldn't be.
+     */
+    int cpuFor(size_t idx) const;
+
+    /**
+     * Pins the calling thread to the CPU for the `idx`'th thread (if any) and returns that CPU.
+     */
+    int pinCurrentThread(size_t idx) const;
+
+    std::string toString() const;
+
+private:
+    CpuAffinity(std::vector<int> cpus);
+
+    std::vector<int> _cpus;
+};
+
+} // namespace ruralpi
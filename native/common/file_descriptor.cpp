@@ -76,7 +76,30 @@ int FileDescriptor::read(void *buf, size_t nbytes) {
             throw SystemException(
                 boost::format("Failed to read from closed file descriptor (%d): %s") % _fd % _desc);
         } else if (nRead < 0 && (errno == EWOULDBLOCK || errno == EAGAIN)) {
-            poll(Milliseconds(-1), POLLIN);
+            _waitUntilReady(POLLIN);
+        }
+    }
+}
+
+int FileDescriptor::readvNonBlocking(const struct iovec *iov, int iovcnt) {
+    int nRead = ::readv(_fd, iov, iovcnt);
+    if (nRead < 0 && (errno == EWOULDBLOCK || errno == EAGAIN))
+        return nRead;
+
+    SYSCALL_MSG(nRead, boost::format("Failed to read from file descriptor (%d): %s") % _fd % _desc);
+    return nRead;
+}
+
+int FileDescriptor::readv(const struct iovec *iov, int iovcnt) {
+    while (true) {
+        int nRead = readvNonBlocking(iov, iovcnt);
+        if (nRead > 0) {
+            return nRead;
+        } else if (nRead == 0) {
+            throw SystemException(
+                boost::format("Failed to read from closed file descriptor (%d): %s") % _fd % _desc);
+        } else if (nRead < 0 && (errno == EWOULDBLOCK || errno == EAGAIN)) {
+            _waitUntilReady(POLLIN);
         }
     }
 }
@@ -100,16 +123,89 @@ int FileDescriptor::write(void const *buf, size_t nbytes) {
             throw SystemException(
                 boost::format("Failed to write to closed file descriptor (%d): %s") % _fd % _desc);
         } else if (nWritten < 0 && (errno == EWOULDBLOCK || errno == EAGAIN)) {
-            poll(Milliseconds(-1), POLLOUT);
+            _waitUntilReady(POLLOUT);
         }
     }
 }
 
-int FileDescriptor::poll(Milliseconds timeout, short events) {
+int FileDescriptor::writevNonBlocking(const struct iovec *iov, int iovcnt) {
+    int nWritten = ::writev(_fd, iov, iovcnt);
+    if (nWritten < 0 && (errno == EWOULDBLOCK || errno == EAGAIN))
+        return nWritten;
+
+    SYSCALL_MSG(nWritten,
+                boost::format("Failed to write to file descriptor (%d): %s") % _fd % _desc);
+    return nWritten;
+}
+
+int FileDescriptor::writev(const struct iovec *iov, int iovcnt) {
+    while (true) {
+        int nWritten = writevNonBlocking(iov, iovcnt);
+        if (nWritten > 0) {
+            return nWritten;
+        } else if (nWritten == 0) {
+            throw SystemException(
+                boost::format("Failed to write to closed file descriptor (%d): %s") % _fd % _desc);
+        } else if (nWritten < 0 && (errno == EWOULDBLOCK || errno == EAGAIN)) {
+            _waitUntilReady(POLLOUT);
+        }
+    }
+}
+
+int FileDescriptor::sendmsgNonBlocking(const struct msghdr *msg, int flags) {
+    int nWritten = ::sendmsg(_fd, msg, flags);
+    if (nWritten < 0 && (errno == EWOULDBLOCK || errno == EAGAIN))
+        return nWritten;
+
+    SYSCALL_MSG(nWritten, boost::format("Failed to send to socket (%d): %s") % _fd % _desc);
+    return nWritten;
+}
+
+int FileDescriptor::sendmsg(const struct msghdr *msg, int flags) {
+    while (true) {
+        int nWritten = sendmsgNonBlocking(msg, flags);
+        if (nWritten > 0) {
+            return nWritten;
+        } else if (nWritten == 0) {
+            throw SystemException(
+                boost::format("Failed to send to closed socket (%d): %s") % _fd % _desc);
+        } else if (nWritten < 0 && (errno == EWOULDBLOCK || errno == EAGAIN)) {
+            _waitUntilReady(POLLOUT);
+        }
+    }
+}
+
+short FileDescriptor::poll(Milliseconds timeout, short events) {
     pollfd fd;
     fd.fd = _fd;
     fd.events = events;
-    return SYSCALL(::poll(&fd, 1, timeout.count()));
+    fd.revents = 0;
+    SYSCALL(::poll(&fd, 1, timeout.count()));
+    return fd.revents;
+}
+
+void FileDescriptor::_waitUntilReady(short events) {
+    const short revents = poll(Milliseconds(-1), events);
+    if (revents & (events | POLLHUP))
+        return;
+    if (revents & POLLNVAL)
+        throw SystemException(boost::format("Polled invalid file descriptor (%d): %s") % _fd %
+                              _desc);
+    if (!(revents & POLLERR))
+        return;
+
+    // POLLERR is also raised while there are MSG_ZEROCOPY completions on the socket's error queue,
+    // so only a pending socket error is an actual failure. The sockets which send with zero-copy
+    // are blocking (see `TunnelFrameStream`), so they never wait here.
+    int err = 0;
+    socklen_t errLen = sizeof(err);
+    SYSCALL_MSG(::getsockopt(_fd, SOL_SOCKET, SO_ERROR, &err, &errLen),
+                boost::format("Error condition on file descriptor (%d): %s") % _fd % _desc);
+    if (err) {
+        errno = err;
+        SystemException::throwFromErrno(
+            boost::format("Error condition on file descriptor (%d): %s") % _fd % _desc);
+    }
 }
 
 std::string FileDescriptor::toString() const {
@@ -20,8 +20,10 @@
 
 #include <fcntl.h>
 #include <string>
+#include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 
 namespace ruralpi {
 
@@ -47,16 +49,32 @@ public:
     int readNonBlocking(void *buf, size_t nbytes);
     int read(void *buf, size_t nbytes);
 
+    int readvNonBlocking(const struct iovec *iov, int iovcnt);
+    int readv(const struct iovec *iov, int iovcnt);
+
     int writeNonBlocking(void const *buf, size_t nbytes);
     int write(void const *buf, size_t nbytes);
 
-    int poll(Milliseconds timeout, short events);
+    int writevNonBlocking(const struct iovec *iov, int iovcnt);
+    int writev(const struct iovec *iov, int iovcnt);
+
+    int sendmsgNonBlocking(const struct msghdr *msg, int flags);
+    int sendmsg(const struct msghdr *msg, int flags);
+
+    /**
+     * Waits for up to `timeout` for any of `events` and returns the `revents` reported for the file
+     * descriptor, which may include POLLERR, POLLHUP or POLLNVAL regardless of `events`.
+     */
+    short poll(Milliseconds timeout, short events);
 
     operator int() const { return _fd; }
 
     std::string toString() const;
 
 protected:
+    // Blocks until the file descriptor is ready for `events` and throws if it reports an error
+    void _waitUntilReady(short events);
+
     // Description used for debugging and diagnostics purposes
     std::string _desc;
 
@@ -0,0 +1,143 @@
+/**
+ * Copyright 2021 Kaloian Manassiev
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software and
+ * associated documentation files (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge, publish, distribute,
+ * sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or
+ * substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT
+ * NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE. */
+
+#include "common/base.h"
+
+#include "common/frame_trace.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <mutex>
+#include <vector>
+
+#include "common/exception.h"
+
+namespace ruralpi {
+namespace {
+
+struct Ring {
+    // Number of events recorded in the ring so far, the last `kRingSize` of which are still in it.
+    // Only incremented by the owning thread, after the event has been written.
+    std::atomic_uint64_t head{0};
+
+    // Set when the owning thread exits, so that the ring can be reused by a new thread
+    std::atomic_bool free{false};
+
+    FrameTrace::Event events[FrameTrace::kRingSize];
+};
+
+// The rings of all threads, which have recorded events so far. The rings of exited threads are kept
+// (so that their events can still be dumped) until they are reused by new threads.
+std::mutex ringsMutex;
+std::vector<std::unique_ptr<Ring>> rings;
+
+Ring &currentThreadRing() {
+    struct RingOwner {
+        RingOwner() {
+            std::lock_guard lg(ringsMutex);
+            for (auto &candidate : rings) {
+                if (candidate->free.load()) {
+                    candidate->free.store(false);
+                    ring = candidate.get();
+                    return;
+                }
+            }
+
+            RASSERT(rings.size() <= UINT8_MAX);
+            rings.push_back(std::make_unique<Ring>());
+            ring = rings.back().get();
+        }
+
+        ~RingOwner() { ring->free.store(true); }
+
+        Ring *ring;
+    };
+    thread_local RingOwner owner;
+
+    return *owner.ring;
+}
+
+} // namespace
+
+constexpr char FrameTrace::FileHeader::kMagic[8];
+
+std::atomic_bool FrameTrace::_enabled{true};
+
+void FrameTrace::_record(Stage stage, uint64_t seqNum, uint32_t size, uint16_t stream) {
+    const auto now = std::chrono::steady_clock::now().time_since_epoch();
+    auto &ring = currentThreadRing();
+
+    const uint64_t head = ring.head.load(std::memory_order_relaxed);
+    auto &event = ring.events[head % kRingSize];
+    event.timestampNanos = std::chrono::duration_cast<std::chrono::nanoseconds>(now).count();
+    event.seqNum = seqNum;
+    event.size = size;
+    event.stream = stream;
+    event.stage = stage;
+    event.thread = 0;
+    ring.head.store(head + 1, std::memory_order_release);
+}
+
+size_t FrameTrace::dump(const std::string &path) {
+    std::vector<Event> events;
+    {
+        std::lock_guard lg(ringsMutex);
+
+        std::vector<Event> ringEvents(kRingSize);
+        for (size_t idxRing = 0; idxRing < rings.size(); idxRing++) {
+            auto &ring = *rings[idxRing];
+
+            // The owning thread keeps recording while the ring is being copied, so only the events
+            // which it could not have overwritten in the meantime (including the one it might be
+            // in the middle of writing) are kept. Rings can't be claimed while `ringsMutex` is
+            // held, so there is no writer for the free ones.
+            const int64_t headBefore = ring.head.load(std::memory_order_acquire);
+            memcpy(ringEvents.data(), ring.events, sizeof(ring.events));
+            const int64_t headAfter = ring.head.load(std::memory_order_acquire);
+            const int64_t numInProgress = ring.free.load() ? 0 : 1;
+
+            const int64_t first = std::max({int64_t(0), headBefore - int64_t(kRingSize),
+                                            headAfter + numInProgress - int64_t(kRingSize)});
+            for (int64_t i = first; i < headBefore; i++) {
+                events.push_back(ringEvents[i % kRingSize]);
+                events.back().thread = idxRing;
+            }
+        }
+    }
+
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    if (!out)
+        throw Exception(boost::format("Unable to open %s for writing the frame trace") % path);
+
+    FileHeader header;
+    memcpy(header.magic, FileHeader::kMagic, sizeof(header.magic));
+    header.version = FileHeader::kVersion;
+    header.eventSize = sizeof(Event);
+    header.numEvents = events.size();
+
+    out.write((char const *)&header, sizeof(header));
+    out.write((char const *)events.data(), events.size() * sizeof(Event));
+    if (!out)
+        throw Exception(boost::format("Unable to write the frame trace to %s") % path);
+
+    return events.size();
+}
+
+} // namespace ruralpi
@@ -0,0 +1,104 @@
+/**
+ * Copyright 2021 Kaloian Manassiev
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software and
+ * associated documentation files (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge, publish, distribute,
+ * sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or
+ * substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT
+ * NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE. */
+
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <string>
+
+#include "common/tunnel_frame.h"
+
+namespace ruralpi {
+
+/**
+ * Always-on, low-overhead trace of the path of the tunnel frames through the pipe. Each thread
+ * records compact binary events in a ring of its own (so recording takes no locks and touches no
+ * shared cache lines) and the rings of all threads can be dumped to a file at any time, without
+ * stopping the threads, to be turned into a timeline by the `decode_frame_trace.py` tool.
+ */
+class FrameTrace {
+public:
+    // Number of most recent events, which are kept per thread
+    static constexpr size_t kRingSize = 4096;
+
+    enum Stage : uint8_t {
+        kFrameClosed = 1,   // The tunnel finished packing datagrams in a frame
+        kFrameNotReady = 2, // The tunnel queued a frame instead of passing it on, because no stream
+                            // is connected, all streams are busy or earlier frames are still queued
+        kFrameSent = 3,     // A stream sent a frame to the other side
+        kFrameReceived = 4, // A stream received a frame from the other side
+        kFrameWritten = 5,  // The tunnel wrote the datagrams of a received frame to the device
+        kFrameDropped = 6,  // The tunnel dropped a frame, which was not ready for too long
+    };
+
+    // The dumped events are stored in this format, in the native (little-endian) byte order
+    struct Event {
+        uint64_t timestampNanos;
+        uint64_t seqNum;
+        uint32_t size;
+        uint16_t stream;
+        uint8_t stage;
+        uint8_t thread;
+    };
+    static_assert(sizeof(Event) == 24);
+
+    // The dump file starts with this header, followed by `numEvents` events
+    struct FileHeader {
+        static constexpr char kMagic[8] = "RPTRACE";
+        static constexpr uint32_t kVersion = 1;
+
+        char magic[8];
+        uint32_t version;
+        uint32_t eventSize;
+        uint64_t numEvents;
+    };
+    static_assert(sizeof(FileHeader) == 24);
+
+    /**
+     * Records an event for the calling thread. The `stream` is the tunnel queue or the socket on
+     * which the frame was seen. The frame variant takes the sequence number from the frame header.
+     */
+    static void record(Stage stage, uint64_t seqNum, uint32_t size, uint16_t stream) {
+        if (enabled())
+            _record(stage, seqNum, size, stream);
+    }
+    static void recordFrame(Stage stage, uint8_t const *data, size_t size, uint16_t stream) {
+        if (enabled())
+            _record(stage,
+                    size >= sizeof(TunnelFrameHeader) ? ((TunnelFrameHeader const *)data)->seqNum
+                                                      : 0,
+                    size, stream);
+    }
+
+    static void setEnabled(bool enabled) { _enabled.store(enabled, std::memory_order_relaxed); }
+    static bool enabled() { return _enabled.load(std::memory_order_relaxed); }
+
+    /**
+     * Writes the events currently in the rings of all threads (including the ones which have
+     * exited) to `path` and returns their number.
+     */
+    static size_t dump(const std::string &path);
+
+private:
+    static void _record(Stage stage, uint64_t seqNum, uint32_t size, uint16_t stream);
+
+    static std::atomic_bool _enabled;
+};
+
+} // namespace ruralpi
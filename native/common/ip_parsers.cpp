@@ -20,12 +20,36 @@
 
 #include "common/ip_parsers.h"
 
+#include <cstring>
+#include <netinet/ip6.h>
 #include <sstream>
 
 namespace ruralpi {
 
 namespace asio = boost::asio;
 
+namespace {
+
+// Finalisation step of MurmurHash3, which spreads the bits of `h` evenly
+uint32_t mix(uint32_t h) {
+    h ^= h >> 16;
+    h *= 0x85ebca6b;
+    h ^= h >> 13;
+    h *= 0xc2b2ae35;
+    h ^= h >> 16;
+    return h;
+}
+
+uint32_t combine(uint32_t h, uint32_t value) { return mix(h ^ (value + 0x9e3779b9 + (h << 6))); }
+
+uint32_t readU32(uint8_t const *p) {
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+} // namespace
+
 std::string ICMP::toString() const {
     std::stringstream ss;
     ss << " type: " << (int)type << " code: " << int(code);
@@ -58,4 +82,51 @@ std::string IP::toString() const {
     return ss.str();
 }
 
+uint32_t IP::flowHash(uint8_t const *data, size_t size) {
+    if (size < sizeof(iphdr))
+        return 0;
+
+    uint32_t h = 0;
+    uint8_t protocol;
+    size_t transportOffset;
+    bool hasTransportHeader;
+
+    switch (data[0] >> 4) {
+    case 4: {
+        const auto &ip = IP::read(data);
+        h = combine(combine(h, ip.saddr), ip.daddr);
+        protocol = ip.protocol;
+        transportOffset = ip.ihl * 4;
+        // Only the first fragment carries the ports, so they are left out of the hash for all the
+        // fragments (including the first one), in order to keep them on the same queue
+        hasTransportHeader = !(ip.frag_off & htons(IP_MF | IP_OFFMASK));
+        break;
+    }
+    case 6: {
+        if (size < sizeof(ip6_hdr))
+            return 0;
+        const auto &ip6 = *((ip6_hdr const *)data);
+        for (size_t i = 0; i < sizeof(in6_addr); i += sizeof(uint32_t)) {
+            h = combine(h, readU32(((uint8_t const *)&ip6.ip6_src) + i));
+            h = combine(h, readU32(((uint8_t const *)&ip6.ip6_dst) + i));
+        }
+        protocol = ip6.ip6_nxt;
+        transportOffset = sizeof(ip6_hdr);
+        hasTransportHeader = true;
+        break;
+    }
+    default:
+        return 0;
+    }
+
+    h = combine(h, protocol);
+
+    // Both TCP and UDP start with the source and destination ports
+    if ((protocol == IPPROTO_TCP || protocol == IPPROTO_UDP) && hasTransportHeader &&
+        size >= transportOffset + sizeof(uint32_t))
+        h = combine(h, readU32(data + transportOffset));
+
+    return h;
+}
+
 } // namespace ruralpi
@@ -60,6 +60,13 @@ struct IP : public StructCast<IP, iphdr> {
     }
 
     std::string toString() const;
+
+    /**
+     * Returns a hash of the flow (addresses, protocol and, if present, ports) to which the IPv4 or
+     * IPv6 datagram of `size` bytes pointed to by `data` belongs. All datagrams of the same flow
+     * produce the same hash, and datagrams which can't be parsed all hash to 0.
+     */
+    static uint32_t flowHash(uint8_t const *data, size_t size);
 };
 
 } // namespace ruralpi
@@ -0,0 +1,145 @@
+/**
+ * Copyright 2021 Kaloian Manassiev
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software and
+ * associated documentation files (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge, publish, distribute,
+ * sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or
+ * substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT
+ * NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE. */
+
+#include "common/base.h"
+
+#include "common/logging.h"
+
+#include <atomic>
+#include <boost/core/null_deleter.hpp>
+#include <boost/log/core.hpp>
+#include <boost/log/sinks/async_frontend.hpp>
+#include <boost/log/sinks/text_file_backend.hpp>
+#include <boost/log/sinks/text_ostream_backend.hpp>
+#include <boost/log/sinks/unbounded_fifo_queue.hpp>
+#include <boost/log/utility/setup/formatter_parser.hpp>
+#include <functional>
+#include <mutex>
+#include <vector>
+
+#include "common/metrics.h"
+
+namespace ruralpi {
+namespace {
+
+namespace logging = boost::log;
+namespace sinks = boost::log::sinks;
+
+/**
+ * Queueing strategy for `asynchronous_sink`, which bounds the lock-free queue used by
+ * `unbounded_fifo_queue` by keeping count of the records in it and drops (and counts) the records
+ * which don't fit.
+ */
+class BoundedLockFreeQueue : public sinks::unbounded_fifo_queue {
+protected:
+    BoundedLockFreeQueue() : _dropped(MetricsRegistry::get().counter("log.dropped")) {}
+
+    template <typename ArgsT>
+    explicit BoundedLockFreeQueue(ArgsT const &args)
+        : sinks::unbounded_fifo_queue(args),
+          _dropped(MetricsRegistry::get().counter("log.dropped")) {}
+
+    void enqueue(logging::record_view const &rec) {
+        if (_size.fetch_add(1, std::memory_order_relaxed) >= AsyncLog::kQueueCapacity) {
+            _size.fetch_sub(1, std::memory_order_relaxed);
+            _dropped.add();
+            return;
+        }
+        sinks::unbounded_fifo_queue::enqueue(rec);
+    }
+
+    bool try_enqueue(logging::record_view const &rec) {
+        enqueue(rec);
+        return true;
+    }
+
+    bool try_dequeue_ready(logging::record_view &rec) {
+        return dequeued(sinks::unbounded_fifo_queue::try_dequeue_ready(rec));
+    }
+
+    bool try_dequeue(logging::record_view &rec) {
+        return dequeued(sinks::unbounded_fifo_queue::try_dequeue(rec));
+    }
+
+    bool dequeue_ready(logging::record_view &rec) {
+        return dequeued(sinks::unbounded_fifo_queue::dequeue_ready(rec));
+    }
+
+private:
+    bool dequeued(bool success) {
+        if (success)
+            _size.fetch_sub(1, std::memory_order_relaxed);
+        return success;
+    }
+
+    std::atomic<size_t> _size{0};
+    Counter &_dropped;
+};
+
+const char kFileFormat[] = "[%TimeStamp% (%Scope%)]: %Message%";
+const char kConsoleFormat[] = "[%TimeStamp% (%Scope%)] %Message%";
+
+using FileSink = sinks::asynchronous_sink<sinks::text_file_backend, BoundedLockFreeQueue>;
+using ConsoleSink = sinks::asynchronous_sink<sinks::text_ostream_backend, BoundedLockFreeQueue>;
+
+// Stops each of the sinks added so far, which must be done before exiting
+std::mutex sinksMutex;
+std::vector<std::function<void()>> sinkStoppers;
+
+template <typename Sink>
+void addSink(boost::shared_ptr<Sink> sink, const char *format) {
+    sink->set_formatter(logging::parse_formatter(format));
+    logging::core::get()->add_sink(sink);
+
+    std::lock_guard lg(sinksMutex);
+    sinkStoppers.push_back([sink] {
+        // Once the sink is removed from the core, no more records are queued to it, so after the
+        // writer thread stops, the remaining ones can be flushed from the calling thread
+        logging::core::get()->remove_sink(sink);
+        sink->stop();
+        sink->flush();
+    });
+}
+
+} // namespace
+
+void AsyncLog::addFileSink(const std::string &pathPrefix) {
+    auto sink = boost::make_shared<FileSink>(
+        logging::keywords::file_name = pathPrefix + "_%N.log",
+        logging::keywords::rotation_size = 256 * 1024 * 1024,
+        logging::keywords::time_based_rotation = sinks::file::rotation_at_time_point(0, 0, 0),
+        logging::keywords::auto_flush = true);
+    addSink(sink, kFileFormat);
+}
+
+void AsyncLog::addConsoleSink(std::ostream &os) {
+    auto sink = boost::make_shared<ConsoleSink>();
+    sink->locked_backend()->add_stream(boost::shared_ptr<std::ostream>(&os, boost::null_deleter()));
+    sink->locked_backend()->auto_flush(true);
+    addSink(sink, kConsoleFormat);
+}
+
+void AsyncLog::stop() {
+    std::lock_guard lg(sinksMutex);
+
+    for (auto &stopSink : sinkStoppers)
+        stopSink();
+    sinkStoppers.clear();
+}
+
+} // namespace ruralpi
@@ -0,0 +1,74 @@
+/**
+ * Copyright 2021 Kaloian Manassiev
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software and
+ * associated documentation files (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge, publish, distribute,
+ * sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or
+ * substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT
+ * NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE. */
+
+#pragma once
+
+#include <boost/log/trivial.hpp>
+#include <ostream>
+#include <string>
+
+// Log records with severity below this level (as a number of `boost::log::trivial::severity_level`,
+// 0 being trace) are removed at compile time. Release builds remove the trace records.
+#ifndef RURALPI_LOG_MIN_SEVERITY
+#define RURALPI_LOG_MIN_SEVERITY 0
+#endif
+
+/**
+ * Same as BOOST_LOG_TRIVIAL, except that records with severity below RURALPI_LOG_MIN_SEVERITY are
+ * compiled out entirely (including the evaluation of their arguments), instead of being filtered
+ * at runtime. Intended for the trace and debug records on the data path.
+ *
+ * The record is the body of a loop (rather than an `if`), so that an `else` following the macro
+ * always binds to the caller's own `if`.
+ */
+#define RLOG(lvl)                                                                                  \
+    for (bool rlogEnabled = ::boost::log::trivial::lvl >= RURALPI_LOG_MIN_SEVERITY; rlogEnabled;   \
+         rlogEnabled = false)                                                                      \
+    BOOST_LOG_TRIVIAL(lvl)
+
+namespace ruralpi {
+
+/**
+ * Logging sinks, which take the formatting and writing of the log records off the threads which
+ * produce them. The records are put on a bounded lock-free queue and written out by a dedicated
+ * thread. If that thread falls behind (for example because the SD card is slow), the records which
+ * don't fit in the queue are dropped instead of blocking the producers and counted in the
+ * "log.dropped" counter.
+ */
+class AsyncLog {
+public:
+    static constexpr size_t kQueueCapacity = 8192;
+
+    /**
+     * Writes the log to files named `pathPrefix`_N.log, which are rotated daily and at 256MB.
+     */
+    static void addFileSink(const std::string &pathPrefix);
+
+    /**
+     * Writes the log to `os`, which must stay valid until `stop` is called.
+     */
+    static void addConsoleSink(std::ostream &os);
+
+    /**
+     * Writes out the records still in the queues and stops the writer threads. Records logged after
+     * this call no longer reach the sinks added so far.
+     */
+    static void stop();
+};
+
+} // namespace ruralpi
@@ -0,0 +1,130 @@
+/**
+ * Copyright 2021 Kaloian Manassiev
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software and
+ * associated documentation files (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge, publish, distribute,
+ * sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or
+ * substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT
+ * NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE. */
+
+#include "common/base.h"
+
+#include "common/metrics.h"
+
+#include <sstream>
+
+namespace ruralpi {
+
+size_t currentThreadMetricsShard() {
+    static std::atomic_size_t nextShard{0};
+    thread_local const size_t shard = nextShard++ % Counter::kNumShards;
+    return shard;
+}
+
+uint64_t Counter::value() const {
+    uint64_t value = 0;
+    for (const auto &shard : _shards)
+        value += shard.value.load(std::memory_order_relaxed);
+    return value;
+}
+
+uint64_t Histogram::bucketUpperBound(size_t bucket) {
+    if (bucket < kSubBucketCount)
+        return bucket;
+    const size_t shift = bucket / kSubBucketCount - 1;
+    const uint64_t lowerBound = uint64_t(kSubBucketCount + bucket % kSubBucketCount) << shift;
+    return lowerBound + ((uint64_t(1) << shift) - 1);
+}
+
+uint64_t Histogram::Snapshot::quantile(double q) const {
+    if (!count)
+        return 0;
+
+    const uint64_t rank = std::max(uint64_t(1), uint64_t(q * count + 0.5));
+    uint64_t seen = 0;
+    for (size_t i = 0; i < kNumBuckets; i++) {
+        seen += buckets[i];
+        if (seen >= rank)
+            return bucketUpperBound(i);
+    }
+
+    return UINT64_MAX;
+}
+
+std::string Histogram::Snapshot::toString() const {
+    std::stringstream ss;
+    ss << "count=" << count << " mean=" << (count ? sum / count : 0) << " p50=" << quantile(0.5)
+       << " p99=" << quantile(0.99) << " p999=" << quantile(0.999) << " max=" << quantile(1.0);
+    return ss.str();
+}
+
+Histogram::Snapshot Histogram::snapshot() const {
+    Snapshot snapshot;
+    for (const auto &shard : _shards) {
+        for (size_t i = 0; i < kNumBuckets; i++) {
+            const uint64_t n = shard.buckets[i].load(std::memory_order_relaxed);
+            snapshot.buckets[i] += n;
+            snapshot.count += n;
+        }
+        snapshot.sum += shard.sum.load(std::memory_order_relaxed);
+    }
+    return snapshot;
+}
+
+MetricsRegistry &MetricsRegistry::get() {
+    static MetricsRegistry registry;
+    return registry;
+}
+
+Counter &MetricsRegistry::counter(const std::string &name) {
+    std::lock_guard lg(_mutex);
+    auto &metric = _counters[name];
+    if (!metric)
+        metric = std::make_unique<Counter>();
+    return *metric;
+}
+
+Gauge &MetricsRegistry::gauge(const std::string &name) {
+    std::lock_guard lg(_mutex);
+    auto &metric = _gauges[name];
+    if (!metric)
+        metric = std::make_unique<Gauge>();
+    return *metric;
+}
+
+Histogram &MetricsRegistry::histogram(const std::string &name) {
+    std::lock_guard lg(_mutex);
+    auto &metric = _histograms[name];
+    if (!metric)
+        metric = std::make_unique<Histogram>();
+    return *metric;
+}
+
+std::string MetricsRegistry::snapshot() const {
+    std::map<std::string, std::string> values;
+    {
+        std::lock_guard lg(_mutex);
+        for (const auto &[name, counter] : _counters)
+            values[name] = std::to_string(counter->value());
+        for (const auto &[name, gauge] : _gauges)
+            values[name] = std::to_string(gauge->value());
+        for (const auto &[name, histogram] : _histograms)
+            values[name] = histogram->snapshot().toString();
+    }
+
+    std::stringstream ss;
+    for (const auto &[name, value] : values)
+        ss << name << ' ' << value << std::endl;
+    return ss.str();
+}
+
+} // namespace ruralpi
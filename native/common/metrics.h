@@ -0,0 +1,173 @@
+/**
+ * Copyright 2021 Kaloian Manassiev
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software and
+ * associated documentation files (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge, publish, distribute,
+ * sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or
+ * substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT
+ * NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE. */
+
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+
+namespace ruralpi {
+
+// Size of the cache line on all the platforms on which the pipe runs. Metrics, which are updated
+// from different threads are aligned on it, so that they don't false-share.
+constexpr size_t kCacheLineSize = 64;
+
+/**
+ * Returns the index of the shard, which the calling thread updates in all sharded metrics. The
+ * threads are assigned shards in the order in which they first update a metric, so as long as
+ * there are no more than `kNumShards` of them, each one has a shard of its own.
+ */
+size_t currentThreadMetricsShard();
+
+/**
+ * Monotonically increasing counter. Each thread increments its own cache line, so concurrent
+ * increments from the data-plane threads neither contend nor false-share and the shards are only
+ * summed up when the value is read.
+ */
+class Counter {
+public:
+    static constexpr size_t kNumShards = 16;
+
+    void add(uint64_t n = 1) {
+        _shards[currentThreadMetricsShard()].value.fetch_add(n, std::memory_order_relaxed);
+    }
+
+    uint64_t value() const;
+
+private:
+    struct alignas(kCacheLineSize) Shard {
+        std::atomic_uint64_t value{0};
+    };
+    std::array<Shard, kNumShards> _shards;
+};
+
+/**
+ * Value, which can go up and down, such as the depth of a queue.
+ */
+class Gauge {
+public:
+    void set(int64_t value) { _value.store(value, std::memory_order_relaxed); }
+    void add(int64_t n) { _value.fetch_add(n, std::memory_order_relaxed); }
+
+    int64_t value() const { return _value.load(std::memory_order_relaxed); }
+
+private:
+    alignas(kCacheLineSize) std::atomic_int64_t _value{0};
+};
+
+/**
+ * Distribution of values (such as latencies), recorded in log-linear buckets (like in HDR
+ * histograms): each power-of-two range is split in `kSubBucketCount` equal buckets, so the
+ * relative error of the reported quantiles is bounded by 1/`kSubBucketCount` across the whole
+ * range of values, while recording a value is just a couple of bit operations and an increment.
+ *
+ * Like the counter, the histogram is sharded by thread, but because each shard holds all the
+ * buckets (about 4KB), it only has `kNumShards` of them, which the threads share round-robin. The
+ * recording threads of a single histogram are usually just a couple (such as the transform workers
+ * of one direction), so this keeps contention low while keeping the footprint at ~16KB.
+ */
+class Histogram {
+public:
+    static constexpr size_t kSubBucketBits = 3;
+    static constexpr size_t kSubBucketCount = 1 << kSubBucketBits;
+    static constexpr size_t kNumBuckets = (64 - kSubBucketBits + 1) * kSubBucketCount;
+    static constexpr size_t kNumShards = 4;
+
+    void record(uint64_t value) {
+        auto &shard = _shards[currentThreadMetricsShard() % kNumShards];
+        shard.buckets[bucketFor(value)].fetch_add(1, std::memory_order_relaxed);
+        shard.sum.fetch_add(value, std::memory_order_relaxed);
+    }
+
+    /**
+     * Values below `kSubBucketCount` have a bucket each. The larger ones are placed according to
+     * their most significant bit and the `kSubBucketBits` bits which follow it.
+     */
+    static size_t bucketFor(uint64_t value) {
+        if (value < kSubBucketCount)
+            return value;
+        const size_t shift = 63 - __builtin_clzll(value) - kSubBucketBits;
+        return (shift + 1) * kSubBucketCount + (value >> shift) - kSubBucketCount;
+    }
+
+    /**
+     * Returns the largest value, which falls in the `bucket`'th bucket.
+     */
+    static uint64_t bucketUpperBound(size_t bucket);
+
+    /**
+     * Point in time view of the histogram.
+     */
+    struct Snapshot {
+        uint64_t count{0};
+        uint64_t sum{0};
+        std::array<uint64_t, kNumBuckets> buckets{};
+
+        /**
+         * Returns the upper bound of the bucket in which the `q`'th quantile (0 < q <= 1) falls,
+         * or 0 if nothing was recorded.
+         */
+        uint64_t quantile(double q) const;
+
+        std::string toString() const;
+    };
+    Snapshot snapshot() const;
+
+private:
+    struct alignas(kCacheLineSize) Shard {
+        std::array<std::atomic_uint64_t, kNumBuckets> buckets{};
+        std::atomic_uint64_t sum{0};
+    };
+    std::array<Shard, kNumShards> _shards;
+};
+
+/**
+ * Process-wide set of named metrics. Registration is expected to happen when the components are
+ * constructed (the returned references stay valid for the lifetime of the process and registering
+ * an existing name returns the same metric), after which the data path only touches the metrics
+ * themselves and never the registry.
+ */
+class MetricsRegistry {
+public:
+    static MetricsRegistry &get();
+
+    Counter &counter(const std::string &name);
+    Gauge &gauge(const std::string &name);
+    Histogram &histogram(const std::string &name);
+
+    /**
+     * Returns all the metrics as text, one per line and sorted by name. The snapshot is taken
+     * without stopping the threads, which update the metrics, so the values of different metrics
+     * may be a few updates apart, but each one of them lies between the values, which that metric
+     * had at the start and at the end of the snapshot.
+     */
+    std::string snapshot() const;
+
+private:
+    mutable std::mutex _mutex;
+
+    std::map<std::string, std::unique_ptr<Counter>> _counters;
+    std::map<std::string, std::unique_ptr<Gauge>> _gauges;
+    std::map<std::string, std::unique_ptr<Histogram>> _histograms;
+};
+
+} // namespace ruralpi
@@ -0,0 +1,158 @@
+/**
+ * Copyright 2021 Kaloian Manassiev
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software and
+ * associated documentation files (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge, publish, distribute,
+ * sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or
+ * substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT
+ * NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE. */
+
+#include "common/base.h"
+
+#include "common/ordered_transform_pool.h"
+
+#include <boost/asio/post.hpp>
+#include <boost/log/trivial.hpp>
+#include <cstring>
+#include <utility>
+
+#include "common/exception.h"
+
+namespace ruralpi {
+
+OrderedTransformPool::OrderedTransformPool(std::string desc, boost::asio::thread_pool &workers,
+                                           size_t capacity, TransformFn transform,
+                                           DeliverFn deliver, CapacityFn onCapacity)
+    : _desc(std::move(desc)), _workers(workers), _capacity(capacity),
+      _transformFn(std::move(transform)), _deliverFn(std::move(deliver)),
+      _capacityFn(std::move(onCapacity)),
+      _framesDropped(MetricsRegistry::get().counter(
+          boost::str(boost::format("transform.%s.frames_dropped") % _desc))),
+      _framesInFlight(MetricsRegistry::get().gauge(
+          boost::str(boost::format("transform.%s.frames_in_flight") % _desc))),
+      _frames(capacity * kTunnelFrameMaxSize), _sizes(capacity),
+      _states(capacity, SlotState::kFree) {
+    RASSERT(capacity > 0);
+}
+
+OrderedTransformPool::~OrderedTransformPool() {
+    std::unique_lock ul(_mutex);
+    _cv.wait(ul, [&] { return _head == _tail && !_delivering; });
+}
+
+void OrderedTransformPool::submit(ConstTunnelFrameBuffer buf) { _submit(buf, false /* wait */); }
+
+void OrderedTransformPool::submit(TunnelFrameBuffers bufs) {
+    for (const auto &buf : bufs)
+        _submit(ConstTunnelFrameBuffer{buf.data, buf.size}, true /* wait */);
+}
+
+void OrderedTransformPool::_submit(ConstTunnelFrameBuffer buf, bool wait) {
+    RASSERT(buf.size <= kTunnelFrameMaxSize);
+
+    size_t idx;
+    {
+        std::unique_lock ul(_mutex);
+        if (wait) {
+            _cv.wait(ul, [&] { return _tail - _head < _capacity; });
+        } else if (_tail - _head == _capacity) {
+            _submittersWaiting = true;
+            throw NotYetReadyException(
+                boost::format("All %d slots of %s transforms are in flight") % _capacity % _desc);
+        }
+
+        idx = _tail++ % _capacity;
+        RASSERT(_states[idx] == SlotState::kFree);
+        _states[idx] = SlotState::kTransforming;
+    }
+
+    // The slot is owned by this thread and then by the worker until it is marked as transformed,
+    // so its contents can be accessed without holding the mutex
+    memcpy(&_frames[idx * kTunnelFrameMaxSize], buf.data, buf.size);
+    _sizes[idx] = buf.size;
+    _framesInFlight.add(1);
+
+    boost::asio::post(_workers, [this, idx] { _transform(idx); });
+}
+
+void OrderedTransformPool::_transform(size_t idx) {
+    TunnelFrameBuffer buf{&_frames[idx * kTunnelFrameMaxSize], _sizes[idx]};
+
+    bool transformed = false;
+    try {
+        _transformFn(buf);
+        _sizes[idx] = buf.size;
+        transformed = true;
+    } catch (const std::exception &ex) {
+        BOOST_LOG_TRIVIAL(debug) << "Failed to transform frame on " << _desc << ": " << ex.what();
+    }
+
+    std::unique_lock ul(_mutex);
+    _states[idx] = transformed ? SlotState::kTransformed : SlotState::kFailed;
+
+    // Another worker is already delivering and will pick this frame up when it gets to it
+    if (_delivering)
+        return;
+    _delivering = true;
+
+    while (_head < _tail) {
+        // Collect the consecutive frames at the head of the ring, which have completed, stopping at
+        // the end of the ring
+        TunnelFrameBuffer batch[kMaxDeliverBatch];
+        size_t batchSize = 0;
+        size_t numFailed = 0;
+        size_t numCompleted = 0;
+        while (_head + numCompleted < _tail && batchSize < kMaxDeliverBatch) {
+            const size_t idxSlot = (_head + numCompleted) % _capacity;
+            if (_states[idxSlot] == SlotState::kTransforming)
+                break;
+            if (_states[idxSlot] == SlotState::kTransformed)
+                batch[batchSize++] = {&_frames[idxSlot * kTunnelFrameMaxSize], _sizes[idxSlot]};
+            else
+                ++numFailed;
+            ++numCompleted;
+            if (idxSlot == _capacity - 1)
+                break;
+        }
+
+        if (!numCompleted)
+            break;
+
+        ul.unlock();
+
+        if (batchSize) {
+            const size_t numDelivered = _deliverFn({batch, batchSize});
+            RASSERT(numDelivered <= batchSize);
+            numFailed += batchSize - numDelivered;
+        }
+        _framesDropped.add(numFailed);
+        _framesInFlight.add(-int64_t(numCompleted));
+
+        ul.lock();
+
+        for (size_t i = 0; i < numCompleted; i++)
+            _states[(_head + i) % _capacity] = SlotState::kFree;
+        _head += numCompleted;
+        _cv.notify_all();
+
+        if (std::exchange(_submittersWaiting, false) && _capacityFn) {
+            ul.unlock();
+            _capacityFn();
+            ul.lock();
+        }
+    }
+
+    _delivering = false;
+    _cv.notify_all();
+}
+
+} // namespace ruralpi
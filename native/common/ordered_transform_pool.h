@@ -0,0 +1,125 @@
+/**
+ * Copyright 2021 Kaloian Manassiev
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software and
+ * associated documentation files (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge, publish, distribute,
+ * sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or
+ * substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT
+ * NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE. */
+
+#pragma once
+
+#include <boost/asio/thread_pool.hpp>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "common/metrics.h"
+#include "common/tunnel_frame.h"
+
+namespace ruralpi {
+
+/**
+ * Runs a CPU-heavy transformation of tunnel frames (such as compression or signing) in parallel on
+ * a pool of worker threads and hands the transformed frames on strictly in the order in which they
+ * were submitted, so that a single fast stream of frames is not limited to the speed of one core.
+ *
+ * The submitted frames are copied into a ring of `capacity` slots, which bounds the number of
+ * frames in flight. Each of them is transformed by whichever worker picks it up and the frames at
+ * the head of the ring, which have completed, are delivered in order by the worker, which completed
+ * the last one of them (so only one thread delivers at a time).
+ */
+class OrderedTransformPool {
+public:
+    // Transforms a frame in place. Invoked concurrently from the worker threads.
+    using TransformFn = std::function<void(TunnelFrameBuffer &)>;
+
+    // Passes on a batch of transformed frames, in submission order, and returns how many of them
+    // were passed on (the rest are counted as dropped). Never invoked concurrently and must not
+    // throw, because the pool can't tell which frames of the batch a failure left behind.
+    using DeliverFn = std::function<size_t(TunnelFrameBuffers)>;
+
+    // Invoked from a worker thread when slots free up after a frame was refused, because the ring
+    // was full. Must not block or submit frames.
+    using CapacityFn = std::function<void()>;
+
+    // Largest number of consecutive frames, which are delivered in one call
+    static constexpr size_t kMaxDeliverBatch = 32;
+
+    OrderedTransformPool(std::string desc, boost::asio::thread_pool &workers, size_t capacity,
+                         TransformFn transform, DeliverFn deliver, CapacityFn onCapacity = {});
+
+    /**
+     * Blocks until all the frames submitted so far have been delivered.
+     */
+    ~OrderedTransformPool();
+
+    /**
+     * Copies the frame(s) and schedules them to be transformed and delivered. The buffers can be
+     * reused as soon as the call returns.
+     *
+     * If the ring is full, the single frame variant throws `NotYetReadyException` without taking
+     * the frame and the capacity callback is invoked once slots free up, so that the submitting
+     * pipe can hold on to the frame instead of its thread. The batch variant blocks while the ring
+     * is full instead, which propagates the backpressure to the submitting thread.
+     *
+     * Frames which fail to be transformed or delivered are dropped and counted in the
+     * "transform.<desc>.frames_dropped" counter.
+     */
+    void submit(ConstTunnelFrameBuffer buf);
+    void submit(TunnelFrameBuffers bufs);
+
+private:
+    enum class SlotState { kFree, kTransforming, kTransformed, kFailed };
+
+    void _submit(ConstTunnelFrameBuffer buf, bool wait);
+
+    void _transform(size_t idx);
+
+    const std::string _desc;
+
+    boost::asio::thread_pool &_workers;
+
+    const size_t _capacity;
+
+    const TransformFn _transformFn;
+    const DeliverFn _deliverFn;
+    const CapacityFn _capacityFn;
+
+    Counter &_framesDropped;
+    Gauge &_framesInFlight;
+
+    // The contents of the frames in the ring, `kTunnelFrameMaxSize` bytes per slot
+    std::vector<uint8_t> _frames;
+
+    // Mutex to protect access to the state below
+    std::mutex _mutex;
+    std::condition_variable _cv;
+
+    // The slots of the ring, where the `_head`'th one (modulo `_capacity`) is the next one to be
+    // delivered and the `_tail`'th one is the next one to be submitted
+    std::vector<size_t> _sizes;
+    std::vector<SlotState> _states;
+    uint64_t _head{0};
+    uint64_t _tail{0};
+
+    // Set while one of the workers is delivering frames from the head of the ring
+    bool _delivering{false};
+
+    // Set when a frame was refused because the ring was full, so that the delivering worker invokes
+    // the capacity callback after it frees up slots
+    bool _submittersWaiting{false};
+};
+
+} // namespace ruralpi
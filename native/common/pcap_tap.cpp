@@ -0,0 +1,321 @@
+/**
+ * Copyright 2021 Kaloian Manassiev
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software and
+ * associated documentation files (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge, publish, distribute,
+ * sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or
+ * substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT
+ * NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE. */
+
+#include "common/base.h"
+
+#include "common/pcap_tap.h"
+
+#include <boost/filesystem.hpp>
+#include <boost/log/attributes/named_scope.hpp>
+#include <boost/log/trivial.hpp>
+#include <chrono>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <sstream>
+
+#include "common/exception.h"
+
+namespace ruralpi {
+namespace {
+
+namespace fs = boost::filesystem;
+
+// Block types and constants of the pcapng format
+constexpr uint32_t kSectionHeaderBlock = 0x0A0D0D0A;
+constexpr uint32_t kInterfaceDescriptionBlock = 1;
+constexpr uint32_t kEnhancedPacketBlock = 6;
+constexpr uint32_t kByteOrderMagic = 0x1A2B3C4D;
+constexpr uint16_t kLinkTypeRaw = 101;
+constexpr uint16_t kOptionEndOfOptions = 0;
+constexpr uint16_t kOptionEPBFlags = 2;
+
+uint64_t nowMicros() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+               std::chrono::system_clock::now().time_since_epoch())
+        .count();
+}
+
+size_t pad4(size_t size) { return (size + 3) & ~size_t(3); }
+
+/**
+ * Writes pcapng blocks to a sequence of files, starting a new one when the current one grows
+ * beyond the configured size.
+ */
+class RotatingPcapngWriter {
+public:
+    RotatingPcapngWriter(const PcapTap::Config &config) : _config(config) {}
+
+    size_t writePacket(uint64_t timestampMicros, uint32_t capturedSize, uint32_t originalSize,
+                       uint8_t direction, uint8_t const *data) {
+        if (!_out.is_open() || _fileBytes >= _config.rotateBytes)
+            _rotate();
+
+        const uint32_t blockSize = 28 + pad4(capturedSize) + 12 + 4;
+        _writeU32(kEnhancedPacketBlock);
+        _writeU32(blockSize);
+        _writeU32(0 /* interface id */);
+        _writeU32(timestampMicros >> 32);
+        _writeU32(timestampMicros & 0xFFFFFFFF);
+        _writeU32(capturedSize);
+        _writeU32(originalSize);
+        _out.write((char const *)data, capturedSize);
+        _writePadding(capturedSize);
+        _writeU16(kOptionEPBFlags);
+        _writeU16(4);
+        _writeU32(direction);
+        _writeU16(kOptionEndOfOptions);
+        _writeU16(0);
+        _writeU32(blockSize);
+
+        if (!_out)
+            throw Exception(boost::format("Failed to write to %s") % _path);
+
+        _fileBytes += blockSize;
+        return blockSize;
+    }
+
+    void flush() {
+        if (_out.is_open())
+            _out.flush();
+    }
+
+private:
+    void _rotate() {
+        if (_out.is_open())
+            _out.close();
+
+        _path = boost::str(boost::format("%s_%d.pcapng") % _config.pathPrefix % _nextFileNum++);
+        _out.open(_path, std::ios::binary | std::ios::trunc);
+        if (!_out)
+            throw Exception(boost::format("Unable to open %s for writing the capture") % _path);
+        BOOST_LOG_TRIVIAL(info) << "Writing capture to " << _path;
+
+        _files.push_back(_path);
+        while (_files.size() > _config.maxFiles) {
+            fs::remove(_files.front());
+            _files.pop_front();
+        }
+
+        // Section header block, without options and with unspecified section length
+        _writeU32(kSectionHeaderBlock);
+        _writeU32(28);
+        _writeU32(kByteOrderMagic);
+        _writeU16(1);
+        _writeU16(0);
+        _writeU32(0xFFFFFFFF);
+        _writeU32(0xFFFFFFFF);
+        _writeU32(28);
+
+        // Interface description block of the raw IP tunnel with the default (microseconds)
+        // timestamp resolution
+        _writeU32(kInterfaceDescriptionBlock);
+        _writeU32(20);
+        _writeU16(kLinkTypeRaw);
+        _writeU16(0);
+        _writeU32(_config.snapLen);
+        _writeU32(20);
+
+        _fileBytes = 48;
+    }
+
+    void _writeU16(uint16_t value) { _out.write((char const *)&value, sizeof(value)); }
+    void _writeU32(uint32_t value) { _out.write((char const *)&value, sizeof(value)); }
+    void _writePadding(size_t size) {
+        constexpr char kZeroes[4] = {0};
+        _out.write(kZeroes, pad4(size) - size);
+    }
+
+    const PcapTap::Config &_config;
+
+    std::ofstream _out;
+    std::string _path;
+    size_t _fileBytes{0};
+
+    size_t _nextFileNum{0};
+    std::deque<std::string> _files;
+};
+
+} // namespace
+
+struct PcapTap::Slot {
+    // Equal to the position of the slot in the ring when it is free for the producers and to the
+    // position + 1 when it contains a datagram for the writer thread
+    std::atomic_size_t sequence;
+
+    uint64_t timestampMicros;
+    uint32_t capturedSize;
+    uint32_t originalSize;
+    uint8_t direction;
+    uint8_t data[kMaxSnapLen];
+};
+
+PcapTap &PcapTap::get() {
+    static PcapTap tap;
+    return tap;
+}
+
+PcapTap::PcapTap()
+    : _numCaptured(MetricsRegistry::get().counter("pcap.captured")),
+      _numDropped(MetricsRegistry::get().counter("pcap.dropped")),
+      _bytesWritten(MetricsRegistry::get().counter("pcap.bytes_written")) {}
+
+PcapTap::~PcapTap() { stop(); }
+
+void PcapTap::start(Config config) {
+    std::lock_guard lg(_mutex);
+    if (started())
+        throw Exception("Capture is already started");
+    if (config.pathPrefix.empty() || !config.snapLen || !config.sampleEvery || !config.maxFiles)
+        throw Exception("Invalid capture configuration");
+
+    config.snapLen = std::min(config.snapLen, kMaxSnapLen);
+    _config = std::move(config);
+
+    if (!_ring) {
+        _ring.reset(new Slot[kRingSize]);
+        for (size_t i = 0; i < kRingSize; i++)
+            _ring[i].sequence.store(i);
+    }
+
+    // The writer of a previous capture might have exited on its own after failing
+    if (_writerThread.joinable())
+        _writerThread.join();
+    {
+        std::lock_guard lgFailure(_failureMutex);
+        _failure.clear();
+    }
+
+    _snapLen.store(_config.snapLen);
+    _sampleEvery.store(_config.sampleEvery);
+    _stopping.store(false);
+
+    // Set before the writer runs, so that a writer which fails right away stops the tap for good
+    _started.store(true);
+    _writerThread = std::thread([this] {
+        BOOST_LOG_NAMED_SCOPE("pcapWriter");
+        _writerLoop();
+    });
+
+    BOOST_LOG_TRIVIAL(info) << "Capture started: " << toString();
+}
+
+void PcapTap::stop() {
+    std::lock_guard lg(_mutex);
+    if (!_writerThread.joinable())
+        return;
+
+    const bool wasStarted = _started.exchange(false);
+    _stopping.store(true);
+    _writerThread.join();
+
+    if (wasStarted)
+        BOOST_LOG_TRIVIAL(info) << "Capture stopped";
+}
+
+std::string PcapTap::toString() const {
+    std::stringstream ss;
+    if (started())
+        ss << "started to " << _config.pathPrefix << "_*.pcapng with snaplen " << _config.snapLen
+           << ", sampling every " << _config.sampleEvery << " datagram(s), rotating every "
+           << _config.rotateBytes << " bytes and keeping " << _config.maxFiles << " file(s)";
+    else {
+        std::lock_guard lg(_failureMutex);
+        ss << "stopped";
+        if (!_failure.empty())
+            ss << " due to failure: " << _failure;
+    }
+    ss << "; captured " << _numCaptured.value() << ", dropped " << _numDropped.value();
+    return ss.str();
+}
+
+void PcapTap::_capture(Direction direction, uint8_t const *data, size_t size) {
+    // Pairs with the starting of the tap, so that the ring is visible
+    if (!_started.load(std::memory_order_acquire))
+        return;
+
+    thread_local size_t numSeen = 0;
+    if (numSeen++ % _sampleEvery.load(std::memory_order_relaxed))
+        return;
+
+    size_t pos = _enqueuePos.load(std::memory_order_relaxed);
+    Slot *slot;
+    while (true) {
+        slot = &_ring[pos % kRingSize];
+        const intptr_t diff =
+            intptr_t(slot->sequence.load(std::memory_order_acquire)) - intptr_t(pos);
+        if (diff == 0) {
+            if (_enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                break;
+        } else if (diff < 0) {
+            _numDropped.add();
+            return;
+        } else {
+            pos = _enqueuePos.load(std::memory_order_relaxed);
+        }
+    }
+
+    slot->timestampMicros = nowMicros();
+    slot->originalSize = size;
+    slot->capturedSize = std::min(size, _snapLen.load(std::memory_order_relaxed));
+    slot->direction = direction;
+    memcpy(slot->data, data, slot->capturedSize);
+    slot->sequence.store(pos + 1, std::memory_order_release);
+
+    _numCaptured.add();
+}
+
+void PcapTap::_writerLoop() {
+    const uint64_t startedAtMicros = nowMicros();
+
+    try {
+        RotatingPcapngWriter writer(_config);
+
+        while (true) {
+            auto &slot = _ring[_dequeuePos % kRingSize];
+            if (slot.sequence.load(std::memory_order_acquire) != _dequeuePos + 1) {
+                // The ring is empty and only at this point is it safe to exit, because all the
+                // datagrams captured before the tap was stopped have been written out
+                if (_stopping.load())
+                    break;
+
+                writer.flush();
+                std::this_thread::sleep_for(Milliseconds(10));
+                continue;
+            }
+
+            // Datagrams left over from a previous capture are skipped
+            if (slot.timestampMicros >= startedAtMicros)
+                _bytesWritten.add(writer.writePacket(slot.timestampMicros, slot.capturedSize,
+                                                     slot.originalSize, slot.direction,
+                                                     slot.data));
+
+            slot.sequence.store(_dequeuePos + kRingSize, std::memory_order_release);
+            ++_dequeuePos;
+        }
+    } catch (const std::exception &ex) {
+        BOOST_LOG_TRIVIAL(error) << "Capture failed due to: " << ex.what();
+
+        // Nothing drains the ring anymore, so the producers must stop filling it
+        std::lock_guard lg(_failureMutex);
+        _failure = ex.what();
+        _started.store(false);
+    }
+}
+
+} // namespace ruralpi
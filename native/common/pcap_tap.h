@@ -0,0 +1,138 @@
+/**
+ * Copyright 2021 Kaloian Manassiev
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software and
+ * associated documentation files (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge, publish, distribute,
+ * sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or
+ * substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT
+ * NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE. */
+
+#pragma once
+
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "common/metrics.h"
+
+namespace ruralpi {
+
+/**
+ * Tap, which captures the datagrams entering and leaving the tunnel into rotating pcapng files,
+ * which can be opened with Wireshark or tcpdump. The data-plane threads copy the (possibly
+ * truncated and sampled) datagrams into a lock-free ring and a background thread writes them out,
+ * so capturing never blocks the data path. When the ring is full, datagrams are dropped from the
+ * capture (and counted), but never from the tunnel.
+ *
+ * There is one tap per process and it is started and stopped at runtime through the commands
+ * server. While it is stopped, the cost on the data path is checking a flag per datagram.
+ */
+class PcapTap {
+public:
+    // Largest number of bytes which are captured from each datagram
+    static constexpr size_t kMaxSnapLen = 2048;
+
+    // Number of datagrams which the ring can hold before the capture starts dropping them
+    static constexpr size_t kRingSize = 1024;
+
+    // Recorded in the flags of each packet as inbound and outbound respectively
+    enum Direction : uint8_t { kEnteringTunnel = 1, kLeavingTunnel = 2 };
+
+    struct Config {
+        // Files are written to `<pathPrefix>_<N>.pcapng`, starting from N = 0
+        std::string pathPrefix;
+
+        // Only the first `snapLen` bytes (up to `kMaxSnapLen`) of every `sampleEvery`'th datagram
+        // seen by each thread are captured
+        size_t snapLen{kMaxSnapLen};
+        size_t sampleEvery{1};
+
+        // A new file is started when the current one reaches `rotateBytes` and only the last
+        // `maxFiles` of them are kept
+        size_t rotateBytes{64 * 1024 * 1024};
+        size_t maxFiles{4};
+    };
+
+    static PcapTap &get();
+
+    ~PcapTap();
+
+    /**
+     * Starts capturing with the specified configuration. Throws if the tap is already started.
+     */
+    void start(Config config);
+
+    /**
+     * Stops capturing and waits for the datagrams captured so far to be written out. Does nothing
+     * if the tap is not started. If writing the capture failed, the tap will have already stopped
+     * itself and `toString` reports the failure until the next start.
+     */
+    void stop();
+
+    bool started() const { return _started.load(std::memory_order_relaxed); }
+
+    std::string toString() const;
+
+    /**
+     * Invoked by the data-plane threads for each datagram, which enters or leaves the tunnel.
+     */
+    void capture(Direction direction, uint8_t const *data, size_t size) {
+        if (started())
+            _capture(direction, data, size);
+    }
+
+private:
+    PcapTap();
+
+    struct Slot;
+
+    void _capture(Direction direction, uint8_t const *data, size_t size);
+
+    /**
+     * Runs on `_writerThread` for as long as the tap is started and writes the captured datagrams
+     * out to the rotating files.
+     */
+    void _writerLoop();
+
+    // Protects starting and stopping the tap and the configuration below
+    mutable std::mutex _mutex;
+    Config _config;
+
+    std::atomic_bool _started{false};
+    std::atomic_bool _stopping{false};
+
+    // Copied out of `_config`, so that the data-plane threads don't need to take `_mutex`
+    std::atomic_size_t _snapLen{kMaxSnapLen};
+    std::atomic_size_t _sampleEvery{1};
+
+    // Bounded multi-producer, single-consumer ring, in which each slot carries a sequence number,
+    // which tells whether the slot is free for the producers or ready for the consumer (the
+    // writer thread). It is allocated on the first start and never freed, so that a data-plane
+    // thread which saw the tap started can always complete its capture.
+    std::unique_ptr<Slot[]> _ring;
+    alignas(kCacheLineSize) std::atomic_size_t _enqueuePos{0};
+    alignas(kCacheLineSize) size_t _dequeuePos{0};
+
+    std::thread _writerThread;
+
+    // Set by the writer thread if it fails and cleared when the tap is started again
+    mutable std::mutex _failureMutex;
+    std::string _failure;
+
+    Counter &_numCaptured;
+    Counter &_numDropped;
+    Counter &_bytesWritten;
+};
+
+} // namespace ruralpi
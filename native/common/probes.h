@@ -0,0 +1,59 @@
+/**
+ * Copyright 2021 Kaloian Manassiev
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software and
+ * associated documentation files (the "Software"), to deal in the Software without restriction,
+ * including without limitation the rights to use, copy, modify, merge, publish, distribute,
+ * sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or
+ * substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT
+ * NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+ * NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM,
+ * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE. */
+
+#pragma once
+
+/**
+ * Static tracepoints (USDT probes) on the hot paths of the datagrams and frames, which perf,
+ * bpftrace and SystemTap can attach to in a running process, for example:
+ *
+ *   bpftrace -e 'usdt:./client:ruralpi:stream_send { @bytes = hist(arg2); }'
+ *
+ * The probes (all under the `ruralpi` provider) and their arguments are:
+ *   datagram_read(queue, size): A datagram was read from a tunnel queue
+ *   frame_closed(queue, size, numDatagrams): The tunnel finished packing a frame
+ *   pipe_invoke_next(fromStage, toStage, size): A frame is passed to the next pipe stage
+ *   pipe_invoke_next_batch(fromStage, toStage, numFrames): A batch of frames is passed to the next
+ *       pipe stage
+ *   stream_send(fd, numFrames, numBytes): A batch of frames was sent on a stream
+ *   stream_receive(fd, numFrames): A batch of frames was received from a stream
+ *   tun_write(queue, size): A datagram was written to a tunnel queue
+ *
+ * Each probe compiles to a single no-op instruction and its arguments are only read by the tracer,
+ * so they cost nothing while nothing is attached. The probes are only compiled in if the
+ * <sys/sdt.h> header (from the systemtap-sdt-dev package) is available at build time.
+ */
+
+#if defined(__has_include)
+#if __has_include(<sys/sdt.h>)
+#include <sys/sdt.h>
+#define RURALPI_HAVE_PROBES 1
+#endif
+#endif
+
+#ifdef RURALPI_HAVE_PROBES
+
+#define RPROBE2(name, a1, a2) DTRACE_PROBE2(ruralpi, name, a1, a2)
+#define RPROBE3(name, a1, a2, a3) DTRACE_PROBE3(ruralpi, name, a1, a2, a3)
+
+#else
+
+#define RPROBE2(name, a1, a2)
+#define RPROBE3(name, a1, a2, a3)
+
+#endif
@@ -16,21 +16,20 @@
  * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
  * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE. */
 
-#pragma once
+#include "common/base.h"
 
-#include "common/tunnel_frame.h"
+#include "common/signing_tunnel_frame_stage.h"
+
+#include <boost/log/trivial.hpp>
 
 namespace ruralpi {
 
-class CompressingTunnelFramePipe : public TunnelFramePipe {
-public:
-    CompressingTunnelFramePipe(TunnelFramePipe &prev);
-    ~CompressingTunnelFramePipe();
+SigningTunnelFrameStage::SigningTunnelFrameStage() {
+    BOOST_LOG_TRIVIAL(info) << "Signing stage attached";
+}
 
-private:
-    // TunnelFramePipe methods
-    void onTunnelFrameFromPrev(TunnelFrameBuffer buf) override;
-    void onTunnelFrameFromNext(TunnelFrameBuffer buf) override;
-};
+SigningTunnelFrameStage::~SigningTunnelFrameStage() {
+    BOOST_LOG_TRIVIAL(info) << "Signing stage detached";
+}
 
 } // namespace ruralpi
@@ -16,33 +16,31 @@
  * DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
  * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE. */
 
-#include "common/base.h"
+#pragma once
 
-#include "common/compressing_tunnel_frame_pipe.h"
-
-#include <boost/log/trivial.hpp>
+#include "common/tunnel_frame.h"
 
 namespace ruralpi {
 
-CompressingTunnelFramePipe::CompressingTunnelFramePipe(TunnelFramePipe &prev)
-    : TunnelFramePipe("Compressing") {
-    pipePush(prev);
-    BOOST_LOG_TRIVIAL(info) << "Compressing pipe attached";
-}
-
-CompressingTunnelFramePipe::~CompressingTunnelFramePipe() {
-    pipePop();
-    BOOST_LOG_TRIVIAL(info) << "Compressing pipe detached";
-}
-
-void CompressingTunnelFramePipe::onTunnelFrameFromPrev(TunnelFrameBuffer buf) {
-    // TODO: Compress the contents of buf
-    pipeInvokeNext(buf);
-}
-
-void CompressingTunnelFramePipe::onTunnelFrameFromNext(TunnelFrameBuffer buf) {
-    // TODO: De-compress the contents of buf
-    pipeInvokePrev(buf);
-}
+/**
+ * Stage of the `StaticTunnelFramePipe` in front of the sockets, which signs the outgoing tunnel
+ * frames and checks the signatures of the incoming ones. The signing is not implemented yet, so for
+ * now the frames pass through it unchanged.
+ */
+class SigningTunnelFrameStage {
+public:
+    static constexpr char kDesc[] = "Signing";
+
+    SigningTunnelFrameStage();
+    ~SigningTunnelFrameStage();
+
+    void onTunnelFrameFromPrev(TunnelFrameBuffer &buf) {
+        // TODO: Sign the contents of buf
+    }
+
+    void onTunnelFrameFromNext(TunnelFrameBuffer &buf) {
+        // TODO: Check the signature of the contents of buf
+    }
+};
 
 } // namespace ruralpi
@@ -20,16 +20,39 @@
 
 #include "common/socket_producer_consumer.h"
 
+#include <algorithm>
 #include <boost/asio.hpp>
 #include <boost/log/attributes/named_scope.hpp>
 #include <boost/log/trivial.hpp>
 #include <boost/uuid/uuid_io.hpp>
+#include <linux/errqueue.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/eventfd.h>
 
 #include "common/exception.h"
+#include "common/frame_trace.h"
+#include "common/logging.h"
+#include "common/probes.h"
+
+// These are only defined by recent kernel and C library headers
+#ifndef SO_ZEROCOPY
+#define SO_ZEROCOPY 60
+#endif
+#ifndef MSG_ZEROCOPY
+#define MSG_ZEROCOPY 0x4000000
+#endif
+#ifndef SO_EE_ORIGIN_ZEROCOPY
+#define SO_EE_ORIGIN_ZEROCOPY 5
+#define SO_EE_CODE_ZEROCOPY_COPIED 1
+#endif
 
 namespace ruralpi {
 namespace {
 
+// Maximum number of frames, which the receive loop passes upstream per wakeup of its socket
+constexpr size_t kMaxReceiveBatch = 64;
+
 struct InitialExchangeResult {
     std::string identifier;
     SessionId sessionId;
@@ -77,13 +100,58 @@ InitialExchangeResult initialTunnelFrameExchange(TunnelFrameStream &stream,
 
 } // namespace
 
-SocketProducerConsumer::SocketProducerConsumer(boost::optional<SessionId> clientSessionId,
-                                               TunnelFramePipe &prev)
-    : TunnelFramePipe("Socket"), _clientSessionId(std::move(clientSessionId)) {
-    _compresser.emplace(prev);
-    _signer.emplace(*_compresser);
-    pipePush(*_signer);
-    BOOST_LOG_TRIVIAL(info) << "Socket producer/consumer started";
+SocketProducerConsumer::SocketProducerConsumer(std::string desc,
+                                               boost::optional<SessionId> clientSessionId,
+                                               TunnelFramePipe &prev, CpuAffinity cpuAffinity,
+                                               size_t numTransformThreads)
+    : TunnelFramePipe("Socket"), _clientSessionId(std::move(clientSessionId)),
+      _cpuAffinity(std::move(cpuAffinity)), _stats(desc) {
+    if (numTransformThreads) {
+        _sendTransformWorkers.emplace(numTransformThreads);
+        _receiveTransformWorkers.emplace(numTransformThreads);
+        _sendTransforms.emplace(
+            desc + ".send", *_sendTransformWorkers, kMaxTransformsInFlight,
+            [this](TunnelFrameBuffer &buf) { _stages.onTunnelFrameFromPrev(buf); },
+            [this](TunnelFrameBuffers bufs) {
+                size_t numDelivered = 0;
+                for (auto &buf : bufs) {
+                    try {
+                        _send(buf, false /* transform */);
+                        ++numDelivered;
+                    } catch (const std::exception &ex) {
+                        // For example, the session was closed while the frame was being
+                        // transformed
+                        BOOST_LOG_TRIVIAL(debug) << "Dropped transformed frame: " << ex.what();
+                    }
+                }
+                return numDelivered;
+            },
+            [this] { pipeSignalCapacity(); });
+        _receiveTransforms.emplace(
+            desc + ".receive", *_receiveTransformWorkers, kMaxTransformsInFlight,
+            [this](TunnelFrameBuffer &buf) { _stages.onTunnelFrameFromNext(buf); },
+            [this](TunnelFrameBuffers bufs) {
+                // The frames are passed on one at a time, so that a failure only drops the frame,
+                // which caused it
+                size_t numDelivered = 0;
+                for (auto &buf : bufs) {
+                    try {
+                        pipeInvokePrev(buf);
+                        ++numDelivered;
+                    } catch (const std::exception &ex) {
+                        BOOST_LOG_TRIVIAL(debug) << "Dropped received frame: " << ex.what();
+                    }
+                }
+                return numDelivered;
+            });
+    }
+
+    pipePush(prev);
+    BOOST_LOG_TRIVIAL(info) << "Socket producer/consumer started"
+                            << (numTransformThreads ? " with " +
+                                                          std::to_string(numTransformThreads) +
+                                                          " transform thread(s) per direction"
+                                                    : "");
 }
 
 SocketProducerConsumer::~SocketProducerConsumer() {
@@ -92,9 +160,13 @@ SocketProducerConsumer::~SocketProducerConsumer() {
 
     RASSERT(_sessions.empty());
 
+    // Deliver the frames, which are still being transformed, while the pipe is still attached
+    _receiveTransforms.reset();
+    _sendTransforms.reset();
+    _receiveTransformWorkers.reset();
+    _sendTransformWorkers.reset();
+
     pipePop();
-    _signer.reset();
-    _compresser.reset();
     BOOST_LOG_TRIVIAL(info) << "Socket producer/consumer finished";
 }
 
@@ -117,9 +189,15 @@ void SocketProducerConsumer::addSocket(SocketConfig config) {
             SYSCALL(::setsockopt(config.fd, SOL_SOCKET, SO_SNDBUF, &kSendBufSize,
                                  sizeof(kSendBufSize)));
 
-            constexpr int kTCPNoDelay = 1;
-            SYSCALL(::setsockopt(config.fd, IPPROTO_TCP, TCP_NODELAY, &kTCPNoDelay,
-                                 sizeof(kTCPNoDelay)));
+            // Streams can also be UNIX sockets (for example in the benchmarks)
+            int protocol;
+            socklen_t protocolLen = sizeof(protocol);
+            SYSCALL(::getsockopt(config.fd, SOL_SOCKET, SO_PROTOCOL, &protocol, &protocolLen));
+            if (protocol == IPPROTO_TCP) {
+                constexpr int kTCPNoDelay = 1;
+                SYSCALL(::setsockopt(config.fd, IPPROTO_TCP, TCP_NODELAY, &kTCPNoDelay,
+                                     sizeof(kTCPNoDelay)));
+            }
         }
 
         int recvBufSize;
@@ -143,10 +221,25 @@ void SocketProducerConsumer::addSocket(SocketConfig config) {
     BOOST_LOG_TRIVIAL(info) << "Starting thread for socket file descriptor "
                             << config.fd.toString();
 
-    boost::asio::post(_pool, [this, config = std::move(config)]() mutable {
+    boost::asio::post(_pool, [this, config = std::move(config),
+                              idxSocket = _numSocketsAdded++]() mutable {
         BOOST_LOG_NAMED_SCOPE("_receiveFromSocketLoop");
 
+        try {
+            const int cpu = _cpuAffinity.pinCurrentThread(idxSocket);
+            BOOST_LOG_TRIVIAL(info) << "Thread for socket " << idxSocket << " ("
+                                    << config.fd.toString() << ") running "
+                                    << (cpu < 0 ? "unpinned" : "on CPU " + std::to_string(cpu));
+        } catch (const std::exception &ex) {
+            BOOST_LOG_TRIVIAL(warning) << "Unable to pin thread for socket " << config.fd.toString()
+                                       << ": " << ex.what();
+        }
+
         TunnelFrameStream s(std::move(config.fd));
+        if (config.zeroCopyMinBytes && s.enableZeroCopy(config.zeroCopyMinBytes))
+            BOOST_LOG_TRIVIAL(info) << "Zero-copy enabled on " << s.toString() << " for batches of "
+                                    << config.zeroCopyMinBytes << " bytes or more";
+
         InitialExchangeResult ier;
 
         try {
@@ -176,21 +269,86 @@ void SocketProducerConsumer::addSocket(SocketConfig config) {
         }
         ();
 
-        auto it = session.streams.emplace(session.streams.end(),
-                                          std::make_shared<StreamTracker>(std::move(s)));
-        auto st = *it;
+        const size_t idxSlot = [&] {
+            for (size_t i = 0; i < session.streams.size(); i++) {
+                if (!session.streams[i].st)
+                    return i;
+            }
+            return session.streams.size();
+        }();
+
+        // This runs on the pool, where nothing would catch an exception, so a peer opening more
+        // streams than there are slots just gets its extra stream closed
+        if (idxSlot == session.streams.size()) {
+            BOOST_LOG_TRIVIAL(warning)
+                << "Rejecting stream " << s.toString() << " because session " << ier.sessionId
+                << " already has the maximum of " << Session::kMaxStreams << " streams";
+            s.close();
+            return;
+        }
+        auto &slot = session.streams[idxSlot];
+        slot.st = std::make_unique<StreamTracker>(std::move(s), _stats);
+        slot.bytesQueued.store(0);
+        slot.state.store(StreamSlot::kAccepting);
+        session.numSlotsUsed = std::max(session.numSlotsUsed, idxSlot + 1);
+        session.numStreams++;
+        auto st = slot.st.get();
+        _stats.streams.add(1);
+
+        // Every new stream adds capacity and the first one also establishes the session, before
+        // which frames are refused without marking the producers as waiting, so the previous pipe
+        // is always signalled
+        {
+            std::lock_guard lg(session.mutex);
+            session.producersWaiting = true;
+        }
+        _notifyCapacity(session);
+
+        st->writer = std::thread([this, &session, &slot, idxSocket] {
+            BOOST_LOG_NAMED_SCOPE("_sendToStreamLoop");
+
+            try {
+                const int cpu = _cpuAffinity.pinCurrentThread(idxSocket);
+                BOOST_LOG_TRIVIAL(info) << "Writer for socket " << idxSocket << " ("
+                                        << slot.st->stream.toString() << ") running "
+                                        << (cpu < 0 ? "unpinned" : "on CPU " + std::to_string(cpu));
+            } catch (const std::exception &ex) {
+                BOOST_LOG_TRIVIAL(warning) << "Unable to pin writer for socket "
+                                           << slot.st->stream.toString() << ": " << ex.what();
+            }
+
+            try {
+                _sendToStreamLoop(session, slot);
+            } catch (const std::exception &ex) {
+                BOOST_LOG_TRIVIAL(info) << "Writer for socket " << slot.st->stream.toString()
+                                        << " completed due to " << ex.what();
+            }
+        });
+
+        ScopedGuard sg([this, &session, &slot, sessionId = ier.sessionId] {
+            {
+                std::lock_guard lg(slot.st->mutex);
+                slot.st->closing = true;
+                slot.publish();
+                slot.st->notifyWriter();
+            }
 
-        ScopedGuard sg([this, sessionId = ier.sessionId, itStream = it] {
-            (*itStream)->stream.close();
+            // Closing the file descriptor would neither wake up the writer if it is blocked in a
+            // send nor stop it from using the descriptor number after it gets reused, so the
+            // stream is only shut down until the writer has exited
+            slot.st->stream.shutdown();
+            slot.st->writer.join();
+            slot.st->stream.close();
 
             std::unique_lock ul(_mutex);
 
-            auto it = _sessions.find(sessionId);
-            it->second.streams.erase(itStream);
+            slot.st.reset();
+            slot.state.store(StreamSlot::kFree);
+            _stats.streams.add(-1);
 
-            bool eraseSession = it->second.streams.empty();
+            bool eraseSession = (--session.numStreams == 0);
             if (eraseSession)
-                _sessions.erase(it);
+                _sessions.erase(sessionId);
 
             ul.unlock();
 
@@ -215,6 +373,22 @@ void SocketProducerConsumer::addSocket(SocketConfig config) {
 }
 
 void SocketProducerConsumer::onTunnelFrameFromPrev(TunnelFrameBuffer buf) {
+    if (!_sendTransforms) {
+        _send(buf, true /* transform */);
+        return;
+    }
+
+    {
+        std::shared_lock sl(_mutex);
+        if (_sessions.empty())
+            throw NotYetReadyException("The other side of the tunnel is not connected yet");
+    }
+
+    // The frame is copied, so it is sent after this method returns, in the order of submission
+    _sendTransforms->submit(ConstTunnelFrameBuffer{buf.data, buf.size});
+}
+
+void SocketProducerConsumer::_send(TunnelFrameBuffer buf, bool transform) {
     std::shared_lock sl(_mutex);
 
     if (_sessions.empty())
@@ -233,43 +407,203 @@ void SocketProducerConsumer::onTunnelFrameFromPrev(TunnelFrameBuffer buf) {
     }
     ();
 
-    TunnelFrameWriter::setSequenceNumberOnClosedBuffer(buf, session.nextSeqNum++);
-
-    std::unique_lock ul(session.mutex);
+    // Picks the stream with the fewest bytes queued, which still has space in its send queue, by
+    // only reading the state published in the slots
+    auto pickStream = [&]() -> StreamSlot * {
+        StreamSlot *picked = nullptr;
+        size_t pickedBytesQueued = 0;
+        for (size_t i = 0; i < session.numSlotsUsed; i++) {
+            auto &slot = session.streams[i];
+            if (slot.state.load(std::memory_order_acquire) != StreamSlot::kAccepting)
+                continue;
+            const size_t bytesQueued = slot.bytesQueued.load(std::memory_order_relaxed);
+            if (!picked || bytesQueued < pickedBytesQueued) {
+                picked = &slot;
+                pickedBytesQueued = bytesQueued;
+            }
+        }
+        return picked;
+    };
+    auto allStreamsClosing = [&] {
+        for (size_t i = 0; i < session.numSlotsUsed; i++) {
+            const auto state = session.streams[i].state.load();
+            if (state == StreamSlot::kAccepting || state == StreamSlot::kFull)
+                return false;
+        }
+        return true;
+    };
+
+    // Rather than blocking the caller until a stream frees up below, refuse the frame so that the
+    // previous pipe can wait for `pipeSignalCapacity` without holding on to its thread. Frames
+    // coming from the transform workers have already been accepted, so they are always queued.
+    if (transform && !pickStream()) {
+        // Checked again after setting the flag, in case the last stream freed up in between
+        std::lock_guard lg(session.mutex);
+        session.producersWaiting = true;
+        if (!pickStream())
+            throw NotYetReadyException("All streams are busy");
+    }
 
-    auto st = [&] {
-        auto its = (Session::StreamsList::iterator *)alloca(session.streams.size());
+    // Must come after the last place which can throw `NotYetReadyException`, because the caller
+    // retries with the same frame, which must not be transformed twice
+    if (transform)
+        _stages.onTunnelFrameFromPrev(buf);
 
-        int i = 0;
-        for (auto it = session.streams.begin(); it != session.streams.end(); it++, i++) {
-            if (!(*it)->inUse) {
-                return *it;
+    while (true) {
+        StreamSlot *slot = pickStream();
+        if (!slot) {
+            std::unique_lock ul(session.mutex);
+            session.cv.wait(ul, [&] { return (slot = pickStream()) || allStreamsClosing(); });
+
+            // All streams failed after the frame was accepted, so it can't be refused anymore
+            if (!slot) {
+                _stats.framesDropped.add();
+                return;
             }
-            its[i] = it;
         }
 
-        auto &st = *its[0];
-        session.cv.wait(ul, [&] { return !st->inUse; });
-        return st;
-    }();
+        auto &st = *slot->st;
+        std::unique_lock ul(st.mutex);
+
+        // Another producer might have filled the queue since the slot was read
+        if (st.closing || st.sendQueue.full())
+            continue;
+
+        // Handing the frame over to the writer costs a copy and a context switch, which is wasted
+        // if the stream is idle, so in that case the frame is sent directly, as far as the socket
+        // buffer has space for it. Frames which would be sent with MSG_ZEROCOPY always go through
+        // the writer, because it tracks when the kernel stops referencing their buffers.
+        if (!st.sending && st.sendQueue.size() == st.numSentFrames &&
+            !st.stream.zeroCopyFor(buf.size)) {
+            size_t numSent;
+            try {
+                const auto startedAt = std::chrono::steady_clock::now();
+                numSent = st.stream.trySend(buf);
+                if (numSent == buf.size) {
+                    _stats.recordSend(1, buf.size, 0, startedAt);
+                    return;
+                }
+            } catch (const std::exception &ex) {
+                // The frame was already accepted, so the failure of the stream only drops it and
+                // makes the writer exit
+                BOOST_LOG_TRIVIAL(debug) << "Failed to send frame on " << st.stream.toString()
+                                         << ": " << ex.what();
+                _stats.framesDropped.add();
+                st.closing = true;
+                slot->publish();
+                st.notifyWriter();
+                return;
+            }
 
-    st->inUse = true;
-    st->bytesSending += buf.size;
+            // The socket buffer filled up, possibly in the middle of the frame, so the rest of it
+            // is left to the writer, which is the only one to send on the stream until its queue
+            // empties again
+            st.enqueue(buf);
+            st.headSentBytes = numSent;
+        } else {
+            st.enqueue(buf);
+        }
 
-    ul.unlock();
-    sl.unlock();
+        slot->publish();
+        st.notifyWriter();
+        return;
+    }
+}
+
+void SocketProducerConsumer::_sendToStreamLoop(Session &session, StreamSlot &slot) {
+    auto &st = *slot.st;
+    std::unique_lock ul(st.mutex);
 
     ScopedGuard sg([&] {
-        sl.lock();
+        if (!ul.owns_lock())
+            ul.lock();
+
+        // Once the writer exits (because the stream is closing or failed), the frames still queued
+        // on the stream will never be sent
+        st.closing = true;
+        st.clearSendQueue();
+        slot.publish();
+        _notifyCapacity(session);
+    });
+
+    while (true) {
+        // Frames which were sent with MSG_ZEROCOPY keep their queue slots until the kernel releases
+        // them, so with nothing else to send the writer waits for these completions, but it still
+        // has to wake up as soon as more frames are queued
+        if (!st.closing && st.sendQueue.size() == st.numSentFrames &&
+            st.stream.zeroCopyPending()) {
+            st.waitingForCompletions = true;
+            ul.unlock();
+
+            st.stream.waitForZeroCopyCompletions(st.wakeEvent);
+            uint64_t numWakeups;
+            st.wakeEvent.readNonBlocking(&numWakeups, sizeof(numWakeups));
+
+            ul.lock();
+            st.waitingForCompletions = false;
+        } else {
+            st.cv.wait(ul, [&] {
+                return st.closing || st.sendQueue.size() > st.numSentFrames ||
+                       st.stream.zeroCopyPending();
+            });
+        }
+        if (st.closing)
+            return;
+
+        const size_t numQueued = st.sendQueue.size() - st.numSentFrames;
+
+        st.sending = true;
+        ul.unlock();
+        const size_t numCompleted =
+            st.stream.zeroCopyPending() ? st.stream.reapZeroCopyCompletions() : 0;
         ul.lock();
 
-        st->inUse = false;
-        st->bytesSending -= buf.size;
-        session.cv.notify_one();
-    });
+        st.numZeroCopyCallsCompleted += numCompleted;
+        st.releaseSentBatches();
+        if (!numQueued) {
+            st.sending = false;
+            slot.publish();
+            _notifyCapacity(session);
+            continue;
+        }
 
-    st->stream.send(buf);
-    st->bytesSent += buf.size;
+        // Frames are only popped after they have been sent (and released by the kernel in the
+        // case of zero-copy), so the producers never overwrite a slot which is being sent
+        TunnelFrameBuffer batch[TunnelFrameStream::kMaxSendBatch];
+        const size_t batchSize = std::min(numQueued, TunnelFrameStream::kMaxSendBatch);
+        size_t batchBytes = 0;
+        for (size_t i = 0; i < batchSize; i++) {
+            batch[i] = st.sendQueue.at(st.numSentFrames + i);
+            batchBytes += batch[i].size;
+        }
+        const size_t offset = std::exchange(st.headSentBytes, 0);
+
+        ul.unlock();
+
+        const auto startedAt = std::chrono::steady_clock::now();
+        const size_t numZeroCopyCalls =
+            st.stream.send(batch, batchSize, numQueued > batchSize /* more */, offset);
+        _stats.recordSend(batchSize, batchBytes, numZeroCopyCalls, startedAt);
+
+        ul.lock();
+
+        st.sending = false;
+        st.sentBatches.push_back({batchSize, numZeroCopyCalls});
+        st.numSentFrames += batchSize;
+        st.releaseSentBatches();
+        slot.publish();
+        _notifyCapacity(session);
+    }
+}
+
+void SocketProducerConsumer::_notifyCapacity(Session &session) {
+    std::lock_guard lg(session.mutex);
+    session.cv.notify_all();
+
+    if (session.producersWaiting) {
+        session.producersWaiting = false;
+        pipeSignalCapacity();
+    }
 }
 
 void SocketProducerConsumer::onTunnelFrameFromNext(TunnelFrameBuffer buf) {
@@ -282,48 +616,374 @@ void SocketProducerConsumer::_receiveFromSocketLoop(Session &session, TunnelFram
             throw Exception("Interrupted");
         }
 
-        pipeInvokePrev(stream.receive());
+        TunnelFrameBuffer frames[kMaxReceiveBatch];
+        const TunnelFrameBuffers batch{frames, stream.receive(frames, kMaxReceiveBatch)};
+
+        uint64_t batchBytes = 0;
+        for (const auto &frame : batch)
+            batchBytes += frame.size;
+        _stats.bytesReceived.add(batchBytes);
+        _stats.framesReceived.add(batch.count);
+
+        if (_receiveTransforms) {
+            _receiveTransforms->submit(batch);
+        } else {
+            _stages.onTunnelFramesFromNext(batch);
+            pipeInvokePrev(batch);
+        }
+    }
+}
+
+SocketProducerConsumer::Stats::Stats(const std::string &desc)
+    : framesSent(MetricsRegistry::get().counter("socket." + desc + ".frames_sent")),
+      bytesSent(MetricsRegistry::get().counter("socket." + desc + ".bytes_sent")),
+      sendBatches(MetricsRegistry::get().counter("socket." + desc + ".send_batches")),
+      zeroCopyCalls(MetricsRegistry::get().counter("socket." + desc + ".zerocopy_calls")),
+      framesDropped(MetricsRegistry::get().counter("socket." + desc + ".frames_dropped")),
+      framesReceived(MetricsRegistry::get().counter("socket." + desc + ".frames_received")),
+      bytesReceived(MetricsRegistry::get().counter("socket." + desc + ".bytes_received")),
+      framesQueued(MetricsRegistry::get().gauge("socket." + desc + ".frames_queued")),
+      streams(MetricsRegistry::get().gauge("socket." + desc + ".streams")),
+      sendMicros(MetricsRegistry::get().histogram("socket." + desc + ".send_us")) {}
+
+void SocketProducerConsumer::Stats::recordSend(size_t numFrames, size_t numBytes,
+                                               size_t numZeroCopyCalls,
+                                               std::chrono::steady_clock::time_point startedAt) {
+    sendMicros.record(std::chrono::duration_cast<std::chrono::microseconds>(
+                          std::chrono::steady_clock::now() - startedAt)
+                          .count());
+    framesSent.add(numFrames);
+    bytesSent.add(numBytes);
+    sendBatches.add();
+    zeroCopyCalls.add(numZeroCopyCalls);
+}
+
+SocketProducerConsumer::StreamTracker::StreamTracker(TunnelFrameStream stream, Stats &stats)
+    : stream(std::move(stream)),
+      wakeEvent("Stream writer wake event", SYSCALL(::eventfd(0, EFD_NONBLOCK))), stats(stats) {}
+
+void SocketProducerConsumer::StreamTracker::notifyWriter() {
+    if (waitingForCompletions) {
+        const uint64_t kWakeup = 1;
+        wakeEvent.writeNonBlocking(&kWakeup, sizeof(kWakeup));
+    } else {
+        cv.notify_one();
+    }
+}
+
+void SocketProducerConsumer::StreamTracker::enqueue(TunnelFrameBuffer buf) {
+    sendQueue.push(buf);
+    bytesSending += buf.size;
+    stats.framesQueued.add(1);
+}
+
+void SocketProducerConsumer::StreamTracker::releaseSentBatches() {
+    while (!sentBatches.empty()) {
+        auto &batch = sentBatches.front();
+        if (batch.numZeroCopyCalls > numZeroCopyCallsCompleted)
+            break;
+
+        numZeroCopyCallsCompleted -= batch.numZeroCopyCalls;
+
+        for (size_t i = 0; i < batch.numFrames; i++)
+            bytesSending -= sendQueue.at(i).size;
+        sendQueue.pop(batch.numFrames);
+        numSentFrames -= batch.numFrames;
+        stats.framesQueued.add(-int64_t(batch.numFrames));
+
+        sentBatches.pop_front();
     }
 }
 
+void SocketProducerConsumer::StreamTracker::clearSendQueue() {
+    stats.framesDropped.add(sendQueue.size() - numSentFrames);
+    stats.framesQueued.add(-int64_t(sendQueue.size()));
+
+    bytesSending -= sendQueue.bytes();
+    sendQueue.clear();
+    headSentBytes = 0;
+    sentBatches.clear();
+    numSentFrames = 0;
+}
+
+void SocketProducerConsumer::StreamSlot::publish() {
+    bytesQueued.store(st->bytesSending, std::memory_order_relaxed);
+    state.store(st->closing ? kClosing : st->sendQueue.full() ? kFull : kAccepting,
+                std::memory_order_release);
+}
+
 SocketProducerConsumer::Session::Session(SessionId sessionId) : sessionId(std::move(sessionId)) {}
 
-TunnelFrameStream::TunnelFrameStream(ScopedFileDescriptor fd) : _fd(std::move(fd)) {
-    _fd.makeNonBlocking();
+TunnelFrameStream::TunnelFrameStream(ScopedFileDescriptor fd)
+    : _fd(std::move(fd)), _rxRing(kReceiveRingSize) {
+    struct stat s;
+    SYSCALL(::fstat(_fd, &s));
+    _isSocket = S_ISSOCK(s.st_mode);
+
+    // Sockets are left blocking, so that the receiving thread waits inside `read`, which (unlike
+    // `poll`) doesn't wake up for the zero-copy completions arriving on the socket's error queue.
+    // The sends, which must not block, ask for it explicitly through MSG_DONTWAIT.
+    if (!_isSocket)
+        _fd.makeNonBlocking();
 }
 
 TunnelFrameStream::TunnelFrameStream(TunnelFrameStream &&) = default;
 
 TunnelFrameStream::~TunnelFrameStream() { close(); }
 
+void TunnelFrameStream::shutdown() {
+    if (_isSocket)
+        ::shutdown(_fd, SHUT_RDWR);
+}
+
 void TunnelFrameStream::close() { _fd.close(); }
 
-void TunnelFrameStream::send(TunnelFrameBuffer buf) {
-    int numWritten = 0;
-    while (numWritten < buf.size) {
-        numWritten += _fd.write((void const *)&buf.data[numWritten], buf.size - numWritten);
+size_t TunnelFrameStream::send(const TunnelFrameBuffer *bufs, size_t count, bool more,
+                               size_t offset) {
+    RASSERT(count && count <= kMaxSendBatch);
+    RASSERT(offset < bufs[0].size);
+
+    struct iovec iov[kMaxSendBatch];
+    size_t totalSize = 0;
+    for (size_t i = 0; i < count; i++) {
+        iov[i].iov_base = bufs[i].data;
+        iov[i].iov_len = bufs[i].size;
+        totalSize += bufs[i].size;
+    }
+    iov[0].iov_base = (uint8_t *)iov[0].iov_base + offset;
+    iov[0].iov_len -= offset;
+    totalSize -= offset;
+
+    const bool zeroCopy = zeroCopyFor(totalSize);
+    size_t numZeroCopyCalls = 0;
+
+    struct iovec *iovCurrent = iov;
+    int iovCount = count;
+
+    size_t numWritten = 0;
+    while (numWritten < totalSize) {
+        size_t n;
+        if (_isSocket) {
+            struct msghdr msg = {0};
+            msg.msg_iov = iovCurrent;
+            msg.msg_iovlen = iovCount;
+            n = _fd.sendmsg(&msg,
+                            MSG_NOSIGNAL | (more ? MSG_MORE : 0) | (zeroCopy ? MSG_ZEROCOPY : 0));
+            if (zeroCopy)
+                ++numZeroCopyCalls;
+        } else {
+            n = _fd.writev(iovCurrent, iovCount);
+        }
+        numWritten += n;
+
+        // Skip over the buffers which were sent completely and adjust the partially sent one
+        while (iovCount && n >= iovCurrent->iov_len) {
+            n -= iovCurrent->iov_len;
+            ++iovCurrent;
+            --iovCount;
+        }
+        if (n) {
+            iovCurrent->iov_base = (uint8_t *)iovCurrent->iov_base + n;
+            iovCurrent->iov_len -= n;
+        }
+    }
+
+    _zeroCopyNextCall += numZeroCopyCalls;
+    RPROBE3(stream_send, int(_fd), count, numWritten);
+
+    for (size_t i = 0; i < count; i++)
+        FrameTrace::recordFrame(FrameTrace::kFrameSent, bufs[i].data, bufs[i].size, int(_fd));
+
+    RLOG(trace) << "Sent " << count << " frame(s) of " << numWritten << " bytes"
+                << (zeroCopy ? " (zero-copy)" : "");
+    return numZeroCopyCalls;
+}
+
+size_t TunnelFrameStream::trySend(const TunnelFrameBuffer &buf) {
+    int n;
+    if (_isSocket) {
+        struct iovec iov = {buf.data, buf.size};
+        struct msghdr msg = {0};
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        n = _fd.sendmsgNonBlocking(&msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+    } else {
+        n = _fd.writeNonBlocking(buf.data, buf.size);
     }
+    if (n <= 0)
+        return 0;
 
-    BOOST_LOG_TRIVIAL(trace) << "Sent frame of " << numWritten << " bytes";
+    if (size_t(n) == buf.size) {
+        RPROBE3(stream_send, int(_fd), 1, n);
+        FrameTrace::recordFrame(FrameTrace::kFrameSent, buf.data, buf.size, int(_fd));
+        RLOG(trace) << "Sent frame of " << n << " bytes directly";
+    }
+    return n;
+}
+
+bool TunnelFrameStream::enableZeroCopy(size_t minBytes) {
+    RASSERT(minBytes > 0);
+
+    if (!_isSocket)
+        return false;
+
+    constexpr int kZeroCopy = 1;
+    if (::setsockopt(_fd, SOL_SOCKET, SO_ZEROCOPY, &kZeroCopy, sizeof(kZeroCopy)) < 0) {
+        BOOST_LOG_TRIVIAL(warning) << "Zero-copy is not supported on " << _fd.toString() << ": "
+                                   << SystemException::getLastError();
+        return false;
+    }
+
+    _zeroCopyMinBytes = minBytes;
+    return true;
+}
+
+size_t TunnelFrameStream::reapZeroCopyCompletions() {
+    const uint32_t completedUpToBefore = _zeroCopyCompletedUpTo;
+
+    while (zeroCopyPending()) {
+        uint8_t control[CMSG_SPACE(sizeof(struct sock_extended_err)) + 64];
+        struct msghdr msg = {0};
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+
+        if (::recvmsg(_fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+            if (errno != EWOULDBLOCK && errno != EAGAIN)
+                SystemException::throwFromErrno(
+                    boost::format("Failed to read the error queue of %s") % _fd.toString());
+            break;
+        }
+
+        for (auto *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            if (!((cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR) ||
+                  (cmsg->cmsg_level == SOL_IPV6 && cmsg->cmsg_type == IPV6_RECVERR)))
+                continue;
+
+            const auto *serr = (struct sock_extended_err const *)CMSG_DATA(cmsg);
+            if (serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY || serr->ee_errno != 0)
+                continue;
+
+            // If the kernel keeps falling back to copying (for example on loopback), zero-copy
+            // only adds overhead from here on
+            if (serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+                ++_zeroCopyCopied;
+            else
+                _zeroCopyCopied = 0;
+            if (_zeroCopyCopied >= kMaxZeroCopyCopied && zeroCopyEnabled()) {
+                BOOST_LOG_TRIVIAL(info) << "Kernel copied " << _zeroCopyCopied
+                                        << " zero-copy sends in a row on " << _fd.toString()
+                                        << "; disabling zero-copy";
+                _zeroCopyMinBytes = 0;
+            }
+
+            _zeroCopyCompletedOutOfOrder.emplace_back(serr->ee_info, serr->ee_data);
+        }
+
+        // Advance over all the contiguous ranges of completed calls
+        bool advanced = true;
+        while (advanced) {
+            advanced = false;
+            for (auto it = _zeroCopyCompletedOutOfOrder.begin();
+                 it != _zeroCopyCompletedOutOfOrder.end(); ++it) {
+                if (it->first == _zeroCopyCompletedUpTo) {
+                    _zeroCopyCompletedUpTo = it->second + 1;
+                    _zeroCopyCompletedOutOfOrder.erase(it);
+                    advanced = true;
+                    break;
+                }
+            }
+        }
+    }
+
+    return _zeroCopyCompletedUpTo - completedUpToBefore;
+}
+
+void TunnelFrameStream::waitForZeroCopyCompletions(int wakeFd) {
+    // The presence of notifications on the error queue is signalled as POLLERR, which is reported
+    // without being asked for
+    pollfd fds[2] = {{_fd, 0, 0}, {wakeFd, POLLIN, 0}};
+    SYSCALL(::poll(fds, 2, -1));
+    if (fds[0].revents & (POLLHUP | POLLNVAL))
+        throw Exception(boost::format("Stream %s hung up while waiting for zero-copy completions") %
+                        _fd.toString());
 }
 
 TunnelFrameBuffer TunnelFrameStream::receive() {
-    size_t numRead = 0;
-    while (numRead < sizeof(TunnelFrameHeaderInfo)) {
-        numRead += _fd.read((void *)&_buffer[numRead], sizeof(TunnelFrameHeaderInfo) - numRead);
+    TunnelFrameBuffer buf;
+    receive(&buf, 1);
+    return buf;
+}
+
+size_t TunnelFrameStream::receive(TunnelFrameBuffer *frames, size_t maxFrames) {
+    RASSERT(maxFrames > 0);
+
+    while (true) {
+        size_t numFrames = _parseReceived(frames, maxFrames);
+        if (numFrames) {
+            RPROBE2(stream_receive, int(_fd), numFrames);
+            for (size_t i = 0; i < numFrames; i++)
+                FrameTrace::recordFrame(FrameTrace::kFrameReceived, frames[i].data, frames[i].size,
+                                        int(_fd));
+            return numFrames;
+        }
+
+        // The ring always has free space at this point, because it is bigger than the largest
+        // possible frame and everything up to `_rxBegin` has been handed out already
+        const size_t freeBytes = kReceiveRingSize - (_rxEnd - _rxBegin);
+        RASSERT(freeBytes > 0);
+
+        const size_t endPos = _rxEnd % kReceiveRingSize;
+        const size_t tailBytes = std::min(freeBytes, kReceiveRingSize - endPos);
+
+        struct iovec iov[2];
+        iov[0].iov_base = &_rxRing[endPos];
+        iov[0].iov_len = tailBytes;
+        iov[1].iov_base = &_rxRing[0];
+        iov[1].iov_len = freeBytes - tailBytes;
+
+        const int numRead = _fd.readv(iov, iov[1].iov_len ? 2 : 1);
+        _rxEnd += numRead;
+        RLOG(trace) << "Received " << numRead << " bytes";
     }
+}
 
-    const auto &hdrInfo = TunnelFrameHeaderInfo::check({_buffer, numRead});
-    const size_t totalSize = hdrInfo.desc.size;
-    BOOST_LOG_TRIVIAL(trace) << "Received header of frame of size " << hdrInfo.desc.size
-                             << " bytes";
+size_t TunnelFrameStream::_parseReceived(TunnelFrameBuffer *frames, size_t maxFrames) {
+    size_t numFrames = 0;
+    while (numFrames < maxFrames) {
+        const size_t numBuffered = _rxEnd - _rxBegin;
+        if (numBuffered < sizeof(TunnelFrameHeaderInfo))
+            break;
+
+        TunnelFrameHeaderInfo hdrInfo;
+        _copyFromRing((uint8_t *)&hdrInfo, _rxBegin, sizeof(hdrInfo));
+        TunnelFrameHeaderInfo::check({(uint8_t const *)&hdrInfo, sizeof(hdrInfo)});
+
+        const size_t frameSize = hdrInfo.desc.size;
+        if (frameSize < sizeof(TunnelFrameHeaderInfo))
+            throw Exception(boost::format("Invalid tunnel frame size %1%") % frameSize);
+        if (numBuffered < frameSize)
+            break;
+
+        const size_t beginPos = _rxBegin % kReceiveRingSize;
+        if (beginPos + frameSize <= kReceiveRingSize) {
+            frames[numFrames] = {&_rxRing[beginPos], frameSize};
+        } else {
+            _copyFromRing(_rxWrappedFrame, _rxBegin, frameSize);
+            frames[numFrames] = {_rxWrappedFrame, frameSize};
+        }
 
-    while (numRead < totalSize) {
-        numRead += _fd.read((void *)&_buffer[numRead], totalSize - numRead);
+        _rxBegin += frameSize;
+        ++numFrames;
     }
 
-    RASSERT(numRead == totalSize);
-    return {_buffer, totalSize};
+    return numFrames;
+}
+
+void TunnelFrameStream::_copyFromRing(uint8_t *dest, size_t pos, size_t size) const {
+    const size_t beginPos = pos % kReceiveRingSize;
+    const size_t tailBytes = std::min(size, kReceiveRingSize - beginPos);
+    memcpy(dest, &_rxRing[beginPos], tailBytes);
+    memcpy(dest + tailBytes, &_rxRing[0], size - tailBytes);
 }
 
 } // namespace ruralpi
@@ -18,18 +18,25 @@
 
 #pragma once
 
+#include <array>
 #include <atomic>
 #include <boost/asio/thread_pool.hpp>
 #include <boost/functional/hash.hpp>
+#include <chrono>
 #include <condition_variable>
-#include <list>
+#include <deque>
 #include <mutex>
+#include <optional>
 #include <shared_mutex>
+#include <thread>
 #include <unordered_map>
 
-#include "common/compressing_tunnel_frame_pipe.h"
+#include "common/compressing_tunnel_frame_stage.h"
+#include "common/cpu_affinity.h"
 #include "common/file_descriptor.h"
-#include "common/signing_tunnel_frame_pipe.h"
+#include "common/metrics.h"
+#include "common/ordered_transform_pool.h"
+#include "common/signing_tunnel_frame_stage.h"
 #include "common/tunnel_frame.h"
 
 namespace ruralpi {
@@ -50,16 +57,86 @@ public:
      * Expects a buffer pointing to a closed tunnel frame writer. Takes its contents and sends them
      * on the socket. Will block if the buffer of the socket is full.
      */
-    void send(TunnelFrameBuffer buf);
+    void send(TunnelFrameBuffer buf) { send(&buf, 1, false /* more */); }
+
+    /**
+     * Same as above, but sends `count` frames with a single gathering system call (as long as the
+     * socket buffer has space for all of them). If `more` is true, the kernel is hinted (through
+     * MSG_MORE) that further frames will follow immediately, so it can coalesce them into fuller
+     * TCP segments. The first `offset` bytes of the first frame are skipped, because they have
+     * already been sent through `trySend`.
+     *
+     * Returns the number of MSG_ZEROCOPY system calls, which were used to send the frames (see
+     * `enableZeroCopy` below). If it is not zero, the kernel may still be referencing the buffers
+     * and they must not be modified or reused until `reapZeroCopyCompletions` has reported these
+     * calls as completed.
+     */
+    static constexpr size_t kMaxSendBatch = 16;
+    size_t send(const TunnelFrameBuffer *bufs, size_t count, bool more, size_t offset = 0);
+
+    /**
+     * Sends as much of `buf` as fits in the socket buffer without blocking (and without
+     * MSG_ZEROCOPY) and returns the number of bytes sent, which may be anything from 0 to the size
+     * of the frame.
+     */
+    size_t trySend(const TunnelFrameBuffer &buf);
+
+    /**
+     * Opts the stream into sending batches of at least `minBytes` through MSG_ZEROCOPY, which
+     * avoids copying them into the kernel. Returns false and leaves the stream unchanged if the
+     * file descriptor or the kernel don't support it.
+     */
+    bool enableZeroCopy(size_t minBytes);
+    bool zeroCopyEnabled() const { return _zeroCopyMinBytes > 0; }
+    bool zeroCopyFor(size_t numBytes) const {
+        return zeroCopyEnabled() && numBytes >= _zeroCopyMinBytes;
+    }
+    bool zeroCopyPending() const { return _zeroCopyCompletedUpTo != _zeroCopyNextCall; }
+
+    /**
+     * Reads the zero-copy completion notifications from the socket's error queue without blocking
+     * and returns the number of MSG_ZEROCOPY calls (in the order in which they were made), which
+     * the kernel has released since the last invocation.
+     *
+     * If the kernel reports `kMaxZeroCopyCopied` consecutive completions as having been copied
+     * anyway (for example on loopback), zero-copy is disabled for the subsequent sends.
+     */
+    static constexpr size_t kMaxZeroCopyCopied = 8;
+    size_t reapZeroCopyCompletions();
+
+    /**
+     * Blocks until there are zero-copy completions to reap or until `wakeFd` (if not negative)
+     * becomes readable, whichever comes first. Throws if the socket is hung up.
+     */
+    void waitForZeroCopyCompletions(int wakeFd = -1);
 
     /**
      * Receives a tunnel frame from the socket. Will block if there is no data available from the
-     * socket yet.
+     * socket yet. The returned buffer is only valid until the next call to `receive`.
      */
     TunnelFrameBuffer receive();
 
     /**
-     * Closes the underlying file description.
+     * Same as above, but places up to `maxFrames` complete frames in `frames` and returns their
+     * number (which is always at least 1). Frames which were already buffered are returned without
+     * performing any system calls, otherwise a single read is issued for as many bytes as the
+     * socket has available (up to the free space in the receive ring).
+     *
+     * The returned buffers point directly inside the receive ring (except for a frame, which wraps
+     * around its end) and are only valid until the next call to `receive`.
+     */
+    static constexpr size_t kReceiveRingSize = 64 * 1024;
+    size_t receive(TunnelFrameBuffer *frames, size_t maxFrames);
+
+    /**
+     * Shuts down both directions of the socket without closing the file descriptor, which fails
+     * the sends and receives blocked on it from other threads. Has no effect on non-sockets.
+     */
+    void shutdown();
+
+    /**
+     * Closes the underlying file description. Must not be called while other threads may still be
+     * using the stream (see `shutdown`), because the file descriptor may be reused.
      */
     void close();
 
@@ -71,7 +148,43 @@ public:
 private:
     ScopedFileDescriptor _fd;
 
-    uint8_t _buffer[kTunnelFrameMaxSize];
+    // Whether `_fd` is a socket (as opposed to a pipe, which is what the unit-tests use) and so
+    // supports `sendmsg`
+    bool _isSocket;
+
+    // Batches of at least that many bytes are sent with MSG_ZEROCOPY (0 means disabled)
+    size_t _zeroCopyMinBytes{0};
+
+    // The kernel numbers the MSG_ZEROCOPY calls consecutively starting from zero and reports their
+    // completion as ranges, which in theory might come out of order. These keep track of the next
+    // call number and of the calls completed so far.
+    uint32_t _zeroCopyNextCall{0};
+    uint32_t _zeroCopyCompletedUpTo{0};
+    std::vector<std::pair<uint32_t, uint32_t>> _zeroCopyCompletedOutOfOrder;
+
+    // Number of consecutive completions, which the kernel reported as copied
+    size_t _zeroCopyCopied{0};
+
+    /**
+     * Parses the complete frames from the receive ring, without reading from the socket.
+     */
+    size_t _parseReceived(TunnelFrameBuffer *frames, size_t maxFrames);
+
+    /**
+     * Copies `size` bytes starting at the ring position `pos` to `dest`, taking care of the wrap.
+     */
+    void _copyFromRing(uint8_t *dest, size_t pos, size_t size) const;
+
+    // Ring buffer, which holds the received bytes. The `_rxBegin` and `_rxEnd` counters only ever
+    // increase and are mapped to positions in the ring modulo its size. The bytes between them
+    // have been received, but not yet parsed as frames.
+    std::vector<uint8_t> _rxRing;
+    size_t _rxBegin{0};
+    size_t _rxEnd{0};
+
+    // Frames, which wrap around the end of `_rxRing` are copied here, so they can be returned as a
+    // contiguous buffer (there can be at most one such frame at a time)
+    uint8_t _rxWrappedFrame[kTunnelFrameMaxSize];
 };
 
 /**
@@ -85,12 +198,28 @@ public:
      * or as a server (where clientSessionId is not set). The difference is that when run as a
      * client, no mapping will be kept between outbound requests in order to differentiate for which
      * clients they need to be dispatched.
+     *
+     * The thread receiving from the `i`'th socket passed to `addSocket` is pinned to the `i`'th CPU
+     * from `cpuAffinity`.
+     *
+     * If `numTransformThreads` is non-zero, the frames are compressed, signed, etc on a pool of
+     * that many threads for each direction, instead of on the thread which carries them.
+     *
+     * The metrics of the instance are named "socket.<desc>.*" (and "transform.<desc>.send.*" and
+     * "transform.<desc>.receive.*" for the transform threads), so that the instances in the same
+     * process are counted separately.
      */
-    SocketProducerConsumer(boost::optional<SessionId> clientSessionId, TunnelFramePipe &prev);
+    SocketProducerConsumer(std::string desc, boost::optional<SessionId> clientSessionId,
+                           TunnelFramePipe &prev, CpuAffinity cpuAffinity = CpuAffinity(),
+                           size_t numTransformThreads = 0);
     ~SocketProducerConsumer();
 
     struct SocketConfig {
         ScopedFileDescriptor fd;
+
+        // If non-zero, batches of frames of at least that many bytes will be sent on the socket
+        // using MSG_ZEROCOPY
+        size_t zeroCopyMinBytes{0};
     };
     void addSocket(SocketConfig config);
 
@@ -99,19 +228,125 @@ private:
     void onTunnelFrameFromPrev(TunnelFrameBuffer buf) override;
     void onTunnelFrameFromNext(TunnelFrameBuffer buf) override;
 
+    // Statistics for the client/server streams, which are exposed through the metrics registry
+    struct Stats {
+        Stats(const std::string &desc);
+
+        Counter &framesSent;
+        Counter &bytesSent;
+        Counter &sendBatches;
+        Counter &zeroCopyCalls;
+        Counter &framesDropped;
+        Counter &framesReceived;
+        Counter &bytesReceived;
+        Gauge &framesQueued;
+        Gauge &streams;
+        Histogram &sendMicros;
+
+        /**
+         * Accounts for a batch of `numFrames` frames of `numBytes` sent on a stream, starting at
+         * `startedAt`.
+         */
+        void recordSend(size_t numFrames, size_t numBytes, size_t numZeroCopyCalls,
+                        std::chrono::steady_clock::time_point startedAt);
+    };
+
     /**
      * Tracks the state of a particular stream under a given session.
      */
     struct StreamTracker {
-        StreamTracker(TunnelFrameStream stream) : stream(std::move(stream)) {}
+        StreamTracker(TunnelFrameStream stream, Stats &stats);
 
         TunnelFrameStream stream;
 
-        bool inUse{false};
+        // Dedicated thread (running `_sendToStreamLoop`), which sends the frames queued on the
+        // stream, so that a slow stream only delays the frames queued on it. It is woken up
+        // through `notifyWriter` when frames are queued or when `closing` is set.
+        std::thread writer;
+
+        // Signalled by `notifyWriter` while the writer waits for zero-copy completions, because it
+        // can't wait on `cv` and on the socket at the same time
+        ScopedFileDescriptor wakeEvent;
+
+        // Mutex to protect access to the state below
+        std::mutex mutex;
+        std::condition_variable cv;
+        bool closing{false};
+
+        // Set while the writer waits on `wakeEvent` instead of `cv`
+        bool waitingForCompletions{false};
+
+        /**
+         * Must be called with `mutex` held, after queueing frames or setting `closing`.
+         */
+        void notifyWriter();
+
+        // Set while the `writer` is using the stream without holding `mutex`, during which the
+        // producers must not send on it directly (see `_send`)
+        bool sending{false};
+
+        // Frames, which were scheduled on the stream and the total number of their bytes. The
+        // producers only copy the frames here and the `writer` sends them in batches.
+        static constexpr size_t kSendQueueDepth = 2 * TunnelFrameStream::kMaxSendBatch;
+        TunnelFrameQueue sendQueue{kSendQueueDepth};
         size_t bytesSending{0};
 
-        // Statistics tracking
-        std::atomic_uint64_t bytesSent{0};
+        // Number of bytes at the start of the first unsent frame in `sendQueue`, which a producer
+        // has already sent directly before the socket buffer filled up
+        size_t headSentBytes{0};
+
+        /**
+         * Appends `buf` to the `sendQueue` (which must not be full).
+         */
+        void enqueue(TunnelFrameBuffer buf);
+
+        // Batches of frames from the front of `sendQueue`, which have already been sent, but which
+        // can't be popped yet, because they were sent with MSG_ZEROCOPY and the kernel has not yet
+        // released them
+        struct SentBatch {
+            size_t numFrames;
+            size_t numZeroCopyCalls;
+        };
+        std::deque<SentBatch> sentBatches;
+        size_t numSentFrames{0};
+        size_t numZeroCopyCallsCompleted{0};
+
+        /**
+         * Pops from `sendQueue` the sent batches, whose buffers are no longer referenced by the
+         * kernel.
+         */
+        void releaseSentBatches();
+
+        /**
+         * Drops all the frames from `sendQueue`, including the ones which haven't been sent yet.
+         */
+        void clearSendQueue();
+
+        Stats &stats;
+    };
+
+    /**
+     * Entry in the stream table of a session. The tracker is only set and reset with `_mutex` held
+     * exclusively, so it stays in place for anyone holding `_mutex` shared. The state and load of
+     * the stream are republished through `publish` after every change to its send queue, so that
+     * the producers can pick a stream by scanning the table without taking any locks.
+     */
+    struct alignas(kCacheLineSize) StreamSlot {
+        enum State : uint8_t {
+            kFree,      // No stream is attached to the slot
+            kAccepting, // The send queue of the stream has space
+            kFull,      // The send queue of the stream is full
+            kClosing,   // The stream is closing and doesn't accept frames anymore
+        };
+        std::atomic<State> state{kFree};
+        std::atomic_size_t bytesQueued{0};
+
+        std::unique_ptr<StreamTracker> st;
+
+        /**
+         * Must be called with `st->mutex` held, after every change to its send queue.
+         */
+        void publish();
     };
 
     /**
@@ -125,13 +360,20 @@ private:
 
         const SessionId sessionId;
 
-        std::atomic_uint64_t nextSeqNum{TunnelFrameHeader::kInitFrameSeqNum + 1};
+        // Table of the streams of the session, of which only the first `numSlotsUsed` slots have
+        // ever been used. These and `numStreams` only change with `_mutex` held exclusively.
+        static constexpr size_t kMaxStreams = 32;
+        std::array<StreamSlot, kMaxStreams> streams;
+        size_t numSlotsUsed{0};
+        size_t numStreams{0};
 
+        // Waited on by the producers (with `mutex`) when the send queues of all streams are full
         std::mutex mutex;
         std::condition_variable cv;
 
-        using StreamsList = std::list<std::shared_ptr<StreamTracker>>;
-        StreamsList streams;
+        // Set when a frame was refused with `NotYetReadyException` because the send queues of all
+        // streams were full, so that the next one to free up signals the previous pipe to retry
+        bool producersWaiting{false};
     };
     using SessionsMap = std::unordered_map<SessionId, Session, boost::hash<SessionId>>;
 
@@ -141,13 +383,52 @@ private:
      */
     void _receiveFromSocketLoop(Session &session, TunnelFrameStream &stream);
 
+    /**
+     * Runs on the `writer` thread of each stream. Sends the frames queued on the stream until its
+     * `closing` flag is set or the stream fails.
+     */
+    void _sendToStreamLoop(Session &session, StreamSlot &slot);
+
+    /**
+     * Schedules `buf` to be sent on one of the streams of the session, after passing it through
+     * `_stages` if `transform` is true (otherwise it must have already been passed through them).
+     * Picks the stream with the fewest bytes queued and, if it has nothing else to send and its
+     * writer is idle, sends the frame on the calling thread without blocking. Otherwise (or if the
+     * socket buffer fills up in the middle of the frame) copies the frame to the stream's send
+     * queue, from where its writer sends it.
+     */
+    void _send(TunnelFrameBuffer buf, bool transform);
+
+    /**
+     * Must be called whenever one of the streams of the session frees up or is added, after the
+     * change has been published to its slot. Wakes up the senders blocked on the session and
+     * signals the previous pipe if it was refused a frame due to lack of capacity.
+     */
+    void _notifyCapacity(Session &session);
+
     // Indicates whether this socket is run as a client or server
     const boost::optional<SessionId> _clientSessionId;
 
-    // Passthrough pipes to sign and check signatures, compress and decompress the exchanged tunnel
-    // frames
-    boost::optional<CompressingTunnelFramePipe> _compresser;
-    boost::optional<SigningTunnelFramePipe> _signer;
+    // CPUs on which to pin the threads started by `addSocket` and the number of sockets added so
+    // far, which is used to select the CPU for the next one
+    const CpuAffinity _cpuAffinity;
+    std::atomic_size_t _numSocketsAdded{0};
+
+    Stats _stats;
+
+    // Passthrough stages to compress and decompress, sign and check signatures of the exchanged
+    // tunnel frames
+    StaticTunnelFramePipe<CompressingTunnelFrameStage, SigningTunnelFrameStage> _stages;
+
+    // Only set if transform threads were requested, in which case the frames in each direction are
+    // passed through `_stages` on that direction's workers instead of on the threads carrying them.
+    // The directions don't share workers, because delivering the sent frames may wait for space on
+    // the streams, which (through the other end) can depend on the received frames being delivered.
+    static constexpr size_t kMaxTransformsInFlight = 256;
+    std::optional<boost::asio::thread_pool> _sendTransformWorkers;
+    std::optional<boost::asio::thread_pool> _receiveTransformWorkers;
+    std::optional<OrderedTransformPool> _sendTransforms;
+    std::optional<OrderedTransformPool> _receiveTransforms;
 
     // Set of threads draining the streams from `_streams`
     boost::asio::thread_pool _pool;
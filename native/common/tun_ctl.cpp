@@ -71,4 +71,12 @@ std::vector<FileDescriptor> TunCtl::getQueues() const {
     return fds;
 }
 
+void TunCtl::setQueueAttached(const FileDescriptor &fd, bool attached) {
+    struct ifreq ifr = {0};
+    ifr.ifr_flags = attached ? IFF_ATTACH_QUEUE : IFF_DETACH_QUEUE;
+    SYSCALL_MSG(::ioctl(fd, TUNSETQUEUE, (void *)&ifr),
+                boost::format("Error %s tunnel queue %s") % (attached ? "attaching" : "detaching") %
+                    fd.toString());
+}
+
 } // namespace ruralpi
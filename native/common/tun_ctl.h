@@ -45,6 +45,13 @@ public:
      */
     std::vector<FileDescriptor> getQueues() const;
 
+    /**
+     * Attaches the queue file descriptor `fd` to (or detaches it from) its tunnel device. The
+     * kernel only steers the outgoing datagrams of the device to the attached queues, so a thread
+     * servicing a detached queue is not woken up. All queues start attached.
+     */
+    static void setQueueAttached(const FileDescriptor &fd, bool attached);
+
 private:
     std::string _deviceName;
     std::vector<FileDescriptor> _fds;
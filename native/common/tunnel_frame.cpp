@@ -24,12 +24,17 @@
 #include <cstring>
 
 #include "common/exception.h"
+#include "common/probes.h"
 
 namespace ruralpi {
 namespace {
 
 const uint8_t kVersion = 1;
 
+// Time which the pipe stages invoked (directly or indirectly) from the current one have spent
+// processing the frame, so that it can be excluded from the time of the current stage
+thread_local std::chrono::nanoseconds nestedStagesTime{0};
+
 } // namespace
 
 constexpr char TunnelFrameHeaderInfo::kMagic[3];
@@ -123,6 +128,40 @@ void TunnelFrameWriter::setSequenceNumberOnClosedBuffer(const TunnelFrameBuffer
     ((TunnelFrameHeader *)buf.data)->seqNum = seqNum;
 }
 
+TunnelFrameQueue::TunnelFrameQueue(size_t capacity)
+    : _frames(capacity * kTunnelFrameMaxSize), _sizes(capacity) {
+    RASSERT(capacity > 0);
+}
+
+void TunnelFrameQueue::push(ConstTunnelFrameBuffer buf) {
+    RASSERT(!full());
+    RASSERT(buf.size <= kTunnelFrameMaxSize);
+
+    const size_t slot = (_head + _count) % capacity();
+    memcpy(&_frames[slot * kTunnelFrameMaxSize], buf.data, buf.size);
+    _sizes[slot] = buf.size;
+
+    ++_count;
+    _bytes += buf.size;
+}
+
+TunnelFrameBuffer TunnelFrameQueue::at(size_t idx) {
+    RASSERT(idx < _count);
+
+    const size_t slot = (_head + idx) % capacity();
+    return {&_frames[slot * kTunnelFrameMaxSize], _sizes[slot]};
+}
+
+void TunnelFrameQueue::pop(size_t count) {
+    RASSERT(count <= _count);
+
+    for (size_t i = 0; i < count; i++) {
+        _bytes -= _sizes[_head];
+        _head = (_head + 1) % capacity();
+    }
+    _count -= count;
+}
+
 class TunnelFramePipe::NotYetReadyTunnelFramePipe : public TunnelFramePipe {
 public:
     NotYetReadyTunnelFramePipe() : TunnelFramePipe("NotYetReady", nullptr, nullptr) {}
@@ -138,16 +177,39 @@ public:
 
 TunnelFramePipe::TunnelFramePipe(std::string desc)
     : TunnelFramePipe(std::move(desc), &kNotYetReadyTunnelFramePipe, &kNotYetReadyTunnelFramePipe) {
+    auto &registry = MetricsRegistry::get();
+    _fromPrevNanos = &registry.histogram(boost::str(boost::format("pipe.%s.from_prev_ns") % _desc));
+    _fromNextNanos = &registry.histogram(boost::str(boost::format("pipe.%s.from_next_ns") % _desc));
 }
 
 TunnelFramePipe::NotYetReadyTunnelFramePipe TunnelFramePipe::kNotYetReadyTunnelFramePipe;
 
+std::atomic_bool TunnelFramePipe::_timingEnabled{false};
+
 TunnelFramePipe::TunnelFramePipe(std::string desc, TunnelFramePipe *prev, TunnelFramePipe *next)
     : _desc(std::move(desc)), _prev(prev), _next(next) {}
 
-void TunnelFramePipe::pipeInvokePrev(TunnelFrameBuffer buf) { _prev->onTunnelFrameFromNext(buf); }
+void TunnelFramePipe::_invokeTimed(Histogram *stageNanos, void (*invoke)(void *), void *fn) {
+    const auto outerNestedStagesTime = nestedStagesTime;
+    nestedStagesTime = {};
+    const auto startedAt = std::chrono::steady_clock::now();
 
-void TunnelFramePipe::pipeInvokeNext(TunnelFrameBuffer buf) {
+    try {
+        invoke(fn);
+    } catch (...) {
+        nestedStagesTime = outerNestedStagesTime;
+        throw;
+    }
+
+    const auto elapsed = std::chrono::steady_clock::now() - startedAt;
+    stageNanos->record(std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed -
+                                                                            nestedStagesTime)
+                           .count());
+    nestedStagesTime = outerNestedStagesTime + elapsed;
+}
+
+template <typename Fn>
+void TunnelFramePipe::_invokeNext(Fn &&fn) {
     std::unique_lock ul(_mutex);
 
     ++_numCallsToNext;
@@ -162,7 +224,39 @@ void TunnelFramePipe::pipeInvokeNext(TunnelFrameBuffer buf) {
             _cv.notify_all();
     });
 
-    next->onTunnelFrameFromPrev(buf);
+    fn(next);
+}
+
+void TunnelFramePipe::pipeInvokePrev(TunnelFrameBuffer buf) {
+    invokeTimed(_prev->_fromNextNanos, [&] { _prev->onTunnelFrameFromNext(buf); });
+}
+
+void TunnelFramePipe::pipeInvokeNext(TunnelFrameBuffer buf) {
+    _invokeNext([&](TunnelFramePipe *next) {
+        RPROBE3(pipe_invoke_next, _desc.c_str(), next->_desc.c_str(), buf.size);
+        invokeTimed(next->_fromPrevNanos, [&] { next->onTunnelFrameFromPrev(buf); });
+    });
+}
+
+void TunnelFramePipe::pipeInvokePrev(TunnelFrameBuffers bufs) {
+    invokeTimed(_prev->_fromNextNanos, [&] { _prev->onTunnelFramesFromNext(bufs); });
+}
+
+void TunnelFramePipe::pipeInvokeNext(TunnelFrameBuffers bufs) {
+    _invokeNext([&](TunnelFramePipe *next) {
+        RPROBE3(pipe_invoke_next_batch, _desc.c_str(), next->_desc.c_str(), bufs.count);
+        invokeTimed(next->_fromPrevNanos, [&] { next->onTunnelFramesFromPrev(bufs); });
+    });
+}
+
+void TunnelFramePipe::onTunnelFramesFromPrev(TunnelFrameBuffers bufs) {
+    for (auto &buf : bufs)
+        onTunnelFrameFromPrev(buf);
+}
+
+void TunnelFramePipe::onTunnelFramesFromNext(TunnelFrameBuffers bufs) {
+    for (auto &buf : bufs)
+        onTunnelFrameFromNext(buf);
 }
 
 void TunnelFramePipe::pipePush(TunnelFramePipe &prev) {
@@ -172,6 +266,8 @@ void TunnelFramePipe::pipePush(TunnelFramePipe &prev) {
 
     _prev = &prev;
     prev._next = this;
+
+    pipeSignalCapacity();
 }
 
 void TunnelFramePipe::pipePop() {
@@ -188,4 +284,6 @@ void TunnelFramePipe::pipePop() {
     _prev = &kNotYetReadyTunnelFramePipe;
 }
 
+void TunnelFramePipe::pipeSignalCapacity() { _prev->onCapacityFromNext(); }
+
 } // namespace ruralpi
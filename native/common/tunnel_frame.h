@@ -19,9 +19,16 @@
 #pragma once
 
 #include <array>
+#include <atomic>
 #include <boost/uuid/uuid.hpp>
 #include <condition_variable>
 #include <mutex>
+#include <string>
+#include <tuple>
+#include <utility>
+#include <vector>
+
+#include "common/metrics.h"
 
 namespace ruralpi {
 
@@ -37,6 +44,19 @@ struct TunnelFrameBuffer {
     size_t size;
 };
 
+/**
+ * Batch of frames, which are contiguous in memory (the equivalent of
+ * `std::span<TunnelFrameBuffer>`, which is not available in C++17).
+ */
+struct TunnelFrameBuffers {
+    TunnelFrameBuffer *frames;
+    size_t count;
+
+    TunnelFrameBuffer *begin() const { return frames; }
+    TunnelFrameBuffer *end() const { return frames + count; }
+    TunnelFrameBuffer &operator[](size_t idx) const { return frames[idx]; }
+};
+
 #pragma pack(push, 1)
 
 // This section contains all the structures which go on the network in binary format. All these
@@ -71,7 +91,8 @@ struct TunnelFrameHeader : public TunnelFrameHeaderInfo {
     SessionId sessionId;
 
     // Sequence number from the point of view of the sender of the frame. I.e., both client and
-    // server send their own sequence numbers which need to be consecutive
+    // server send their own increasing sequence numbers, which are assigned when the tunnel closes
+    // the frame, so frames dropped before reaching a stream leave gaps
     uint64_t seqNum;
 
     // Cryptographic signature of all the contents of the frame, which follow after this field (up
@@ -192,12 +213,63 @@ private:
     uint8_t *_current;
 };
 
+/**
+ * Fixed-capacity FIFO of tunnel frames, which owns the memory for the frames it contains (i.e.,
+ * pushing a frame copies its contents). It is not internally synchronised.
+ *
+ * Pushing a frame never moves any of the frames already in the queue, so the buffers returned by
+ * `at` stay valid until they are popped, even if more frames get pushed in the mean time.
+ */
+class TunnelFrameQueue {
+public:
+    TunnelFrameQueue(size_t capacity);
+
+    size_t capacity() const { return _sizes.size(); }
+    size_t size() const { return _count; }
+    bool empty() const { return _count == 0; }
+    bool full() const { return _count == capacity(); }
+
+    /**
+     * Returns the total number of frame bytes currently in the queue.
+     */
+    size_t bytes() const { return _bytes; }
+
+    /**
+     * Copies the contents of `buf` at the back of the queue. May only be called if the queue is not
+     * full.
+     */
+    void push(ConstTunnelFrameBuffer buf);
+    void push(TunnelFrameBuffer buf) { push(ConstTunnelFrameBuffer{buf.data, buf.size}); }
+
+    /**
+     * Returns the frame at position `idx` from the front of the queue, where `idx` must be less
+     * than `size()`.
+     */
+    TunnelFrameBuffer at(size_t idx);
+
+    /**
+     * Removes `count` frames from the front of the queue, which must be less or equal to `size()`.
+     */
+    void pop(size_t count);
+    void clear() { pop(_count); }
+
+private:
+    std::vector<uint8_t> _frames;
+    std::vector<size_t> _sizes;
+
+    size_t _head{0};
+    size_t _count{0};
+    size_t _bytes{0};
+};
+
 /**
  * Interface for exchanging tunnel frames between two parties (namely between the tunnel
  * producer/consumer and the client/server socket, which actually sends them on the wire).
  *
  * The tunnel frame pipes can be stacked in order to allow transformations, such as compression,
- * etc, to be performed before sending on the wire.
+ * etc, to be performed before sending on the wire. Each hop between two pipes costs a lock and a
+ * virtual call, so the transformations which are fixed for the lifetime of a pipe should instead
+ * be composed in a `StaticTunnelFramePipe` owned by it.
  */
 class TunnelFramePipe {
 public:
@@ -215,10 +287,49 @@ public:
     virtual void onTunnelFrameFromNext(TunnelFrameBuffer buf) = 0;
 
     /**
-     * Invoke the `onTunnelFrameReady` method of the previous or next pipe in the chain.
+     * Same as the methods above, but for a batch of frames, which were produced or received
+     * together. Stages which can amortise their per-call costs (locking, system calls, etc) across
+     * the frames of a batch should override them. The default implementations pass the frames one
+     * by one, in order, to the single-frame methods, so if one of them throws, the frames before it
+     * have already been passed on.
+     */
+    virtual void onTunnelFramesFromPrev(TunnelFrameBuffers bufs);
+    virtual void onTunnelFramesFromNext(TunnelFrameBuffers bufs);
+
+    /**
+     * Invoke the `onTunnelFrameReady` method of the previous or next pipe in the chain. The batch
+     * variants pay for the locking and dispatch once for the entire batch.
      */
     void pipeInvokePrev(TunnelFrameBuffer buf);
     void pipeInvokeNext(TunnelFrameBuffer buf);
+    void pipeInvokePrev(TunnelFrameBuffers bufs);
+    void pipeInvokeNext(TunnelFrameBuffers bufs);
+
+    /**
+     * Enables or disables the timing of the pipe stages. When enabled, the time which each stage
+     * spends processing a frame or a batch of frames (excluding the time spent in the stages it
+     * passes them on to) is recorded in the "pipe.<stage>.from_prev_ns" and
+     * "pipe.<stage>.from_next_ns" histograms. When disabled, the only cost on the path of the
+     * frames is checking this flag.
+     */
+    static void setTimingEnabled(bool enabled) {
+        _timingEnabled.store(enabled, std::memory_order_relaxed);
+    }
+    static bool timingEnabled() { return _timingEnabled.load(std::memory_order_relaxed); }
+
+    /**
+     * Invokes `fn`, which passes a frame to a pipe stage and if timing is enabled, records the time
+     * that stage spent processing it in `stageNanos` (which may be null if the stage is not timed).
+     */
+    template <typename Fn>
+    static void invokeTimed(Histogram *stageNanos, Fn &&fn) {
+        if (!stageNanos || !timingEnabled()) {
+            fn();
+            return;
+        }
+        _invokeTimed(
+            stageNanos, [](void *fn) { (*static_cast<std::remove_reference_t<Fn> *>(fn))(); }, &fn);
+    }
 
 protected:
     TunnelFramePipe(std::string desc);
@@ -226,14 +337,47 @@ protected:
     void pipePush(TunnelFramePipe &prev);
     void pipePop();
 
+    /**
+     * Instead of blocking when it can't accept a frame (because it is not connected yet or because
+     * it has no capacity), a pipe throws `NotYetReadyException` and later signals the previous pipe
+     * through `pipeSignalCapacity` when it may be able to accept frames again, which invokes the
+     * previous pipe's `onCapacityFromNext`. The producer of the frames retries on that signal
+     * instead of in a loop. Attaching a pipe through `pipePush` also signals the pipe it was
+     * attached to.
+     */
+    void pipeSignalCapacity();
+
+    /**
+     * Invoked on the thread of the next pipe every time it signals capacity. Because the signal may
+     * arrive between a failed attempt and the producer going to sleep, implementations should
+     * latch it (for example by writing to an eventfd, which the producer polls). Must not block or
+     * call back into the pipe.
+     */
+    virtual void onCapacityFromNext() {}
+
 private:
     class NotYetReadyTunnelFramePipe;
     static NotYetReadyTunnelFramePipe kNotYetReadyTunnelFramePipe;
 
     TunnelFramePipe(std::string desc, TunnelFramePipe *prev, TunnelFramePipe *next);
 
+    static void _invokeTimed(Histogram *stageNanos, void (*invoke)(void *), void *fn);
+
+    /**
+     * Invokes `fn` with the next pipe in the chain, which is guaranteed to stay attached until `fn`
+     * returns.
+     */
+    template <typename Fn>
+    void _invokeNext(Fn &&fn);
+
+    static std::atomic_bool _timingEnabled;
+
     const std::string _desc;
 
+    // Time spent by this stage in `onTunnelFrameFromPrev` and `onTunnelFrameFromNext` respectively
+    Histogram *_fromPrevNanos{nullptr};
+    Histogram *_fromNextNanos{nullptr};
+
     TunnelFramePipe *_prev;
     TunnelFramePipe *_next;
 
@@ -244,4 +388,105 @@ private:
     int _numCallsToNext{0};
 };
 
+/**
+ * Fixed chain of pipe stages, which is composed at compile time and embedded in the pipe owning it,
+ * so that passing a frame through the stages costs neither locks nor virtual calls and can be
+ * inlined. Frames from the previous pipe go through `Stages` in order and frames from the next pipe
+ * in reverse order.
+ *
+ * Each stage must provide a `static constexpr char kDesc[]`, which names its timing histograms the
+ * same way as for `TunnelFramePipe`, and `onTunnelFrameFromPrev/Next(TunnelFrameBuffer &buf)`,
+ * which transform the frame in place and have the same threading requirements as the methods of
+ * `TunnelFramePipe`. Stages which can process a batch of frames faster than one frame at a time can
+ * also provide `onTunnelFramesFromPrev/Next(TunnelFrameBuffers bufs)`.
+ */
+template <typename... Stages>
+class StaticTunnelFramePipe {
+public:
+    StaticTunnelFramePipe()
+        : _fromPrevNanos{&MetricsRegistry::get().histogram(std::string("pipe.") + Stages::kDesc +
+                                                           ".from_prev_ns")...},
+          _fromNextNanos{&MetricsRegistry::get().histogram(std::string("pipe.") + Stages::kDesc +
+                                                           ".from_next_ns")...} {}
+
+    void onTunnelFrameFromPrev(TunnelFrameBuffer &buf) {
+        _fromPrev(buf, std::index_sequence_for<Stages...>());
+    }
+
+    void onTunnelFrameFromNext(TunnelFrameBuffer &buf) {
+        _fromNext(buf, std::index_sequence_for<Stages...>());
+    }
+
+    /**
+     * Passes the entire batch through each stage before moving on to the next one.
+     */
+    void onTunnelFramesFromPrev(TunnelFrameBuffers bufs) {
+        _fromPrev(bufs, std::index_sequence_for<Stages...>());
+    }
+
+    void onTunnelFramesFromNext(TunnelFrameBuffers bufs) {
+        _fromNext(bufs, std::index_sequence_for<Stages...>());
+    }
+
+private:
+    static constexpr size_t kNumStages = sizeof...(Stages);
+
+    template <typename Bufs, size_t... I>
+    void _fromPrev(Bufs &bufs, std::index_sequence<I...>) {
+        (TunnelFramePipe::invokeTimed(_fromPrevNanos[I],
+                                      [&] { _stageFromPrev(std::get<I>(_stages), bufs, 0); }),
+         ...);
+    }
+
+    template <typename Bufs, size_t... I>
+    void _fromNext(Bufs &bufs, std::index_sequence<I...>) {
+        (TunnelFramePipe::invokeTimed(
+             _fromNextNanos[kNumStages - 1 - I],
+             [&] { _stageFromNext(std::get<kNumStages - 1 - I>(_stages), bufs, 0); }),
+         ...);
+    }
+
+    // Invoke the batch methods of the stages which have them and otherwise fall back to passing the
+    // frames of the batch one at a time (the `int` overloads are preferred if they compile)
+    template <typename Stage>
+    static void _stageFromPrev(Stage &stage, TunnelFrameBuffer &buf, int) {
+        stage.onTunnelFrameFromPrev(buf);
+    }
+
+    template <typename Stage>
+    static auto _stageFromPrev(Stage &stage, TunnelFrameBuffers bufs, int)
+        -> decltype(stage.onTunnelFramesFromPrev(bufs)) {
+        stage.onTunnelFramesFromPrev(bufs);
+    }
+
+    template <typename Stage>
+    static void _stageFromPrev(Stage &stage, TunnelFrameBuffers bufs, long) {
+        for (auto &buf : bufs)
+            stage.onTunnelFrameFromPrev(buf);
+    }
+
+    template <typename Stage>
+    static void _stageFromNext(Stage &stage, TunnelFrameBuffer &buf, int) {
+        stage.onTunnelFrameFromNext(buf);
+    }
+
+    template <typename Stage>
+    static auto _stageFromNext(Stage &stage, TunnelFrameBuffers bufs, int)
+        -> decltype(stage.onTunnelFramesFromNext(bufs)) {
+        stage.onTunnelFramesFromNext(bufs);
+    }
+
+    template <typename Stage>
+    static void _stageFromNext(Stage &stage, TunnelFrameBuffers bufs, long) {
+        for (auto &buf : bufs)
+            stage.onTunnelFrameFromNext(buf);
+    }
+
+    std::tuple<Stages...> _stages;
+
+    // Time spent by each stage in `onTunnelFrameFromPrev` and `onTunnelFrameFromNext` respectively
+    std::array<Histogram *, kNumStages> _fromPrevNanos;
+    std::array<Histogram *, kNumStages> _fromNextNanos;
+};
+
 } // namespace ruralpi
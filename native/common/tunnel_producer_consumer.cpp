@@ -20,13 +20,21 @@
 
 #include "common/tunnel_producer_consumer.h"
 
+#include <algorithm>
 #include <boost/asio.hpp>
 #include <boost/log/attributes/named_scope.hpp>
 #include <boost/log/trivial.hpp>
+#include <poll.h>
 #include <sstream>
+#include <sys/eventfd.h>
 
 #include "common/exception.h"
+#include "common/frame_trace.h"
 #include "common/ip_parsers.h"
+#include "common/logging.h"
+#include "common/pcap_tap.h"
+#include "common/probes.h"
+#include "common/tun_ctl.h"
 
 namespace ruralpi {
 namespace {
@@ -34,6 +42,19 @@ namespace {
 const Seconds kWaitForData(5);
 const Milliseconds kWaitForFullerBatch(5);
 
+// How often the utilization of the tunnel queues is measured when queue scaling is enabled
+const Seconds kQueueScalingInterval(1);
+
+uint64_t steadyClockNanos() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+}
+
+// Number of frames per tunnel queue, which are kept while the downstream pipe is not ready to
+// accept them, before the oldest ones start getting dropped
+constexpr size_t kMaxPendingFrames = 64;
+
 std::string debugLogDatagram(uint8_t const *data, size_t size) {
     std::stringstream ss;
 
@@ -59,15 +80,70 @@ std::string debugLogDatagram(uint8_t const *data, size_t size) {
     return ss.str();
 }
 
+/**
+ * Bounded FIFO of copies of the frames, which the downstream pipe was not ready to accept. When it
+ * is full, the oldest frame is dropped to make room, because by the time the pipe becomes ready the
+ * most recent traffic is the most likely to still be useful.
+ */
+class PendingFrames {
+public:
+    PendingFrames(size_t capacity) : _frames(capacity) {}
+
+    bool empty() const { return !_count; }
+    bool full() const { return _count == _frames.size(); }
+
+    TunnelFrameBuffer front() { return {_frames[_begin].data, _frames[_begin].size}; }
+
+    void pop() {
+        _begin = (_begin + 1) % _frames.size();
+        --_count;
+    }
+
+    /**
+     * Drops the oldest frame if the queue is `full` in order to make room for `buf`.
+     */
+    void push(TunnelFrameBuffer buf) {
+        if (full())
+            pop();
+
+        auto &frame = _frames[(_begin + _count++) % _frames.size()];
+        memcpy(frame.data, buf.data, buf.size);
+        frame.size = buf.size;
+    }
+
+private:
+    struct Frame {
+        uint8_t data[kTunnelFrameMaxSize];
+        size_t size{0};
+    };
+    std::vector<Frame> _frames;
+
+    size_t _begin{0};
+    size_t _count{0};
+};
+
 } // namespace
 
-TunnelProducerConsumer::TunnelProducerConsumer(std::vector<FileDescriptor> tunnelFds, int mtu)
-    : TunnelFramePipe("Tunnel"), _tunnelFds(tunnelFds.size()), _mtu(mtu), _stats(tunnelFds.size()) {
-    for (int i = 0; i < tunnelFds.size(); i++) {
+TunnelProducerConsumer::TunnelProducerConsumer(std::string desc,
+                                               std::vector<FileDescriptor> tunnelFds, int mtu,
+                                               CpuAffinity cpuAffinity, size_t minQueues)
+    : TunnelFramePipe("Tunnel"), _tunnelFds(tunnelFds.size()), _mtu(mtu),
+      _cpuAffinity(std::move(cpuAffinity)), _minQueues(minQueues),
+      _numAttachedQueues(tunnelFds.size()), _stats(desc, tunnelFds.size()),
+      _pool(tunnelFds.size() + (minQueues ? 1 : 0)) {
+    RASSERT(!tunnelFds.empty());
+    RASSERT(tunnelFds.size() <= kMaxTunnelQueues);
+    if (minQueues > tunnelFds.size())
+        throw Exception(boost::format("Cannot keep %1% tunnel queues attached out of %2%") %
+                        minQueues % tunnelFds.size());
+
+    _stats.queuesAttached.set(_numAttachedQueues);
+
+    for (size_t i = 0; i < tunnelFds.size(); i++) {
         _tunnelFds[i].emplace(std::move(tunnelFds[i]));
     }
 
-    for (int i = 0; i < _tunnelFds.size(); i++) {
+    for (size_t i = 0; i < _tunnelFds.size(); i++) {
         BOOST_LOG_TRIVIAL(info) << "Starting thread for tunnel file descriptor "
                                 << _tunnelFds[i]->fd;
 
@@ -77,9 +153,14 @@ TunnelProducerConsumer::TunnelProducerConsumer(std::vector<FileDescriptor> tunne
             auto &fd = _tunnelFds[i];
             BOOST_LOG_NAMED_SCOPE("_receiveFromTunnelLoop");
 
-            fd->fd.makeNonBlocking();
-
             try {
+                fd->fd.makeNonBlocking();
+
+                const int cpu = _cpuAffinity.pinCurrentThread(i);
+                BOOST_LOG_TRIVIAL(info) << "Thread for tunnel queue " << i << " ("
+                                        << fd->fd.toString() << ") running "
+                                        << (cpu < 0 ? "unpinned" : "on CPU " + std::to_string(cpu));
+
                 _receiveFromTunnelLoop(i);
 
                 RASSERT_MSG(false, boost::format("Thread for tunnel device %s exited normally. "
@@ -92,11 +173,57 @@ TunnelProducerConsumer::TunnelProducerConsumer(std::vector<FileDescriptor> tunne
         });
     }
 
+    if (_minQueues) {
+        BOOST_LOG_TRIVIAL(info) << "Starting thread for scaling the tunnel queues between "
+                                << _minQueues << " and " << _tunnelFds.size();
+
+        boost::asio::post(_pool, [this] {
+            BOOST_LOG_NAMED_SCOPE("_scaleQueuesLoop");
+
+            try {
+                _scaleQueuesLoop();
+            } catch (const std::exception &ex) {
+                BOOST_LOG_TRIVIAL(info) << "Thread for scaling the tunnel queues completed due to "
+                                        << ex.what();
+            }
+        });
+    }
+
     BOOST_LOG_TRIVIAL(info) << "Tunnel producer/consumer started";
 }
 
+TunnelProducerConsumer::Stats::Stats(const std::string &desc, size_t nTunnelFds)
+    : framesOut(MetricsRegistry::get().counter("tunnel." + desc + ".frames_out")),
+      framesIn(MetricsRegistry::get().counter("tunnel." + desc + ".frames_in")),
+      framesNotReady(MetricsRegistry::get().counter("tunnel." + desc + ".frames_not_ready")),
+      framesDropped(MetricsRegistry::get().counter("tunnel." + desc + ".frames_dropped")),
+      frameFillMicros(MetricsRegistry::get().histogram("tunnel." + desc + ".frame_fill_us")),
+      queuesAttached(MetricsRegistry::get().gauge("tunnel." + desc + ".queues_attached")) {
+    queues.reserve(nTunnelFds);
+    for (size_t i = 0; i < nTunnelFds; i++)
+        queues.emplace_back(desc, i);
+}
+
+TunnelProducerConsumer::Stats::QueueStats::QueueStats(const std::string &desc, size_t idxTunnelFds)
+    : datagramsIn(MetricsRegistry::get().counter(
+          boost::str(boost::format("tunnel.%s.queue%d.datagrams_in") % desc % idxTunnelFds))),
+      bytesIn(MetricsRegistry::get().counter(
+          boost::str(boost::format("tunnel.%s.queue%d.bytes_in") % desc % idxTunnelFds))),
+      datagramsOut(MetricsRegistry::get().counter(
+          boost::str(boost::format("tunnel.%s.queue%d.datagrams_out") % desc % idxTunnelFds))),
+      bytesOut(MetricsRegistry::get().counter(
+          boost::str(boost::format("tunnel.%s.queue%d.bytes_out") % desc % idxTunnelFds))) {}
+
+TunnelProducerConsumer::FileDescriptorTracker::FileDescriptorTracker(FileDescriptor fd)
+    : fd(std::move(fd)), wakeEvent("Tunnel wake event", SYSCALL(::eventfd(0, EFD_NONBLOCK))) {}
+
 TunnelProducerConsumer::~TunnelProducerConsumer() {
-    _interrupted.store(true);
+    {
+        std::lock_guard lg(_mutex);
+        _interrupted.store(true);
+        _interruptedCv.notify_all();
+    }
+    _wakeReceiveThreads();
     _pool.join();
 
     BOOST_LOG_TRIVIAL(info) << "Tunnel producer/consumer finished";
@@ -107,26 +234,81 @@ void TunnelProducerConsumer::onTunnelFrameFromPrev(TunnelFrameBuffer buf) {
 }
 
 void TunnelProducerConsumer::onTunnelFrameFromNext(TunnelFrameBuffer buf) {
-    TunnelFrameReader reader(buf);
-    while (reader.next()) {
-        int idxTunnelFds = ++_tunnelFdRoundRobin % _tunnelFds.size();
-        auto &tunnelFd = _tunnelFds[idxTunnelFds];
-        int numWritten = [&] {
-            std::lock_guard lg(tunnelFd->mutex);
-            return tunnelFd->fd.write(reader.data(), reader.size());
-        }();
-
-        _stats.bytesOut[idxTunnelFds] += numWritten;
-        BOOST_LOG_TRIVIAL(trace) << "Wrote " << numWritten << " byte datagram to tunnel socket "
-                                 << tunnelFd->fd << ": "
-                                 << debugLogDatagram(reader.data(), reader.size());
+    onTunnelFramesFromNext({&buf, 1});
+}
+
+void TunnelProducerConsumer::onTunnelFramesFromNext(TunnelFrameBuffers bufs) {
+    // Each datagram is written to the attached queue selected by the hash of its flow, so that all
+    // the datagrams of a flow enter the kernel through the same queue (and CPU) and are not
+    // reordered. Attaching or detaching a queue only moves the flows of that queue (see
+    // `queueForFlow`). This only selects the queue; the TUN device still takes one write() per
+    // datagram. The statistics are only updated once for the entire batch.
+    uint64_t datagramsOut[kMaxTunnelQueues] = {0};
+    uint64_t bytesOut[kMaxTunnelQueues] = {0};
+
+    // Keeps the queues, which are attached at this point, from being detached until all the writes
+    // below have completed
+    std::shared_lock sl(_attachedQueuesMutex);
+    const size_t numAttachedQueues = _numAttachedQueues.load(std::memory_order_relaxed);
+
+    for (const auto &buf : bufs) {
+        TunnelFrameReader reader(buf);
+        while (reader.next()) {
+            const size_t idxTunnelFds =
+                queueForFlow(IP::flowHash(reader.data(), reader.size()), numAttachedQueues);
+            auto &tunnelFd = _tunnelFds[idxTunnelFds]->fd;
+
+            PcapTap::get().capture(PcapTap::kLeavingTunnel, reader.data(), reader.size());
+            int numWritten = tunnelFd.write(reader.data(), reader.size());
+            RPROBE2(tun_write, idxTunnelFds, numWritten);
+            ++datagramsOut[idxTunnelFds];
+            bytesOut[idxTunnelFds] += numWritten;
+            RLOG(trace) << "Wrote " << numWritten << " byte datagram to tunnel socket " << tunnelFd
+                        << ": " << debugLogDatagram(reader.data(), reader.size());
+        }
+
+        FrameTrace::recordFrame(FrameTrace::kFrameWritten, buf.data, buf.size, 0);
+    }
+
+    _stats.framesIn.add(bufs.count);
+    for (size_t idxTunnelFds = 0; idxTunnelFds < _tunnelFds.size(); idxTunnelFds++) {
+        if (!datagramsOut[idxTunnelFds])
+            continue;
+
+        auto &queueStats = _stats.queues[idxTunnelFds];
+        queueStats.datagramsOut.add(datagramsOut[idxTunnelFds]);
+        queueStats.bytesOut.add(bytesOut[idxTunnelFds]);
     }
 }
 
+void TunnelProducerConsumer::onCapacityFromNext() { _wakeReceiveThreads(); }
+
 void TunnelProducerConsumer::_receiveFromTunnelLoop(int idxTunnelFds) {
     auto &tunnelFd = _tunnelFds[idxTunnelFds]->fd;
+    auto &wakeEvent = _tunnelFds[idxTunnelFds]->wakeEvent;
+    auto &waitedNanos = _tunnelFds[idxTunnelFds]->waitedNanos;
+    auto &waitingSinceNanos = _tunnelFds[idxTunnelFds]->waitingSinceNanos;
+    auto &queueStats = _stats.queues[idxTunnelFds];
+
+    PendingFrames pendingFrames(kMaxPendingFrames);
+
+    // Passes on the pending frames in order and returns true if all of them were accepted
+    auto sendPendingFrames = [&] {
+        while (!pendingFrames.empty()) {
+            try {
+                pipeInvokeNext(pendingFrames.front());
+            } catch (const NotYetReadyException &ex) {
+                _stats.framesNotReady.add();
+                return false;
+            }
+            _stats.framesOut.add();
+            pendingFrames.pop();
+        }
+        return true;
+    };
 
     uint8_t buffer[kTunnelFrameMaxSize];
+    // Holds the datagram, which didn't fit in the previous frame, until the next one is started
     uint8_t *mtuBuffer = (uint8_t *)alloca(_mtu);
     int mtuBufferSize = 0;
 
@@ -138,6 +320,7 @@ void TunnelProducerConsumer::_receiveFromTunnelLoop(int idxTunnelFds) {
 
         // Receive datagrams from the tunnel devices and write them to the frame until it is full
         int numDatagramsWritten = 0;
+        std::chrono::steady_clock::time_point firstDatagramReceivedAt;
         while (true) {
             // Wait for the next datagram to arrive
             int res;
@@ -151,17 +334,42 @@ void TunnelProducerConsumer::_receiveFromTunnelLoop(int idxTunnelFds) {
                     break;
                 }
 
-                BOOST_LOG_TRIVIAL(trace)
+                RLOG(trace)
                     << "Waiting for datagrams from file descriptor " << tunnelFd << " ("
                     << numDatagramsWritten << " datagrams received so far)";
 
-                res = tunnelFd.poll(numDatagramsWritten ? Milliseconds(kWaitForFullerBatch)
-                                                        : Milliseconds(kWaitForData),
-                                    POLLIN);
-                if (res > 0)
+                if (_minQueues)
+                    waitingSinceNanos.store(steadyClockNanos());
+
+                pollfd fds[2] = {{tunnelFd, POLLIN, 0}, {wakeEvent, POLLIN, 0}};
+                res = SYSCALL(::poll(fds, 2,
+                                     numDatagramsWritten ? Milliseconds(kWaitForFullerBatch).count()
+                                                         : Milliseconds(kWaitForData).count()));
+
+                if (_minQueues) {
+                    waitedNanos.fetch_add(steadyClockNanos() - waitingSinceNanos.load());
+                    waitingSinceNanos.store(0);
+                }
+
+                // Woken up by `_wakeReceiveThreads`, either because the downstream pipe may be
+                // able to accept the pending frames or because the thread is being interrupted
+                if (fds[1].revents) {
+                    uint64_t numWakeups;
+                    wakeEvent.readNonBlocking(&numWakeups, sizeof(numWakeups));
+                    sendPendingFrames();
+                }
+
+                if (fds[0].revents) {
+                    res = 1;
                     break;
-                if (numDatagramsWritten) // res == 0
+                }
+                if (!res && numDatagramsWritten)
                     break;
+
+                // Retry the pending frames periodically, in case a capacity signal was missed
+                if (!res)
+                    sendPendingFrames();
+                res = 0;
             }
 
             // Nothing was received for some time, see whether we managed to batch some frames in
@@ -173,43 +381,174 @@ void TunnelProducerConsumer::_receiveFromTunnelLoop(int idxTunnelFds) {
 
             RASSERT(res == 1);
 
-            // Read the incoming datagram in the MTU buffer
-            if (!mtuBufferSize) {
-                mtuBufferSize = tunnelFd.read(mtuBuffer, _mtu);
-            }
+            // Read the incoming datagram straight into the frame. Only if it doesn't fit in the
+            // space left in the frame, its tail spills into the MTU buffer, where it is completed
+            // and carried over to the next frame.
+            int datagramSize;
+            if (mtuBufferSize) {
+                if (size_t(mtuBufferSize) > writer.remainingBytes()) {
+                    RASSERT(numDatagramsWritten);
+                    break;
+                }
 
-            if (mtuBufferSize > writer.remainingBytes()) {
-                RASSERT(numDatagramsWritten);
-                break;
+                memcpy(writer.data(), mtuBuffer, mtuBufferSize);
+                datagramSize = mtuBufferSize;
+                mtuBufferSize = 0;
+            } else {
+                const int remainingBytes = writer.remainingBytes();
+                if (remainingBytes >= _mtu) {
+                    datagramSize = tunnelFd.read(writer.data(), _mtu);
+                } else {
+                    const iovec iov[2] = {
+                        {writer.data(), size_t(remainingBytes)},
+                        {mtuBuffer + remainingBytes, size_t(_mtu - remainingBytes)}};
+                    datagramSize = tunnelFd.readv(iov, 2);
+                }
+                RPROBE2(datagram_read, idxTunnelFds, datagramSize);
+
+                if (datagramSize > remainingBytes) {
+                    memcpy(mtuBuffer, writer.data(), remainingBytes);
+                    mtuBufferSize = datagramSize;
+                    PcapTap::get().capture(PcapTap::kEnteringTunnel, mtuBuffer, mtuBufferSize);
+
+                    RASSERT(numDatagramsWritten);
+                    break;
+                }
+
+                PcapTap::get().capture(PcapTap::kEnteringTunnel, writer.data(), datagramSize);
             }
 
-            memcpy(writer.data(), mtuBuffer, mtuBufferSize);
-            _stats.bytesIn[idxTunnelFds] += mtuBufferSize;
-            BOOST_LOG_TRIVIAL(trace)
-                << "Received " << mtuBufferSize << " byte datagram from tunnel socket " << tunnelFd
-                << ": " << debugLogDatagram(writer.data(), mtuBufferSize);
-            writer.onDatagramWritten(mtuBufferSize);
-            mtuBufferSize = 0;
+            if (!numDatagramsWritten)
+                firstDatagramReceivedAt = std::chrono::steady_clock::now();
+
+            queueStats.datagramsIn.add();
+            queueStats.bytesIn.add(datagramSize);
+            RLOG(trace)
+                << "Received " << datagramSize << " byte datagram from tunnel socket " << tunnelFd
+                << ": " << debugLogDatagram(writer.data(), datagramSize);
+            writer.onDatagramWritten(datagramSize);
 
             ++numDatagramsWritten;
         }
 
+        writer.header().seqNum = _nextSeqNum.fetch_add(1, std::memory_order_relaxed);
         writer.close();
-
-        while (true) {
-            if (_interrupted.load()) {
-                throw Exception("Interrupted");
-            }
-
+        RPROBE3(frame_closed, idxTunnelFds, writer.buffer().size, numDatagramsWritten);
+        FrameTrace::recordFrame(FrameTrace::kFrameClosed, writer.buffer().data,
+                                writer.buffer().size, idxTunnelFds);
+        const auto frameFillTime = std::chrono::steady_clock::now() - firstDatagramReceivedAt;
+        _stats.frameFillMicros.record(
+            std::chrono::duration_cast<std::chrono::microseconds>(frameFillTime).count());
+
+        // Instead of holding on to the frame (and not draining the tunnel device) until the
+        // downstream pipe is ready, queue it behind the already pending ones, which will be sent
+        // when the pipe signals capacity
+        if (sendPendingFrames()) {
             try {
                 pipeInvokeNext(writer.buffer());
-                break;
+                _stats.framesOut.add();
+                continue;
             } catch (const NotYetReadyException &ex) {
-                BOOST_LOG_TRIVIAL(trace)
-                    << "Socket not yet ready: " << ex.what() << "; retrying ...";
-                ::sleep(5);
+                _stats.framesNotReady.add();
+                RLOG(trace) << "Socket not yet ready: " << ex.what() << "; queueing the frame";
             }
         }
+
+        FrameTrace::recordFrame(FrameTrace::kFrameNotReady, writer.buffer().data,
+                                writer.buffer().size, idxTunnelFds);
+        if (pendingFrames.full()) {
+            const auto oldest = pendingFrames.front();
+            _stats.framesDropped.add();
+            FrameTrace::recordFrame(FrameTrace::kFrameDropped, oldest.data, oldest.size,
+                                    idxTunnelFds);
+        }
+        pendingFrames.push(writer.buffer());
+    }
+}
+
+void TunnelProducerConsumer::_wakeReceiveThreads() {
+    const uint64_t kWakeup = 1;
+    for (auto &fd : _tunnelFds)
+        fd->wakeEvent.writeNonBlocking(&kWakeup, sizeof(kWakeup));
+}
+
+size_t TunnelProducerConsumer::queueForFlow(uint32_t flowHash, size_t numAttachedQueues) {
+    // Jump consistent hash (Lamping and Veach): the key jumps forward through the buckets with
+    // probabilities, which make it land in each of the first `numAttachedQueues` equally often
+    uint64_t key = flowHash;
+    int64_t bucket = -1;
+    int64_t next = 0;
+    while (next < int64_t(numAttachedQueues)) {
+        bucket = next;
+        key = key * 2862933555777941757ULL + 1;
+        next = int64_t((bucket + 1) * (double(1LL << 31) / double((key >> 33) + 1)));
+    }
+    return bucket;
+}
+
+size_t TunnelProducerConsumer::scaleQueues(double utilization, size_t numAttachedQueues,
+                                           size_t minQueues, size_t maxQueues) {
+    if (utilization > kScaleUpUtilization && numAttachedQueues < maxQueues)
+        return numAttachedQueues + 1;
+    if (utilization < kScaleDownUtilization && numAttachedQueues > minQueues)
+        return numAttachedQueues - 1;
+    return numAttachedQueues;
+}
+
+void TunnelProducerConsumer::_scaleQueuesLoop() {
+    // The time the thread of a queue has spent waiting so far, including the current wait
+    auto waitedNanos = [&](const FileDescriptorTracker &fd, uint64_t nowNanos) {
+        const uint64_t waitingSinceNanos = fd.waitingSinceNanos.load();
+        return fd.waitedNanos.load() + (waitingSinceNanos ? nowNanos - waitingSinceNanos : 0);
+    };
+
+    uint64_t lastNanos = steadyClockNanos();
+    std::vector<uint64_t> lastWaitedNanos;
+    for (auto &fd : _tunnelFds)
+        lastWaitedNanos.push_back(waitedNanos(*fd, lastNanos));
+
+    std::unique_lock ul(_mutex);
+    while (!_interruptedCv.wait_for(ul, kQueueScalingInterval,
+                                    [&] { return _interrupted.load(); })) {
+        const uint64_t nowNanos = steadyClockNanos();
+        const size_t numAttachedQueues = _numAttachedQueues.load();
+
+        // The counters are read without synchronising with the queue threads, so the utilization
+        // of a queue can be slightly off for an interval, but never outside of [0, 1]
+        double utilization = 0;
+        for (size_t i = 0; i < _tunnelFds.size(); i++) {
+            const uint64_t waited = waitedNanos(*_tunnelFds[i], nowNanos);
+            if (i < numAttachedQueues)
+                utilization += std::clamp(1.0 - double(int64_t(waited - lastWaitedNanos[i])) /
+                                                    double(nowNanos - lastNanos),
+                                          0.0, 1.0);
+            lastWaitedNanos[i] = waited;
+        }
+        utilization /= numAttachedQueues;
+        lastNanos = nowNanos;
+
+        const size_t newNumAttachedQueues =
+            scaleQueues(utilization, numAttachedQueues, _minQueues, _tunnelFds.size());
+        if (newNumAttachedQueues > numAttachedQueues) {
+            TunCtl::setQueueAttached(_tunnelFds[numAttachedQueues]->fd, true);
+            _numAttachedQueues.store(newNumAttachedQueues);
+        } else if (newNumAttachedQueues < numAttachedQueues) {
+            // Datagrams stop being written to the queue before it is detached (the writes, which
+            // already picked it, are waited for), but its thread keeps draining the ones, which
+            // the kernel has already steered to it
+            {
+                std::lock_guard lg(_attachedQueuesMutex);
+                _numAttachedQueues.store(newNumAttachedQueues);
+            }
+            TunCtl::setQueueAttached(_tunnelFds[newNumAttachedQueues]->fd, false);
+        } else {
+            continue;
+        }
+
+        _stats.queuesAttached.set(_numAttachedQueues.load());
+        BOOST_LOG_TRIVIAL(info) << "Tunnel queues at " << int(utilization * 100)
+                                << "% utilization, " << _numAttachedQueues.load()
+                                << " queue(s) attached now";
     }
 }
 
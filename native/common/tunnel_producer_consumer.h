@@ -20,11 +20,16 @@
 
 #include <atomic>
 #include <boost/asio/thread_pool.hpp>
+#include <condition_variable>
 #include <mutex>
 #include <optional>
+#include <shared_mutex>
+#include <string>
 #include <vector>
 
+#include "common/cpu_affinity.h"
 #include "common/file_descriptor.h"
+#include "common/metrics.h"
 #include "common/tunnel_frame.h"
 
 namespace ruralpi {
@@ -35,56 +40,158 @@ namespace ruralpi {
  */
 class TunnelProducerConsumer : public TunnelFramePipe {
 public:
-    TunnelProducerConsumer(std::vector<FileDescriptor> tunnelFds, int mtu);
+    // Maximum number of tunnel device queues which can be serviced
+    static constexpr size_t kMaxTunnelQueues = 64;
+
+    /**
+     * The thread servicing the `i`'th queue from `tunnelFds` is pinned to the `i`'th CPU from
+     * `cpuAffinity`, so passing the queues in the order in which they were created keeps the CPUs
+     * aligned with the queue numbers of the tunnel device.
+     *
+     * If `minQueues` is not zero, the queues from `tunnelFds` must belong to a tunnel device and
+     * only the first `minQueues` of them are kept attached at all times. The rest are attached and
+     * detached at runtime (last one first), depending on the utilization of the attached ones.
+     *
+     * The threads are not re-pinned when queues are detached, so the CPUs are only guaranteed to
+     * stay aligned with the queue numbers if queue scaling is disabled. With scaling, the alignment
+     * relies on nothing else attaching or detaching the queues: the kernel gives the number of a
+     * detached queue to its last attached one and numbers the re-attached ones from the end, which
+     * only leaves the numbering unchanged because the last attached queue is always the one which
+     * this class detaches.
+     *
+     * The metrics of the instance are named "tunnel.<desc>.*", so that the instances in the same
+     * process (such as both ends in the loopback benchmark) are counted separately.
+     */
+    TunnelProducerConsumer(std::string desc, std::vector<FileDescriptor> tunnelFds, int mtu,
+                           CpuAffinity cpuAffinity = CpuAffinity(), size_t minQueues = 0);
     ~TunnelProducerConsumer();
 
+    /**
+     * Returns which of the `numAttachedQueues` attached queues the datagrams of the flow with hash
+     * `flowHash` are written to. Since the queues are always attached and detached at the end,
+     * changing the number of attached queues by one only moves the flows of the queue, which was
+     * attached or detached, and keeps all the others in place.
+     */
+    static size_t queueForFlow(uint32_t flowHash, size_t numAttachedQueues);
+
+    /**
+     * Returns how many queues should be attached for the next scaling interval, given that
+     * `numAttachedQueues` of them are attached at the moment and were busy (as opposed to waiting
+     * for datagrams) for `utilization` (between 0 and 1) of the last one on average. Attaches one
+     * more queue above `kScaleUpUtilization` and detaches one below `kScaleDownUtilization` (the
+     * gap between them keeps the number of queues from flapping), staying within `minQueues` and
+     * `maxQueues`.
+     */
+    static constexpr double kScaleUpUtilization = 0.5;
+    static constexpr double kScaleDownUtilization = 0.1;
+    static size_t scaleQueues(double utilization, size_t numAttachedQueues, size_t minQueues,
+                              size_t maxQueues);
+
 private:
     // TunnelFramePipe methods
     void onTunnelFrameFromPrev(TunnelFrameBuffer buf) override;
     void onTunnelFrameFromNext(TunnelFrameBuffer buf) override;
+    void onTunnelFramesFromNext(TunnelFrameBuffers bufs) override;
+    void onCapacityFromNext() override;
 
     /**
      * One of these functions runs on a separate thread per tunnel file descriptor (from
      * `_tunnelFds`). They receive incoming datagrams, pack them into TunneFrame(s) and pass them
      * downwstream to the pipe attached to via 'TunnelFramePipe::pipeTo'.
+     *
+     * Frames, which the downstream pipe is not ready to accept are kept in a bounded queue (from
+     * which the oldest frame is dropped when it is full) while the thread continues to drain the
+     * tunnel device. The queue is flushed as soon as the downstream pipe signals capacity.
      */
     void _receiveFromTunnelLoop(int idxTunnelFds);
 
+    /**
+     * Wakes up all the `_receiveFromTunnelLoop` threads, which are waiting for datagrams.
+     */
+    void _wakeReceiveThreads();
+
+    /**
+     * Runs on a separate thread if queue scaling was requested. Periodically measures the fraction
+     * of time the threads of the attached queues spent processing datagrams (as opposed to waiting
+     * for them) and attaches another queue if they are busy or detaches the last one if they are
+     * mostly idle.
+     */
+    void _scaleQueuesLoop();
+
     // Set of file descriptors provided at construction time, corresponding to the queues of the
-    // tunnel device
+    // tunnel device. Writes to them are not synchronised, because the tunnel device accepts
+    // exactly one datagram per `write` call.
     struct FileDescriptorTracker {
-        FileDescriptorTracker(FileDescriptor fd) : fd(std::move(fd)) {}
+        FileDescriptorTracker(FileDescriptor fd);
 
-        std::mutex mutex;
         FileDescriptor fd;
+
+        // Event file descriptor, which the thread servicing `fd` polls together with it, so that
+        // it can be woken up by `_wakeReceiveThreads`
+        ScopedFileDescriptor wakeEvent;
+
+        // Only maintained if queue scaling was requested. The total time the thread servicing `fd`
+        // has spent waiting for datagrams and when it started the current wait (0 if it is not
+        // waiting at the moment), in nanoseconds since the epoch of the steady clock.
+        alignas(kCacheLineSize) std::atomic_uint64_t waitedNanos{0};
+        std::atomic_uint64_t waitingSinceNanos{0};
     };
     std::vector<std::optional<FileDescriptorTracker>> _tunnelFds;
 
     // Stores the MTU of the tunnel device
     int _mtu;
 
-    // Used to select the output queue on which to send a datagram in a round-robin fashion
-    std::atomic_uint64_t _tunnelFdRoundRobin{0};
+    // CPUs on which to pin the threads servicing `_tunnelFds`
+    const CpuAffinity _cpuAffinity;
+
+    // Number of queues, which are always attached (0 means that queue scaling is disabled) and the
+    // number of queues from the front of `_tunnelFds`, which are currently attached. The received
+    // datagrams are only written to the attached queues.
+    const size_t _minQueues;
+    std::atomic_size_t _numAttachedQueues;
+
+    // Held shared while writing datagrams to the attached queues and exclusively while lowering
+    // `_numAttachedQueues`, so that no writes to a queue are still in flight when it gets detached
+    std::shared_mutex _attachedQueuesMutex;
+
+    // Sequence number of the next frame, which the threads draining `_tunnelFds` close. It is
+    // assigned as soon as the frame is closed, so that all the trace events of a frame carry it.
+    std::atomic_uint64_t _nextSeqNum{TunnelFrameHeader::kInitFrameSeqNum + 1};
 
-    // Self-synchronising set of statistics for the tunnel interface
+    // Statistics for the tunnel interface, which are exposed through the metrics registry
     struct Stats {
-        Stats(int nTunnelFds) : bytesIn(nTunnelFds), bytesOut(nTunnelFds) {}
+        Stats(const std::string &desc, size_t nTunnelFds);
 
         // Global statistics
+        Counter &framesOut;
+        Counter &framesIn;
+        Counter &framesNotReady;
+        Counter &framesDropped;
+        Histogram &frameFillMicros;
+        Gauge &queuesAttached;
 
         // Per-tunnel queue statistics
-        std::vector<std::atomic_uint64_t> bytesIn;
-        std::vector<std::atomic_uint64_t> bytesOut;
+        struct QueueStats {
+            QueueStats(const std::string &desc, size_t idxTunnelFds);
+
+            Counter &datagramsIn;
+            Counter &bytesIn;
+            Counter &datagramsOut;
+            Counter &bytesOut;
+        };
+        std::vector<QueueStats> queues;
     } _stats;
 
-    // Set of threads draining the file descriptors from `_tunnelFds`
+    // Set of threads draining the file descriptors from `_tunnelFds` (one thread per queue), plus
+    // the one running `_scaleQueuesLoop` if queue scaling was requested
     boost::asio::thread_pool _pool;
 
     // Mutex to protect access to the state below
     std::mutex _mutex;
 
-    // Associated with the `_receiveFromTunnelLoop` method
+    // Associated with the `_receiveFromTunnelLoop` and `_scaleQueuesLoop` methods
     std::atomic_bool _interrupted{false};
+    std::condition_variable _interruptedCv;
 };
 
 } // namespace ruralpi
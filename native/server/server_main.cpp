@@ -69,8 +69,10 @@ public:
                 auto addr_v4 = asio::ip::address_v4(ntohl(addr.sin_addr.s_addr));
                 BOOST_LOG_TRIVIAL(info) << "Accepted connection from " << addr_v4;
 
-                _socketPC.addSocket(SocketProducerConsumer::SocketConfig{ScopedFileDescriptor(
-                    boost::str(boost::format("Client %s") % addr_v4.to_string()), clientSocket)});
+                _socketPC.addSocket(SocketProducerConsumer::SocketConfig{
+                    ScopedFileDescriptor(
+                        boost::str(boost::format("Client %s") % addr_v4.to_string()), clientSocket),
+                    size_t(_ctx.zerocopy_min_bytes)});
             } catch (const Exception &ex) {
                 BOOST_LOG_TRIVIAL(error) << ex.what();
             }
@@ -89,11 +91,15 @@ void serverMain(Context &ctx) {
     BOOST_LOG_TRIVIAL(info) << "Rural Pipe server starting on port " << ctx.port
                             << " tunnel interface " << ctx.tunnel_interface << " listening on "
                             << ctx.nqueues << " queues";
+    BOOST_LOG_TRIVIAL(info) << "Tunnel queue threads placement: " << ctx.tunnel_cpus.toString()
+                            << "; socket threads placement: " << ctx.stream_cpus.toString();
 
     // Create the server-side Tunnel device
     TunCtl tunnel(ctx.tunnel_interface, ctx.nqueues);
-    TunnelProducerConsumer tunnelPC(tunnel.getQueues(), tunnel.getMTU());
-    SocketProducerConsumer socketPC(boost::none /* clientSessionId */, tunnelPC);
+    TunnelProducerConsumer tunnelPC("server", tunnel.getQueues(), tunnel.getMTU(),
+                                    ctx.tunnel_cpus, ctx.nqueues_min);
+    SocketProducerConsumer socketPC("server", boost::none /* clientSessionId */, tunnelPC,
+                                    ctx.stream_cpus, ctx.transform_threads);
     Server server(ctx, socketPC);
 
     BOOST_LOG_TRIVIAL(info) << "Rural Pipe server running";
@@ -18,13 +18,27 @@
 
 #include "common/base.h"
 
+#include <boost/algorithm/string.hpp>
 #include <boost/filesystem.hpp>
 #include <boost/log/attributes/named_scope.hpp>
 #include <boost/log/trivial.hpp>
 #include <boost/uuid/random_generator.hpp>
+#include <condition_variable>
+#include <fstream>
 #include <mutex>
+#include <netinet/in.h>
+#include <sstream>
+#include <thread>
 
+#include "common/commands_server.h"
+#include "common/cpu_affinity.h"
 #include "common/exception.h"
+#include "common/frame_trace.h"
+#include "common/ip_parsers.h"
+#include "common/logging.h"
+#include "common/metrics.h"
+#include "common/ordered_transform_pool.h"
+#include "common/pcap_tap.h"
 #include "common/socket_producer_consumer.h"
 #include "common/tunnel_producer_consumer.h"
 #include "test/test.h"
@@ -53,6 +67,29 @@ struct TestFifo {
           }()) {}
 };
 
+// Connected pair of TCP sockets over the loopback interface (unlike the FIFO above, these support
+// `sendmsg` and the socket options used by the stream)
+struct TestSocketPair {
+    ScopedFileDescriptor client;
+    ScopedFileDescriptor server;
+
+    TestSocketPair()
+        : client("Test client socket", SYSCALL(::socket(AF_INET, SOCK_STREAM, 0))),
+          server("Test server socket", [this] {
+              ScopedFileDescriptor listener("Test listener socket",
+                                            SYSCALL(::socket(AF_INET, SOCK_STREAM, 0)));
+              sockaddr_in addr{};
+              addr.sin_family = AF_INET;
+              addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+              socklen_t addrLen = sizeof(addr);
+              SYSCALL(::bind(listener, (sockaddr *)&addr, addrLen));
+              SYSCALL(::listen(listener, 1));
+              SYSCALL(::getsockname(listener, (sockaddr *)&addr, &addrLen));
+              SYSCALL(::connect(client, (sockaddr *)&addr, addrLen));
+              return SYSCALL(::accept(listener, nullptr, nullptr));
+          }()) {}
+};
+
 struct TunnelFrameTestsFixture {
     TunnelFrameTestsFixture() { memset(buffer, 0xAA, sizeof(buffer)); }
     ~TunnelFrameTestsFixture() { CHECK(buffer[kTunnelFrameMaxSize] == 0xAA); }
@@ -207,13 +244,709 @@ BOOST_AUTO_TEST_CASE(Tests) {
         }
         CHECK(!reader.next());
     }
+
+    // Batched send/receive
+    {
+        uint8_t buffers[3][kTunnelFrameMaxSize];
+        TunnelFrameBuffer frames[3];
+        for (int i = 0; i < 3; i++) {
+            TunnelFrameWriter writer({buffers[i], sizeof(buffers[i])});
+            writer.append(std::string(100 * (i + 1), 'A' + i));
+            writer.header().seqNum = i;
+            writer.close();
+            frames[i] = writer.buffer();
+        }
+        stream.send(frames, 3, false /* more */);
+
+        for (size_t i = 0; i < 3; i++) {
+            TunnelFrameReader reader(stream.receive());
+            CHECK(reader.header().seqNum == i);
+            CHECK(reader.next());
+            CHECK(reader.size() == 100 * (i + 1));
+            CHECK(reader.data()[0] == 'A' + i);
+            CHECK(!reader.next());
+        }
+    }
+
+    // Batched receive of frames, which wrap around the end of the receive ring
+    {
+        uint64_t seqNumSent = 100, seqNumReceived = 100;
+        while (seqNumSent < 200) {
+            // Send a few frames of varying sizes without receiving them
+            for (int i = 0; i < 7; i++, seqNumSent++) {
+                TunnelFrameWriter writer({buffer, sizeof(buffer)});
+                writer.append(std::string(50 + (seqNumSent * 997) % 3000, 'X'));
+                writer.header().seqNum = seqNumSent;
+                writer.close();
+                stream.send(writer.buffer());
+            }
+
+            while (seqNumReceived < seqNumSent) {
+                TunnelFrameBuffer frames[5];
+                size_t numFrames = stream.receive(frames, 5);
+                CHECK(numFrames > 0);
+                for (size_t i = 0; i < numFrames; i++, seqNumReceived++) {
+                    TunnelFrameReader reader(frames[i]);
+                    CHECK(reader.header().seqNum == seqNumReceived);
+                    CHECK(reader.next());
+                    CHECK(reader.size() == 50 + (seqNumReceived * 997) % 3000);
+                    CHECK(reader.data()[reader.size() - 1] == 'X');
+                    CHECK(!reader.next());
+                }
+            }
+        }
+    }
+}
+
+BOOST_AUTO_TEST_CASE(ZeroCopy) {
+    TestSocketPair sockets;
+    TunnelFrameStream sender(std::move(sockets.client));
+    TunnelFrameStream receiver(std::move(sockets.server));
+
+    constexpr size_t kZeroCopyMinBytes = 8 * 1024;
+    if (!sender.enableZeroCopy(kZeroCopyMinBytes)) {
+        TLOG << "Zero-copy is not supported, skipping";
+        return;
+    }
+
+    uint8_t buffers[TunnelFrameStream::kMaxSendBatch][kTunnelFrameMaxSize];
+    uint64_t seqNum = 0;
+    auto sendAndCheck = [&](size_t count, size_t datagramSize) {
+        TunnelFrameBuffer frames[TunnelFrameStream::kMaxSendBatch];
+        for (size_t i = 0; i < count; i++) {
+            TunnelFrameWriter writer({buffers[i], sizeof(buffers[i])});
+            writer.append(std::string(datagramSize, 'A' + (seqNum + i) % 26));
+            writer.header().seqNum = seqNum + i;
+            writer.close();
+            frames[i] = writer.buffer();
+        }
+        size_t numZeroCopyCalls = sender.send(frames, count, false /* more */);
+
+        for (size_t i = 0; i < count; i++, seqNum++) {
+            TunnelFrameReader reader(receiver.receive());
+            CHECK(reader.header().seqNum == seqNum);
+            CHECK(reader.next());
+            CHECK(reader.size() == datagramSize);
+            CHECK(reader.data()[0] == 'A' + seqNum % 26);
+            CHECK(reader.data()[datagramSize - 1] == 'A' + seqNum % 26);
+            CHECK(!reader.next());
+        }
+
+        // The buffers may only be reused once the kernel has released them
+        size_t numCompleted = 0;
+        while (sender.zeroCopyPending()) {
+            sender.waitForZeroCopyCompletions();
+            numCompleted += sender.reapZeroCopyCompletions();
+        }
+        CHECK(numCompleted == numZeroCopyCalls);
+        return numZeroCopyCalls;
+    };
+
+    // Batches below the threshold are copied as usual
+    CHECK(sendAndCheck(1, 100) == 0);
+    CHECK(!sender.zeroCopyPending());
+
+    // Batches above the threshold go through MSG_ZEROCOPY and arrive intact
+    CHECK(sendAndCheck(TunnelFrameStream::kMaxSendBatch, 1000) > 0);
+
+    // Loopback always ends up copying, so after enough of these zero-copy gets disabled
+    for (size_t i = 0; i < TunnelFrameStream::kMaxZeroCopyCopied && sender.zeroCopyEnabled(); i++)
+        sendAndCheck(TunnelFrameStream::kMaxSendBatch, 1000);
+    CHECK(!sender.zeroCopyEnabled());
+    CHECK(sendAndCheck(TunnelFrameStream::kMaxSendBatch, 1000) == 0);
+}
+BOOST_AUTO_TEST_SUITE_END()
+
+BOOST_FIXTURE_TEST_SUITE(TunnelFrameQueueTests, TunnelFrameTestsFixture)
+BOOST_AUTO_TEST_CASE(Tests) {
+    TunnelFrameQueue queue(2);
+    CHECK(queue.empty());
+
+    queue.push(ConstTunnelFrameBuffer{(uint8_t const *)"Frame1", 7});
+    queue.push(ConstTunnelFrameBuffer{(uint8_t const *)"Frame2", 7});
+    CHECK(queue.full());
+    CHECK(queue.bytes() == 14);
+    CHECK(!strcmp((char *)queue.at(0).data, "Frame1"));
+
+    queue.pop(1);
+    queue.push(ConstTunnelFrameBuffer{(uint8_t const *)"Frame3", 7});
+    CHECK(!strcmp((char *)queue.at(0).data, "Frame2"));
+    CHECK(!strcmp((char *)queue.at(1).data, "Frame3"));
+
+    queue.clear();
+    CHECK(queue.empty());
+    CHECK(queue.bytes() == 0);
+}
+BOOST_AUTO_TEST_SUITE_END()
+
+BOOST_AUTO_TEST_SUITE(TunnelFramePipeTests)
+std::vector<std::string> staticPipeCalls;
+
+struct StaticPipeFirstStage {
+    static constexpr char kDesc[] = "staticPipeStageFirst";
+    void onTunnelFrameFromPrev(TunnelFrameBuffer &buf) {
+        staticPipeCalls.push_back("first from prev");
+        buf.size--;
+    }
+    void onTunnelFrameFromNext(TunnelFrameBuffer &buf) {
+        staticPipeCalls.push_back("first from next");
+    }
+};
+
+struct StaticPipeSecondStage {
+    static constexpr char kDesc[] = "staticPipeStageSecond";
+    void onTunnelFrameFromPrev(TunnelFrameBuffer &buf) {
+        staticPipeCalls.push_back("second from prev");
+        CHECK(buf.size == 15);
+    }
+    void onTunnelFrameFromNext(TunnelFrameBuffer &buf) {
+        staticPipeCalls.push_back("second from next");
+    }
+};
+
+struct StaticPipeBatchStage {
+    static constexpr char kDesc[] = "staticPipeBatchStage";
+    void onTunnelFrameFromPrev(TunnelFrameBuffer &buf) { RASSERT(false); }
+    void onTunnelFrameFromNext(TunnelFrameBuffer &buf) { RASSERT(false); }
+    void onTunnelFramesFromPrev(TunnelFrameBuffers bufs) { staticPipeCalls.push_back("batch"); }
+    void onTunnelFramesFromNext(TunnelFrameBuffers bufs) { RASSERT(false); }
+};
+
+BOOST_AUTO_TEST_CASE(StaticPipeStageOrderAndTiming) {
+    StaticTunnelFramePipe<StaticPipeFirstStage, StaticPipeSecondStage> pipe;
+
+    uint8_t frame[16] = {0};
+    TunnelFrameBuffer buf{frame, sizeof(frame)};
+    pipe.onTunnelFrameFromPrev(buf);
+    CHECK(buf.size == 15);
+
+    TunnelFramePipe::setTimingEnabled(true);
+    pipe.onTunnelFrameFromNext(buf);
+    TunnelFramePipe::setTimingEnabled(false);
+
+    CHECK(staticPipeCalls == std::vector<std::string>({"first from prev", "second from prev",
+                                                       "second from next", "first from next"}));
+
+    auto &registry = MetricsRegistry::get();
+    CHECK(registry.histogram("pipe.staticPipeStageFirst.from_prev_ns").snapshot().count == 0);
+    CHECK(registry.histogram("pipe.staticPipeStageFirst.from_next_ns").snapshot().count == 1);
+    CHECK(registry.histogram("pipe.staticPipeStageSecond.from_next_ns").snapshot().count == 1);
+}
+
+BOOST_AUTO_TEST_CASE(PipeBatches) {
+    struct TestPipe : public TunnelFramePipe {
+        TestPipe(std::string desc, TunnelFramePipe *prev) : TunnelFramePipe(std::move(desc)) {
+            if (prev)
+                pipePush(*prev);
+            else
+                isFirst = true;
+        }
+
+        ~TestPipe() {
+            if (!isFirst)
+                pipePop();
+        }
+
+        void onTunnelFrameFromPrev(TunnelFrameBuffer buf) override { sizes.push_back(buf.size); }
+        void onTunnelFrameFromNext(TunnelFrameBuffer buf) override { RASSERT(false); }
+
+        void onTunnelFramesFromPrev(TunnelFrameBuffers bufs) override {
+            batchSizes.push_back(bufs.count);
+            TunnelFramePipe::onTunnelFramesFromPrev(bufs);
+        }
+
+        bool isFirst{false};
+        std::vector<size_t> sizes;
+        std::vector<size_t> batchSizes;
+    };
+
+    TestPipe first("pipeBatchesFirst", nullptr);
+    TestPipe second("pipeBatchesSecond", &first);
+
+    uint8_t frame[16] = {0};
+    TunnelFrameBuffer frames[3] = {{frame, 1}, {frame, 2}, {frame, 3}};
+    first.pipeInvokeNext(TunnelFrameBuffers{frames, 3});
+    first.pipeInvokeNext(frames[0]);
+
+    // The batch is dispatched once and the default implementation passes its frames in order
+    CHECK(second.batchSizes == std::vector<size_t>({3}));
+    CHECK(second.sizes == std::vector<size_t>({1, 2, 3, 1}));
+
+    // Stages of a static pipe without batch methods get the frames of the batch one at a time
+    staticPipeCalls.clear();
+    StaticTunnelFramePipe<StaticPipeBatchStage, StaticPipeFirstStage> pipe;
+    pipe.onTunnelFramesFromPrev({frames, 3});
+    CHECK(staticPipeCalls == std::vector<std::string>({"batch", "first from prev",
+                                                       "first from prev", "first from prev"}));
+}
+
+BOOST_AUTO_TEST_CASE(PipeCapacitySignal) {
+    struct TestPipe : public TunnelFramePipe {
+        TestPipe(std::string desc, TunnelFramePipe *prev) : TunnelFramePipe(std::move(desc)) {
+            if (prev)
+                pipePush(*prev);
+            else
+                isFirst = true;
+        }
+
+        ~TestPipe() {
+            if (!isFirst)
+                pipePop();
+        }
+
+        void onTunnelFrameFromPrev(TunnelFrameBuffer buf) override {
+            if (full)
+                throw NotYetReadyException("Full");
+        }
+        void onTunnelFrameFromNext(TunnelFrameBuffer buf) override { RASSERT(false); }
+
+        void onCapacityFromNext() override { ++numCapacitySignals; }
+
+        void makeRoom() {
+            full = false;
+            pipeSignalCapacity();
+        }
+
+        bool isFirst{false};
+        std::atomic<bool> full{true};
+        std::atomic<int> numCapacitySignals{0};
+    };
+
+    TestPipe first("pipeCapacityFirst", nullptr);
+
+    // Attaching the next pipe counts as a capacity signal
+    TestPipe second("pipeCapacitySecond", &first);
+    CHECK(first.numCapacitySignals == 1);
+
+    uint8_t frame[16] = {0};
+    BOOST_CHECK_THROW(first.pipeInvokeNext(TunnelFrameBuffer{frame, sizeof(frame)}),
+                      NotYetReadyException);
+    CHECK(first.numCapacitySignals == 1);
+
+    std::thread t([&] { second.makeRoom(); });
+    t.join();
+    CHECK(first.numCapacitySignals == 2);
+
+    first.pipeInvokeNext(TunnelFrameBuffer{frame, sizeof(frame)});
+}
+BOOST_AUTO_TEST_SUITE_END()
+
+BOOST_AUTO_TEST_SUITE(CpuAffinityTests)
+BOOST_AUTO_TEST_CASE(Parse) {
+    CHECK(CpuAffinity::parse("").cpuFor(0) == -1);
+
+    auto affinity = CpuAffinity::parse("0");
+    CHECK(affinity.cpuFor(0) == 0);
+    CHECK(affinity.cpuFor(3) == 0);
+    std::thread([&] { CHECK(affinity.pinCurrentThread(1) == 0); }).join();
+
+    BOOST_CHECK_THROW(CpuAffinity::parse("1-0"), Exception);
+    BOOST_CHECK_THROW(CpuAffinity::parse("zero"), Exception);
+    BOOST_CHECK_THROW(CpuAffinity::parse("100000"), Exception);
+}
+BOOST_AUTO_TEST_SUITE_END()
+
+BOOST_AUTO_TEST_SUITE(MetricsTests)
+BOOST_AUTO_TEST_CASE(CountersAndHistograms) {
+    auto &counter = MetricsRegistry::get().counter("test.counter");
+    CHECK(&counter == &MetricsRegistry::get().counter("test.counter"));
+
+    auto &histogram = MetricsRegistry::get().histogram("test.histogram");
+
+    // More threads than histogram shards, so some of them share a shard
+    constexpr int kNumThreads = 2 * Histogram::kNumShards;
+    std::vector<std::thread> threads;
+    for (int i = 0; i < kNumThreads; i++) {
+        threads.emplace_back([&] {
+            for (uint64_t value = 0; value < 1000; value++) {
+                counter.add();
+                histogram.record(value);
+            }
+        });
+    }
+    for (auto &thread : threads)
+        thread.join();
+
+    CHECK(counter.value() == kNumThreads * 1000);
+
+    auto snapshot = histogram.snapshot();
+    TLOG << snapshot.toString();
+    CHECK(snapshot.count == kNumThreads * 1000);
+    CHECK(snapshot.sum == kNumThreads * 999 * 1000 / 2);
+    CHECK(snapshot.quantile(0.5) == 511);
+    CHECK(snapshot.quantile(1.0) == 1023);
+
+    MetricsRegistry::get().gauge("test.gauge").set(-5);
+    auto stats = MetricsRegistry::get().snapshot();
+    CHECK(stats.find("test.counter 8000\n") != std::string::npos);
+    CHECK(stats.find("test.gauge -5\n") != std::string::npos);
+    CHECK(stats.find("test.histogram count=8000") != std::string::npos);
+}
+
+BOOST_AUTO_TEST_CASE(LogLinearBuckets) {
+    size_t lastBucket = 0;
+    for (uint64_t value = 0; value < 100000; value++) {
+        const size_t bucket = Histogram::bucketFor(value);
+        CHECK(bucket == lastBucket || bucket == lastBucket + 1);
+        CHECK(Histogram::bucketUpperBound(bucket) >= value);
+        CHECK(Histogram::bucketUpperBound(bucket) - value <= value / Histogram::kSubBucketCount);
+        lastBucket = bucket;
+    }
+
+    CHECK(Histogram::bucketFor(UINT64_MAX) == Histogram::kNumBuckets - 1);
+    CHECK(Histogram::bucketUpperBound(Histogram::kNumBuckets - 1) == UINT64_MAX);
+}
+
+BOOST_AUTO_TEST_CASE(PipeStageTiming) {
+    struct TestPipe : public TunnelFramePipe {
+        TestPipe(std::string desc, TunnelFramePipe *prev, Milliseconds delay)
+            : TunnelFramePipe(std::move(desc)), delay(delay) {
+            if (prev)
+                pipePush(*prev);
+            else
+                isFirst = true;
+        }
+
+        ~TestPipe() {
+            if (!isFirst)
+                pipePop();
+        }
+
+        void onTunnelFrameFromPrev(TunnelFrameBuffer buf) override {
+            std::this_thread::sleep_for(delay);
+            try {
+                pipeInvokeNext(buf);
+            } catch (const NotYetReadyException &) {
+                // Last stage of the pipe
+            }
+        }
+
+        void onTunnelFrameFromNext(TunnelFrameBuffer buf) override { RASSERT(false); }
+
+        Milliseconds delay;
+        bool isFirst{false};
+    };
+
+    TestPipe first("pipeStageTimingFirst", nullptr, Milliseconds(0));
+    TestPipe second("pipeStageTimingSecond", &first, Milliseconds(2));
+    TestPipe third("pipeStageTimingThird", &second, Milliseconds(10));
+
+    auto &thirdHistogram =
+        MetricsRegistry::get().histogram("pipe.pipeStageTimingThird.from_prev_ns");
+
+    uint8_t frame[16] = {0};
+    first.pipeInvokeNext({frame, sizeof(frame)});
+    CHECK(thirdHistogram.snapshot().count == 0);
+
+    TunnelFramePipe::setTimingEnabled(true);
+    first.pipeInvokeNext({frame, sizeof(frame)});
+    TunnelFramePipe::setTimingEnabled(false);
+
+    auto secondNanos =
+        MetricsRegistry::get().histogram("pipe.pipeStageTimingSecond.from_prev_ns").snapshot();
+    auto thirdNanos = thirdHistogram.snapshot();
+    TLOG << "Second: " << secondNanos.toString() << "; third: " << thirdNanos.toString();
+    CHECK(secondNanos.count == 1);
+    CHECK(thirdNanos.count == 1);
+    CHECK(secondNanos.sum >= 2000000 && secondNanos.sum < 10000000);
+    CHECK(thirdNanos.sum >= 10000000);
+}
+BOOST_AUTO_TEST_SUITE_END()
+
+BOOST_AUTO_TEST_SUITE(AsyncLogTests)
+BOOST_AUTO_TEST_CASE(RecordsWrittenBeforeStop) {
+    std::ostringstream os;
+    AsyncLog::addConsoleSink(os);
+
+    std::thread([] {
+        for (int i = 0; i < 100; i++)
+            RLOG(info) << "Async log record " << i;
+    }).join();
+
+    AsyncLog::stop();
+
+    const auto log = os.str();
+    CHECK(log.find("Async log record 0\n") != std::string::npos);
+    CHECK(log.find("Async log record 99\n") != std::string::npos);
+}
+
+BOOST_AUTO_TEST_CASE(ElseAfterRecordBindsToCaller) {
+    bool reachedElse = false;
+    const bool skipRecord = true;
+    if (!skipRecord)
+        RLOG(info) << "Never logged";
+    else
+        reachedElse = true;
+    CHECK(reachedElse);
+}
+BOOST_AUTO_TEST_SUITE_END()
+
+BOOST_AUTO_TEST_SUITE(OrderedTransformPoolTests)
+BOOST_AUTO_TEST_CASE(DeliversInSubmissionOrder) {
+    boost::asio::thread_pool workers(4);
+    std::vector<uint32_t> delivered;
+
+    std::mutex capacityMutex;
+    std::condition_variable capacityCV;
+    bool capacitySignalled = false;
+
+    {
+        OrderedTransformPool pool(
+            "orderedTransformPoolTest", workers, 8,
+            [](TunnelFrameBuffer &buf) {
+                uint32_t value;
+                memcpy(&value, buf.data, sizeof(value));
+
+                // Make the later frames of each group of 4 complete before the earlier ones
+                std::this_thread::sleep_for(std::chrono::microseconds((3 - value % 4) * 200));
+                if (value == 13)
+                    throw Exception("Test transform failure");
+
+                value *= 2;
+                memcpy(buf.data, &value, sizeof(value));
+                buf.size = sizeof(value);
+            },
+            [&](TunnelFrameBuffers bufs) {
+                size_t numDelivered = 0;
+                for (const auto &buf : bufs) {
+                    CHECK(buf.size == sizeof(uint32_t));
+                    uint32_t value;
+                    memcpy(&value, buf.data, sizeof(value));
+                    // Only the refused frame must be counted as dropped, not its entire batch
+                    if (value == 2 * 57)
+                        continue;
+                    delivered.push_back(value);
+                    ++numDelivered;
+                }
+                return numDelivered;
+            },
+            [&] {
+                std::lock_guard lg(capacityMutex);
+                capacitySignalled = true;
+                capacityCV.notify_all();
+            });
+
+        // The ring is much smaller than the number of frames, so some of them are refused and
+        // resubmitted on the capacity signal
+        size_t numRefused = 0;
+        for (uint32_t i = 0; i < 100; i++) {
+            uint8_t frame[16] = {0};
+            memcpy(frame, &i, sizeof(i));
+            while (true) {
+                try {
+                    pool.submit(ConstTunnelFrameBuffer{frame, sizeof(frame)});
+                    break;
+                } catch (const NotYetReadyException &) {
+                    ++numRefused;
+                    std::unique_lock ul(capacityMutex);
+                    capacityCV.wait(ul, [&] { return capacitySignalled; });
+                    capacitySignalled = false;
+                }
+            }
+        }
+        CHECK(numRefused > 0);
+    }
+
+    std::vector<uint32_t> expected;
+    for (uint32_t i = 0; i < 100; i++) {
+        if (i != 13 && i != 57)
+            expected.push_back(i * 2);
+    }
+    CHECK(delivered == expected);
+    CHECK(MetricsRegistry::get()
+              .counter("transform.orderedTransformPoolTest.frames_dropped")
+              .value() == 2);
+}
+BOOST_AUTO_TEST_SUITE_END()
+
+BOOST_AUTO_TEST_SUITE(FrameTraceTests)
+BOOST_AUTO_TEST_CASE(RecordAndDump) {
+    const auto tracePath = fs::temp_directory_path() / "rural_pipe_test_frame_trace.bin";
+
+    auto readDump = [&] {
+        std::vector<FrameTrace::Event> events;
+        FILE *f = fopen(tracePath.c_str(), "rb");
+        CHECK(f);
+        FrameTrace::FileHeader header;
+        CHECK(fread(&header, sizeof(header), 1, f) == 1);
+        CHECK(!memcmp(header.magic, FrameTrace::FileHeader::kMagic, sizeof(header.magic)));
+        CHECK(header.eventSize == sizeof(FrameTrace::Event));
+        events.resize(header.numEvents);
+        CHECK(fread(events.data(), sizeof(FrameTrace::Event), events.size(), f) == events.size());
+        fclose(f);
+        return events;
+    };
+
+    FrameTrace::record(FrameTrace::kFrameReceived, 5, 200, 8888);
+
+    // The events of a thread, which has exited must still be in the dump
+    std::thread([] {
+        for (uint64_t seqNum = 1; seqNum <= FrameTrace::kRingSize + 10; seqNum++)
+            FrameTrace::record(FrameTrace::kFrameSent, seqNum, 100, 7777);
+    }).join();
+
+    CHECK(FrameTrace::dump(tracePath.string()) >= FrameTrace::kRingSize + 1);
+
+    auto events = readDump();
+    size_t numSent = 0, numReceived = 0;
+    for (const auto &event : events) {
+        if (event.stream == 7777) {
+            CHECK(event.stage == FrameTrace::kFrameSent);
+            CHECK(event.seqNum > 10);
+            ++numSent;
+        } else if (event.stream == 8888) {
+            CHECK(event.stage == FrameTrace::kFrameReceived);
+            CHECK(event.seqNum == 5 && event.size == 200);
+            ++numReceived;
+        }
+    }
+    CHECK(numSent == FrameTrace::kRingSize);
+    CHECK(numReceived == 1);
+}
+BOOST_AUTO_TEST_SUITE_END()
+
+BOOST_AUTO_TEST_SUITE(PcapTapTests)
+BOOST_AUTO_TEST_CASE(CaptureSampledAndTruncated) {
+    const auto pathPrefix = (fs::temp_directory_path() / "rural_pipe_test_capture").string();
+    const auto path = pathPrefix + "_0.pcapng";
+    ::remove(path.c_str());
+
+    auto &tap = PcapTap::get();
+    uint8_t datagram[100];
+    memset(datagram, 0x45, sizeof(datagram));
+
+    // Nothing is captured before the tap is started
+    tap.capture(PcapTap::kEnteringTunnel, datagram, sizeof(datagram));
+
+    PcapTap::Config config;
+    config.pathPrefix = pathPrefix;
+    config.snapLen = 8;
+    config.sampleEvery = 2;
+    tap.start(config);
+    BOOST_CHECK_THROW(tap.start(config), Exception);
+
+    std::thread([&] {
+        for (int i = 0; i < 10; i++)
+            tap.capture(i < 5 ? PcapTap::kEnteringTunnel : PcapTap::kLeavingTunnel, datagram,
+                        sizeof(datagram));
+    }).join();
+
+    tap.stop();
+    TLOG << tap.toString();
+
+    std::ifstream in(path, std::ios::binary);
+    std::vector<uint8_t> contents((std::istreambuf_iterator<char>(in)),
+                                  std::istreambuf_iterator<char>());
+    auto u32At = [&](size_t offset) { return *((uint32_t *)&contents[offset]); };
+
+    CHECK(contents.size() > 48);
+    CHECK(u32At(0) == 0x0A0D0D0A);
+    CHECK(u32At(8) == 0x1A2B3C4D);
+
+    // Walk the blocks following the section header and interface description blocks
+    size_t numPackets = 0;
+    for (size_t offset = 48; offset < contents.size(); offset += u32At(offset + 4)) {
+        CHECK(u32At(offset) == 6);
+        CHECK(u32At(offset + 20) == 8);
+        CHECK(u32At(offset + 24) == sizeof(datagram));
+        CHECK(u32At(offset + 4) == u32At(offset + u32At(offset + 4) - 4));
+        ++numPackets;
+    }
+    CHECK(numPackets == 5);
+}
+
+BOOST_AUTO_TEST_CASE(WriteFailureStopsCapture, *boost::unit_test::timeout(30)) {
+    auto &tap = PcapTap::get();
+    uint8_t datagram[100];
+    memset(datagram, 0x45, sizeof(datagram));
+
+    PcapTap::Config config;
+    config.pathPrefix =
+        (fs::temp_directory_path() / "rural_pipe_test_missing_dir" / "capture").string();
+    tap.start(config);
+
+    // The writer only opens the file once it has a datagram to write
+    while (tap.started()) {
+        tap.capture(PcapTap::kEnteringTunnel, datagram, sizeof(datagram));
+        std::this_thread::sleep_for(Milliseconds(10));
+    }
+    TLOG << tap.toString();
+    CHECK(tap.toString().find("failure") != std::string::npos);
+
+    // The failed capture can be restarted without stopping it first
+    config.pathPrefix = (fs::temp_directory_path() / "rural_pipe_test_capture").string();
+    tap.start(config);
+    CHECK(tap.started());
+    tap.stop();
+    CHECK(tap.toString().find("failure") == std::string::npos);
+}
+BOOST_AUTO_TEST_SUITE_END()
+
+BOOST_AUTO_TEST_SUITE(CommandsServerTests)
+BOOST_AUTO_TEST_CASE(Tests) {
+    boost::asio::io_service ioService;
+    CommandsServer cmdServer(ioService, "rural_pipe_test_commands", [](auto args) {
+        if (args[0] == "echo")
+            return boost::join(args, " ");
+        throw Exception("Unknown command");
+    });
+    std::thread ioThread([&] { ioService.run(); });
+
+    boost::asio::local::stream_protocol::socket socket(ioService);
+    socket.connect((fs::temp_directory_path() / "rural_pipe_test_commands").string());
+
+    auto execute = [&](std::string command) {
+        boost::asio::write(socket, boost::asio::buffer(command + "\n"));
+
+        boost::asio::streambuf buffer;
+        size_t numBytes = boost::asio::read_until(socket, buffer, "\n\n");
+        std::string response(numBytes, 0);
+        buffer.sgetn(response.data(), numBytes);
+        return response;
+    };
+
+    CHECK(execute("echo  1 2") == "echo 1 2\n\n");
+    CHECK(execute("unknown") == "ERROR: Unknown command\n\n");
+
+    socket.close();
+    ioService.stop();
+    ioThread.join();
+}
+BOOST_AUTO_TEST_SUITE_END()
+
+BOOST_AUTO_TEST_SUITE(IPParsersTests)
+BOOST_AUTO_TEST_CASE(FlowHash) {
+    auto makeUDPDatagram = [](uint8_t *buf, uint32_t daddr, uint16_t sport) {
+        memset(buf, 0, sizeof(iphdr) + sizeof(udphdr));
+        auto &ip = *((iphdr *)buf);
+        ip.version = 4;
+        ip.ihl = 5;
+        ip.protocol = IPPROTO_UDP;
+        ip.saddr = htonl(0x0A000101);
+        ip.daddr = htonl(daddr);
+        auto &udp = *((udphdr *)(buf + sizeof(iphdr)));
+        udp.source = htons(sport);
+        udp.dest = htons(53);
+        return sizeof(iphdr) + sizeof(udphdr);
+    };
+
+    uint8_t dg1[64], dg2[64], dg3[64];
+    size_t size = makeUDPDatagram(dg1, 0x08080808, 10000);
+    makeUDPDatagram(dg2, 0x08080808, 10000);
+    makeUDPDatagram(dg3, 0x08080808, 10001);
+
+    CHECK(IP::flowHash(dg1, size) == IP::flowHash(dg2, size));
+    CHECK(IP::flowHash(dg1, size) != IP::flowHash(dg3, size));
+    CHECK(IP::flowHash(dg1, 10) == 0);
+    CHECK(IP::flowHash((uint8_t const *)"Not an IP datagram", 19) == 0);
 }
 BOOST_AUTO_TEST_SUITE_END()
 
 BOOST_FIXTURE_TEST_SUITE(TunnelProducerConsumerTests, TunnelFrameTestsFixture)
 BOOST_AUTO_TEST_CASE(Tests) {
     TestFifo pipes[2];
-    TunnelProducerConsumer tunnelPC(std::vector<FileDescriptor>{pipes[0].fd, pipes[1].fd}, 1500);
+    TunnelProducerConsumer tunnelPC("tunnelTest",
+                                    std::vector<FileDescriptor>{pipes[0].fd, pipes[1].fd}, 1500);
 
     struct TestPipe : public TunnelFramePipe {
         TestPipe(TunnelFramePipe &prev) : TunnelFramePipe("tunnelProducerConsumerTests") {
@@ -255,12 +988,147 @@ BOOST_AUTO_TEST_CASE(Tests) {
 
     TunnelFrameReader reader(
         ConstTunnelFrameBuffer{testPipe.lastFrameReceived, testPipe.lastFrameReceivedSize});
+
+    // The frames are numbered when the tunnel closes them, starting after the initial frame (the
+    // two queues close theirs concurrently, so either of them can be the last one received)
+    CHECK((reader.header().seqNum == 1 || reader.header().seqNum == 2));
     CHECK(reader.next());
     TLOG << (char *)reader.data();
     CHECK(!reader.next());
 
     testPipe.pipeInvokePrev({testPipe.lastFrameReceived, testPipe.lastFrameReceivedSize});
 }
+
+BOOST_AUTO_TEST_CASE(ScaleQueues) {
+    using TPC = TunnelProducerConsumer;
+    const double kBusy = (TPC::kScaleUpUtilization + 1) / 2;
+    const double kModerate = (TPC::kScaleDownUtilization + TPC::kScaleUpUtilization) / 2;
+    const double kIdle = TPC::kScaleDownUtilization / 2;
+
+    // Busy queues get one more queue attached, up to the maximum
+    CHECK(TPC::scaleQueues(kBusy, 1, 1, 4) == 2);
+    CHECK(TPC::scaleQueues(kBusy, 3, 1, 4) == 4);
+    CHECK(TPC::scaleQueues(kBusy, 4, 1, 4) == 4);
+    CHECK(TPC::scaleQueues(1.0, 4, 1, 4) == 4);
+
+    // Idle queues get one queue detached, down to the minimum
+    CHECK(TPC::scaleQueues(kIdle, 4, 1, 4) == 3);
+    CHECK(TPC::scaleQueues(kIdle, 2, 1, 4) == 1);
+    CHECK(TPC::scaleQueues(kIdle, 1, 1, 4) == 1);
+    CHECK(TPC::scaleQueues(0.0, 3, 3, 4) == 3);
+
+    // Between the thresholds (and exactly at them) nothing changes
+    CHECK(TPC::scaleQueues(kModerate, 2, 1, 4) == 2);
+    CHECK(TPC::scaleQueues(TPC::kScaleUpUtilization, 2, 1, 4) == 2);
+    CHECK(TPC::scaleQueues(TPC::kScaleDownUtilization, 2, 1, 4) == 2);
+}
+
+BOOST_AUTO_TEST_CASE(QueueForFlow) {
+    using TPC = TunnelProducerConsumer;
+    constexpr uint32_t kNumFlows = 10000;
+    constexpr size_t kMaxQueues = 8;
+
+    size_t flowsPerQueue[kMaxQueues] = {0};
+    for (uint32_t flowHash = 0; flowHash < kNumFlows; flowHash++) {
+        CHECK(TPC::queueForFlow(flowHash, 1) == 0);
+
+        // Attaching one more queue only moves flows to the new queue
+        for (size_t numQueues = 1; numQueues < kMaxQueues; numQueues++) {
+            const size_t before = TPC::queueForFlow(flowHash, numQueues);
+            const size_t after = TPC::queueForFlow(flowHash, numQueues + 1);
+            CHECK(before < numQueues);
+            CHECK((after == before || after == numQueues));
+        }
+
+        ++flowsPerQueue[TPC::queueForFlow(flowHash, kMaxQueues)];
+    }
+
+    // The flows are spread evenly over the queues
+    for (size_t numFlows : flowsPerQueue) {
+        CHECK(numFlows > kNumFlows / kMaxQueues * 8 / 10);
+        CHECK(numFlows < kNumFlows / kMaxQueues * 12 / 10);
+    }
+}
+
+BOOST_AUTO_TEST_CASE(DatagramSpillsIntoNextFrame) {
+    constexpr int kMTU = 1500;
+    constexpr size_t kDatagramSize = 1400;
+    constexpr int kNumDatagrams = 3;
+
+    // Only two datagrams fit in a frame, after which there is less than an MTU of space left, so
+    // the third one is read partly into the frame and partly into the MTU buffer
+    {
+        uint8_t frame[kTunnelFrameMaxSize];
+        TunnelFrameWriter writer({frame, sizeof(frame)});
+        writer.append(std::string(kDatagramSize, 'X'));
+        writer.append(std::string(kDatagramSize, 'X'));
+        CHECK(writer.remainingBytes() > 0);
+        CHECK(writer.remainingBytes() < kDatagramSize);
+    }
+
+    // Unlike the FIFO, a datagram socket keeps the boundaries of the datagrams like the tunnel
+    // device does
+    int fds[2];
+    SYSCALL(::socketpair(AF_UNIX, SOCK_DGRAM, 0, fds));
+    ScopedFileDescriptor inside("Test tunnel inside", fds[0]);
+    ScopedFileDescriptor outside("Test tunnel outside", fds[1]);
+
+    auto datagramByte = [](int idxDatagram, size_t i) { return uint8_t(idxDatagram * 31 + i); };
+    for (int idxDatagram = 0; idxDatagram < kNumDatagrams; idxDatagram++) {
+        uint8_t datagram[kDatagramSize];
+        for (size_t i = 0; i < kDatagramSize; i++)
+            datagram[i] = datagramByte(idxDatagram, i);
+        CHECK(outside.write(datagram, kDatagramSize) == kDatagramSize);
+    }
+
+    struct TestPipe : public TunnelFramePipe {
+        TestPipe(TunnelFramePipe &prev) : TunnelFramePipe("datagramSpillsIntoNextFrame") {
+            pipePush(prev);
+        }
+
+        ~TestPipe() { pipePop(); }
+
+        void onTunnelFrameFromPrev(TunnelFrameBuffer buf) override {
+            std::lock_guard lg(mutex);
+            framesReceived.emplace_back(buf.data, buf.data + buf.size);
+        }
+
+        void onTunnelFrameFromNext(TunnelFrameBuffer buf) override { RASSERT(false); }
+
+        size_t getNumFramesReceived() {
+            std::lock_guard lg(mutex);
+            return framesReceived.size();
+        }
+
+        std::mutex mutex;
+        std::vector<std::vector<uint8_t>> framesReceived;
+    };
+
+    TunnelProducerConsumer tunnelPC("tunnelTest", std::vector<FileDescriptor>{inside}, kMTU);
+    TestPipe testPipe(tunnelPC);
+
+    while (testPipe.getNumFramesReceived() < 2)
+        std::this_thread::sleep_for(Milliseconds(10));
+
+    std::lock_guard lg(testPipe.mutex);
+    CHECK(testPipe.framesReceived.size() == 2);
+
+    int idxDatagram = 0;
+    for (int idxFrame = 0; idxFrame < 2; idxFrame++) {
+        const auto &frame = testPipe.framesReceived[idxFrame];
+        TunnelFrameReader reader(ConstTunnelFrameBuffer{frame.data(), frame.size()});
+        while (reader.next()) {
+            TLOG << "Frame " << idxFrame << " has datagram " << idxDatagram;
+            CHECK(reader.size() == kDatagramSize);
+            for (size_t i = 0; i < kDatagramSize; i++)
+                CHECK(reader.data()[i] == datagramByte(idxDatagram, i));
+            ++idxDatagram;
+        }
+
+        // The spilled datagram is the only one in the second frame
+        CHECK(idxDatagram == (idxFrame == 0 ? 2 : 3));
+    }
+}
 BOOST_AUTO_TEST_SUITE_END()
 
 BOOST_FIXTURE_TEST_SUITE(SocketProducerConsumerTests, TunnelFrameTestsFixture)
@@ -272,11 +1140,166 @@ BOOST_AUTO_TEST_CASE(Tests) {
         void onTunnelFrameFromNext(TunnelFrameBuffer buf) override { RASSERT(false); }
     } testPipe;
 
-    SocketProducerConsumer socketPC(uuidGen() /* clientSessionId */, testPipe);
+    SocketProducerConsumer socketPC("socketTest", uuidGen() /* clientSessionId */, testPipe);
 
     TestFifo pipe;
     socketPC.addSocket(SocketProducerConsumer::SocketConfig{std::move(pipe.fd)});
 }
+
+BOOST_AUTO_TEST_CASE(CloseStreamWhilePeerNotReading, *boost::unit_test::timeout(60)) {
+    struct ClientPipe : public TunnelFramePipe {
+        ClientPipe() : TunnelFramePipe("closeStreamClient") {}
+
+        void onTunnelFrameFromPrev(TunnelFrameBuffer buf) override { RASSERT(false); }
+        void onTunnelFrameFromNext(TunnelFrameBuffer buf) override { RASSERT(false); }
+    } clientPipe;
+
+    // Blocks the server's receiving thread on the first frame, so it stops reading from the stream
+    struct ServerPipe : public TunnelFramePipe {
+        ServerPipe() : TunnelFramePipe("closeStreamServer") {}
+
+        void onTunnelFrameFromPrev(TunnelFrameBuffer buf) override { RASSERT(false); }
+        void onTunnelFrameFromNext(TunnelFrameBuffer buf) override {
+            std::unique_lock ul(mutex);
+            cv.wait(ul, [&] { return released; });
+        }
+
+        void release() {
+            std::lock_guard lg(mutex);
+            released = true;
+            cv.notify_all();
+        }
+
+        std::mutex mutex;
+        std::condition_variable cv;
+        bool released{false};
+    } serverPipe;
+
+    TestSocketPair sockets;
+    const int clientFd = sockets.client, serverFd = sockets.server;
+    constexpr int kRecvBufSize = 256 * 1024;
+    SYSCALL(::setsockopt(serverFd, SOL_SOCKET, SO_RCVBUF, &kRecvBufSize, sizeof(kRecvBufSize)));
+
+    SocketProducerConsumer serverSocketPC("closeStreamServer", boost::none, serverPipe);
+    serverSocketPC.addSocket({std::move(sockets.server)});
+    {
+        SocketProducerConsumer clientSocketPC("closeStreamClient", uuidGen(), clientPipe);
+        clientSocketPC.addSocket({std::move(sockets.client)});
+
+        // Send until the stream has refused frames for a while, at which point its writer is
+        // blocked in a send, which the server will never read
+        uint8_t buffer[kTunnelFrameMaxSize];
+        size_t numFramesSent = 0;
+        auto lastSentAt = std::chrono::steady_clock::now();
+        auto backedUp = [&] {
+            return numFramesSent &&
+                   std::chrono::steady_clock::now() - lastSentAt > Milliseconds(200);
+        };
+        while (!backedUp()) {
+            TunnelFrameWriter writer({buffer, sizeof(buffer)});
+            writer.append(std::string(writer.remainingBytes() - 16, 'X'));
+            writer.close();
+            try {
+                clientPipe.pipeInvokeNext(writer.buffer());
+                ++numFramesSent;
+                lastSentAt = std::chrono::steady_clock::now();
+            } catch (const NotYetReadyException &) {
+                std::this_thread::sleep_for(Milliseconds(1));
+            }
+        }
+        TLOG << "Sent " << numFramesSent << " frames before the stream backed up";
+
+        // The server half-closing its end makes the client's receiving thread fail and close the
+        // stream, which must not wait for the blocked writer to finish on its own
+        SYSCALL(::shutdown(serverFd, SHUT_WR));
+    }
+
+    serverPipe.release();
+    ::shutdown(serverFd, SHUT_RDWR);
+    TLOG << "Closed stream " << clientFd;
+}
+
+BOOST_AUTO_TEST_CASE(TransformThreadsBidirectional, *boost::unit_test::timeout(120)) {
+    constexpr int kNumFrames = 20000;
+    constexpr size_t kDatagramSize = 1000;
+
+    // Stands for the tunnel side of each end and sends `kNumFrames` frames while counting the ones
+    // which come back from the other end
+    struct TestPipe : public TunnelFramePipe {
+        TestPipe(std::string desc) : TunnelFramePipe(std::move(desc)) {}
+
+        void onTunnelFrameFromPrev(TunnelFrameBuffer buf) override { RASSERT(false); }
+        void onTunnelFrameFromNext(TunnelFrameBuffer buf) override {
+            TunnelFrameReader reader(buf);
+            while (reader.next())
+                CHECK(reader.size() == kDatagramSize);
+
+            // Stall every now and then, so that the received frames pile up in the transform ring
+            // and the streams back up in both directions
+            if (++numFramesReceived % 64 == 0)
+                std::this_thread::sleep_for(Milliseconds(5));
+        }
+
+        void sendFrames() {
+            uint8_t buffer[kTunnelFrameMaxSize];
+            for (int i = 0; i < kNumFrames; i++) {
+                TunnelFrameWriter writer({buffer, sizeof(buffer)});
+                while (writer.remainingBytes() >= kDatagramSize)
+                    writer.append(std::string(kDatagramSize, 'A' + i % 26));
+                writer.close();
+
+                while (true) {
+                    try {
+                        pipeInvokeNext(writer.buffer());
+                        break;
+                    } catch (const NotYetReadyException &) {
+                        std::this_thread::sleep_for(Milliseconds(1));
+                    }
+                }
+            }
+        }
+
+        std::atomic<int> numFramesReceived{0};
+    } clientPipe("transformThreadsClient"), serverPipe("transformThreadsServer");
+
+    TestSocketPair sockets;
+    const int streamFds[] = {sockets.client, sockets.server};
+    for (int fd : streamFds) {
+        // Fixed receive buffers (which disables their auto-tuning), so that the streams back up
+        // long before all the frames have been sent. They must still fit a few loopback segments
+        // (of up to 64KB), otherwise TCP stalls waiting for the window to open.
+        constexpr int kRecvBufSize = 256 * 1024;
+        SYSCALL(::setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &kRecvBufSize, sizeof(kRecvBufSize)));
+    }
+    {
+        // With a single transform thread per side, the delivery of the frames being sent (which
+        // waits for space on the streams) must not hold up the frames being received
+        SocketProducerConsumer clientSocketPC("transformThreadsClient", uuidGen(), clientPipe,
+                                              CpuAffinity(), 1);
+        SocketProducerConsumer serverSocketPC("transformThreadsServer", boost::none, serverPipe,
+                                              CpuAffinity(), 1);
+        clientSocketPC.addSocket({std::move(sockets.client)});
+        serverSocketPC.addSocket({std::move(sockets.server)});
+
+        std::thread clientSender([&] { clientPipe.sendFrames(); });
+        std::thread serverSender([&] { serverPipe.sendFrames(); });
+        clientSender.join();
+        serverSender.join();
+
+        const auto deadline = std::chrono::steady_clock::now() + Seconds(30);
+        while ((clientPipe.numFramesReceived < kNumFrames ||
+                serverPipe.numFramesReceived < kNumFrames) &&
+               std::chrono::steady_clock::now() < deadline)
+            std::this_thread::sleep_for(Milliseconds(10));
+        TLOG << "Client received " << clientPipe.numFramesReceived << ", server received "
+             << serverPipe.numFramesReceived;
+        CHECK(clientPipe.numFramesReceived == kNumFrames);
+        CHECK(serverPipe.numFramesReceived == kNumFrames);
+
+        for (int fd : streamFds)
+            ::shutdown(fd, SHUT_RDWR);
+    }
+}
 BOOST_AUTO_TEST_SUITE_END()
 
 } // namespace